@@ -5,11 +5,99 @@
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
 
+//a dynarray reached through the pointer it owns, so two of them swap by exchanging pointers
+//without copying the elements or depending on how dynarray lays itself out; it converts to the
+//dynarray for functions that take one
+template <class T> class LSystemArray
+{
+public:
+    LSystemArray() :array_(new octet::dynarray<T>()){}
+    LSystemArray(const LSystemArray& other) :array_(new octet::dynarray<T>(*other.array_)){}
+    ~LSystemArray()
+    {
+        delete array_;
+    }
+    void operator =(const LSystemArray& other)
+    {
+        *array_ = *other.array_;
+    }
+    void operator =(const octet::dynarray<T>& other)
+    {
+        *array_ = other;
+    }
+    void Swap(LSystemArray& other)
+    {
+        octet::dynarray<T>* array = array_;
+        array_ = other.array_;
+        other.array_ = array;
+    }
+
+    operator octet::dynarray<T>&()
+    {
+        return *array_;
+    }
+    operator const octet::dynarray<T>&() const
+    {
+        return *array_;
+    }
+
+    void resize(unsigned size)
+    {
+        array_->resize(size);
+    }
+    void reset()
+    {
+        array_->reset();
+    }
+    void push_back(const T& item)
+    {
+        array_->push_back(item);
+    }
+    void pop_back()
+    {
+        array_->pop_back();
+    }
+    T& back()
+    {
+        return array_->back();
+    }
+    const T& back() const
+    {
+        return ((const octet::dynarray<T>*)array_)->back();
+    }
+    T* data()
+    {
+        return array_->data();
+    }
+    const T* data() const
+    {
+        return ((const octet::dynarray<T>*)array_)->data();
+    }
+    unsigned size() const
+    {
+        return array_->size();
+    }
+    T& operator[](int i)
+    {
+        return (*array_)[i];
+    }
+    const T& operator[](int i) const
+    {
+        return (*(const octet::dynarray<T>*)array_)[i];
+    }
+
+private:
+    octet::dynarray<T>* array_;
+};
+
 //a data structure containing information about a single recursion of the LSystem
 class LSystemState
 {
 public:
-    LSystemState(LSystemState* prev = NULL) : readIndex(0), prevState(prev), level(0)
+    enum { MAX_PARAMS = 4 };
+
+    LSystemState(LSystemState* prev = NULL) : readIndex(0), prevState(prev), level(0), packedCount_(0), packBits_(0), grammar_(false),
+        paramCount_(0)
     {
 
     }
@@ -23,6 +111,69 @@ public:
         userPointer = cpy.userPointer;
         state_.resize(cpy.state_.size());
         memcpy(state_.data(), cpy.state_.data(), cpy.state_.size());
+        packed_.resize(cpy.packed_.size());
+        memcpy(packed_.data(), cpy.packed_.data(), cpy.packed_.size());
+        packedCount_ = cpy.packedCount_;
+        packBits_ = cpy.packBits_;
+        grammar_ = cpy.grammar_;
+        paramCount_ = cpy.paramCount_;
+        for (int k = 0; k < MAX_PARAMS; ++k)
+        {
+            params_[k] = cpy.params_[k];
+        }
+        spanRead_ = cpy.spanRead_;
+        spanWrite_ = cpy.spanWrite_;
+    }
+
+    LSystemState(LSystemState&& mv) : readIndex(0), prevState(NULL), level(0), packedCount_(0), packBits_(0), grammar_(false),
+        paramCount_(0)
+    {
+        Swap(mv);
+    }
+
+    void operator =(LSystemState&& mv)
+    {
+        Swap(mv);
+    }
+
+    //exchanges levels including their buffers, nothing is copied
+    void Swap(LSystemState& other)
+    {
+        int i = readIndex; readIndex = other.readIndex; other.readIndex = i;
+        i = level; level = other.level; other.level = i;
+        const LSystemState* p = prevState; prevState = other.prevState; other.prevState = p;
+        state_.Swap(other.state_);
+        packed_.Swap(other.packed_);
+        i = packedCount_; packedCount_ = other.packedCount_; other.packedCount_ = i;
+        i = packBits_; packBits_ = other.packBits_; other.packBits_ = i;
+        bool g = grammar_; grammar_ = other.grammar_; other.grammar_ = g;
+        i = paramCount_; paramCount_ = other.paramCount_; other.paramCount_ = i;
+        for (int k = 0; k < MAX_PARAMS; ++k)
+        {
+            params_[k].Swap(other.params_[k]);
+        }
+        spanRead_.Swap(other.spanRead_);
+        spanWrite_.Swap(other.spanWrite_);
+    }
+
+    //empties the level for reuse after prev, the buffers keep their capacity
+    void Recycle(LSystemState* prev)
+    {
+        readIndex = 0;
+        level = 0;
+        prevState = prev;
+        state_.resize(0);
+        packed_.resize(0);
+        packedCount_ = 0;
+        packBits_ = 0;
+        grammar_ = false;
+        for (int k = 0; k < paramCount_; ++k)
+        {
+            params_[k].resize(0);
+        }
+        paramCount_ = 0;
+        spanRead_.resize(0);
+        spanWrite_.resize(0);
     }
 
     void operator =(const LSystemState& cpy)
@@ -34,12 +185,74 @@ public:
         state_.resize(0);
         state_.resize(cpy.state_.size());
         memcpy(state_.data(), cpy.state_.data(), cpy.state_.size());
+        packed_.resize(0);
+        packed_.resize(cpy.packed_.size());
+        memcpy(packed_.data(), cpy.packed_.data(), cpy.packed_.size());
+        packedCount_ = cpy.packedCount_;
+        packBits_ = cpy.packBits_;
+        grammar_ = cpy.grammar_;
+        paramCount_ = cpy.paramCount_;
+        for (int k = 0; k < MAX_PARAMS; ++k)
+        {
+            params_[k] = cpy.params_[k];
+        }
+        spanRead_ = cpy.spanRead_;
+        spanWrite_ = cpy.spanWrite_;
+    }
+
+    bool IsPacked() const
+    {
+        return packBits_ != 0;
+    }
+
+    //levels stored as a grammar only know their length through LSystem::GetLevelLength
+    bool IsGrammar() const
+    {
+        return grammar_;
+    }
+
+    int GetSymbolCount() const
+    {
+        return grammar_ ? 0 : packBits_ ? packedCount_ : state_.size();
+    }
+
+    //bytes used by the symbols of this level in whichever form it is stored, parameters included
+    int GetByteSize() const
+    {
+        return grammar_ ? 0 : packBits_ ? packed_.size() : state_.size() * (1 + paramCount_ * sizeof(float));
+    }
+
+    //parameter slot k of symbol i, parametric levels only
+    float GetParameter(int i, int k) const
+    {
+        return params_[k][i];
     }
 
     int readIndex;//variable indicating the read position in the previous state
     int level;//level of recursion depth
     const LSystemState* prevState;//last state behind it
-    octet::dynarray<char> state_;//
+    LSystemArray<char> state_;//
+
+    //packed levels leave state_ empty and store symbol codes here instead, packBits_ per symbol,
+    //symbol i in bits i*packBits_ onwards counting from the low bit of each byte
+    LSystemArray<unsigned char> packed_;
+    int packedCount_;
+    int packBits_;
+
+    //grammar levels store nothing, the level is the axiom expanded level times through the
+    //(symbol, depth) nodes LSystem shares across the whole history
+    bool grammar_;
+
+    //parametric levels keep parameter slot k of every symbol in params_[k], each column runs
+    //parallel to state_, symbols with fewer parameters leave their extra slots 0
+    LSystemArray<float> params_[MAX_PARAMS];
+    int paramCount_;
+
+    //symbol spanRead_[k] of the previous level writes its production from spanWrite_[k] of this one,
+    //at least every LSystem::SPAN_BLOCK symbols; plain byte levels keep these so a rule edit can
+    //splice the runs it does not touch through instead of rewriting them
+    LSystemArray<int> spanRead_;
+    LSystemArray<int> spanWrite_;
 
     static void* userPointer;
 };
@@ -95,6 +308,58 @@ public:
 private:
 };
 
+//the occurrences of batched symbols in one run of a level being derived, symbols[i] was read at
+//readIndex[i] of prevState and its production starts at writeIndex[i] of state, already written;
+//runs are disjoint so a function may swap the symbols of its own productions for other symbols of
+//the grammar but never resize the level, and under REWRITE_PARALLEL it is called from the pool's
+//threads at the same time
+struct LSystemBatch
+{
+    const int* readIndex;
+    const int* writeIndex;
+    const char* symbols;
+    int count;
+    int level;
+    const LSystemState* prevState;
+    LSystemState* state;
+    void* context;//as given to LSystem::AddBatchFunction
+};
+
+//what the turtle drew over one chunk of symbols, recorded by a visualizer on the interpret
+//stage of a pipelined visualize and built into geometry on the mesh stage, the record layout
+//is up to the visualizer
+struct LSystemGeometryBatch
+{
+    LSystemGeometryBatch() :used(0){}
+
+    //keeps the buffer for the next chunk
+    void Clear()
+    {
+        used = 0;
+    }
+    template<class T> void Append(const T& record)
+    {
+        if (used + (int)sizeof(T) > bytes.size())
+        {
+            bytes.resize(bytes.size() * 2 > used + (int)sizeof(T) ? bytes.size() * 2 : used + sizeof(T) * 64);
+        }
+        memcpy(bytes.data() + used, &record, sizeof(T));
+        used += sizeof(T);
+    }
+    template<class T> int Count() const
+    {
+        return used / sizeof(T);
+    }
+    //copied out as the records are only byte aligned
+    template<class T> void Read(int index, T& record) const
+    {
+        memcpy(&record, bytes.data() + index * sizeof(T), sizeof(T));
+    }
+
+    octet::dynarray<char> bytes;
+    int used;
+};
+
 //an abstract base class for creation of a intergrated graphics tool, not necessary
 class LSystemVisualizer
 {
@@ -114,726 +379,6850 @@ public:
 
     virtual void Finished(){};
 
+    //a run of count DrawLines and a net turn of turns RotatePositives, RotateNegatives when negative,
+    //which is how a level lowered to LSystemOpcodes reaches the visualizer; the defaults repeat the single calls
+    virtual void DrawLines(int count)
+    {
+        for (int i = 0; i < count; ++i)DrawLine();
+    }
+    virtual void Turn(int turns)
+    {
+        for (; turns > 0; --turns)RotatePositive();
+        for (; turns < 0; ++turns)RotateNegative();
+    }
+    //whether a RotatePositive and a RotateNegative undo each other with these settings,
+    //only then are runs of mixed rotations folded into one Turn
+    virtual bool CanCancelTurns(const LSystemDrawInfo* info) const { return false; }
+
+    //vertices emitted so far, reported as progress while a level is visualized,
+    //a pipelined visualize calls this from the turtle's thread
+    virtual int GetVertexCount() const { return 0; }
+
+    //visualizers that split the turtle from the geometry record what they draw into the batch
+    //while one is set and build it later in BuildGeometry, which a pipelined visualize calls on
+    //another thread in the order the batches were recorded, the rest build as they go
+    virtual bool CanDefer() const { return false; }
+    virtual void SetBatch(LSystemGeometryBatch* batch){}
+    virtual void BuildGeometry(const LSystemGeometryBatch& batch){}
+
+    //called before the key of every symbol of a parametric level with that symbol's parameters
+    virtual void SetParameters(const float* params, int count){};
+
+    //visualizers whose turtle can be run a chunk of the level at a time, see LSystem::VisualizeParallel;
+    //the number of summary passes they need, 0 when the turtle can't be split
+    virtual int GetSplitPasses() const { return 0; }
+    //called after Init with the number of chunks the level was cut into
+    virtual void BeginSplit(int chunks){}
+    //each pass is called for every chunk at once on the pool's threads with the chunk's LSystem::KEY_SYMBOLS,
+    //then ScanSplit once on the calling thread with the summaries of every chunk in
+    virtual void SummarizeChunk(int pass, int chunk, const unsigned char* keys, int count){}
+    virtual void ScanSplit(int pass){}
+    //after the last scan every chunk draws its own part of the geometry, again all at once
+    virtual void EmitChunk(int chunk, const unsigned char* keys, int count){}
+
     virtual void SetState(LSystemState* state) = 0{};
 };
 
-//the recursion engine for use in parsing each LSystem recursion to the next, holds most of the information about rules
-class LSystem
-{ //make these variables private
+//the turtle commands of a level lowered to a compact stream: a run of draws is one opcode with a count,
+//so is a run of rotations, folded to the net turn when the visualizer says they cancel, and symbols that
+//draw nothing leave nothing; record it by visualizing a level into it and replay it into any visualizer,
+//parameters are not recorded so parametric levels have to be visualized directly
+class LSystemOpcodes final : public LSystemVisualizer
+{
 public:
-    enum KEY_SYMBOLS{
-        KEY_NULL = 0,
-        KEY_DRAW,
-        KEY_PLUS_ROTATE,
-        KEY_MINUS_ROTATE,
-        KEY_PUSH,
-        KEY_POP,
-        KEY_ROTATE,
-        KEY_LEAF,
-        KEY_CUSTOM,
+    enum OPCODE { OP_DRAW, OP_TURN, OP_PUSH, OP_POP, OP_LEAF, OP_ROTATE, OP_CUSTOM };
+    enum { OP_BITS = 3, OP_MASK = 7, MAX_RUN = (1 << 27) - 1 };
 
-        KEY_MAX
-    };
+    LSystemOpcodes() :cancelTurns_(false), draws_(0), turns_(0), symbols_(0), state_(NULL), info_(NULL), finished_(false){}
 
+    //when set a + and a - cancel out, otherwise only rotations of the same sign are folded
+    void SetCancelTurns(bool cancel)
+    {
+        cancelTurns_ = cancel;
+    }
 
-    typedef void(*VarFunc)(LSystemState*);
-public:
-    LSystem():info_(NULL){}
-    ~LSystem(){ delete(info_); }
-
-    void Iterate(int n)
+    void SetState(LSystemState* state)override
     {
-        for (int i = 0; i < n; ++i)
-        {
-            Iterate();
-        }
+        Clear();
+        state_ = state;
     }
-    void Iterate()
+    void Init(LSystemDrawInfo* info)override
     {
-        assert(stateVec_.size()>0);
-        stateVec_.push_back(new LSystemState(stateVec_.back()));
-        stateVec_.back()->level = stateVec_.size()-1;
-        const LSystemState* prevState = stateVec_.back()->prevState;
-        assert(prevState->state_.size() > 0);
-        for (int i = 0; i < prevState->state_.size(); ++i)
-        {
-            stateVec_.back()->readIndex = i;
-            ProcessSymbol(prevState->state_[i]);
-        }
+        info_ = info;
     }
-
-    void Decrement(int n){
-        for (int i = 0; i < n; ++i)
-        {
-            Decrement();
-        }
+    void DrawLine()override
+    {
+        DrawLines(1);
     }
-    void Decrement()
+    void DrawLines(int count)override
     {
-        stateVec_.pop_back();
+        if (turns_)FlushTurns();
+        draws_ += count;
+        symbols_ += count;
+        if (draws_ >= MAX_RUN)FlushDraws();
     }
-
-    void Collapse()
+    void RotatePositive()override
     {
-        *stateVec_.data() = stateVec_.back();
-        stateVec_.resize(1);
-        stateVec_.back()->prevState = nullptr;
+        Turn(1);
+    }
+    void RotateNegative()override
+    {
+        Turn(-1);
+    }
+    void Turn(int turns)override
+    {
+        if (draws_)FlushDraws();
+        if (turns_ && !cancelTurns_ && (turns_ > 0) != (turns > 0))FlushTurns();
+        turns_ += turns;
+        symbols_ += turns > 0 ? turns : -turns;
+        if (turns_ >= MAX_RUN || turns_ <= -MAX_RUN)FlushTurns();
+    }
+    void PushStack()override
+    {
+        Emit(OP_PUSH);
+    }
+    void PopStack()override
+    {
+        Emit(OP_POP);
+    }
+    void DrawLeaf()override
+    {
+        Emit(OP_LEAF);
+    }
+    void Rotate()override
+    {
+        Emit(OP_ROTATE);
+    }
+    void Custom()override
+    {
+        Emit(OP_CUSTOM);
+    }
+    void Finished()override
+    {
+        Flush();
+        finished_ = true;
     }
 
-    void Visualize(LSystemVisualizer* viz){
-        if (viz)
-        {
-            LSystemState* state = stateVec_.back();
-            viz->SetState(state);
-            info_ ? viz->Init(info_) : viz->Init(NULL);
-            for (int i = 0; i < state->state_.size(); ++i)
-            {
-                CallKey(referenceMap_[state->state_[i]].key, viz);
-            }
-            viz->Finished();
-        }
+    //ends the open runs of draws and rotations
+    void Flush()
+    {
+        if (draws_)FlushDraws();
+        if (turns_)FlushTurns();
     }
 
-    void AddAlphabetSymbol(char symb)
+    void Clear()
     {
-        alphabet_.push_back(symb);
+        ops_.resize(0);
+        draws_ = 0;
+        turns_ = 0;
+        symbols_ = 0;
+        finished_ = false;
     }
 
-    void SetAxiom(const char* c, int size)
+    //calls viz for every opcode ended so far, without SetState, Init or Finished
+    template<class Visualizer>
+    void ReplayOps(Visualizer* viz) const
     {
-        if (stateVec_.size() == 0)
+        const int* ops = ops_.data();
+        for (int i = 0; i < ops_.size(); ++i)
         {
-            axiom_.resize(size);
-            memcpy(axiom_.data(), c, size);
-            stateVec_.push_back(new LSystemState());
-            stateVec_.back()->state_ = axiom_;
-            stateVec_.back()->level = 1;
+            int count = ops[i] >> OP_BITS;
+            switch (ops[i] & OP_MASK)
+            {
+            case(OP_DRAW) :
+                viz->DrawLines(count);
+                break;
+            case(OP_TURN) :
+                viz->Turn(count);
+                break;
+            case(OP_PUSH) :
+                viz->PushStack();
+                break;
+            case(OP_POP) :
+                viz->PopStack();
+                break;
+            case(OP_LEAF) :
+                viz->DrawLeaf();
+                break;
+            case(OP_ROTATE) :
+                viz->Rotate();
+                break;
+            case(OP_CUSTOM) :
+                viz->Custom();
+                break;
+            }
         }
     }
 
-    void AddBasicRules(char c, octet::string& str)
+    //replays the ended opcodes and drops them, the open runs stay open so recording can carry on
+    template<class Visualizer>
+    void Drain(Visualizer* viz)
     {
-        referenceMap_[c].str = str;
+        ReplayOps(viz);
+        ops_.resize(0);
     }
 
-    void SetKeyDecl(char c, KEY_SYMBOLS k)
+    //replays the recording as visualizing the level itself would
+    template<class Visualizer>
+    void Replay(Visualizer* viz) const
     {
-        referenceMap_[c].key = k;
+        viz->SetState(state_);
+        viz->Init(info_);
+        ReplayOps(viz);
+        if (finished_)viz->Finished();
     }
 
-    void AddRuleFunction(char c, VarFunc func)
+    int GetOpCount() const
     {
-        referenceMap_[c].func = func;
+        return ops_.size();
     }
-
-    void SetDrawInfo(LSystemDrawInfo* info)
+    //draws and rotations recorded, what the opcodes stand in for
+    unsigned long long GetTurtleSymbols() const
     {
-        info_ = info;
+        return symbols_;
     }
 
-    LSystemDrawInfo* GetDrawInfo(){
-        return info_;
+private:
+    void Emit(int op)
+    {
+        Flush();
+        ops_.push_back(op | (1 << OP_BITS));
+        ++symbols_;
     }
-
-    const LSystemState* GetCurrentState()
+    void FlushDraws()
     {
-        return stateVec_.back();
+        ops_.push_back(OP_DRAW | (draws_ << OP_BITS));
+        draws_ = 0;
     }
-private:
-    struct SymbolRef
+    void FlushTurns()
     {
-        SymbolRef() : func(NULL), key(KEY_NULL){}
-        octet::string str;
-        VarFunc func;
-        KEY_SYMBOLS key;
-    };
+        if (turns_)ops_.push_back(OP_TURN | (int)((unsigned int)turns_ << OP_BITS));
+        turns_ = 0;
+    }
 
-private:
+    octet::dynarray<int> ops_;//opcode in the low OP_BITS, count above
+    bool cancelTurns_;
+    int draws_;//open runs
+    int turns_;
+    unsigned long long symbols_;
+    LSystemState* state_;
+    LSystemDrawInfo* info_;
+    bool finished_;
+};
 
+//stands in front of viz while LSystem visualizes with turtle lowering, recording into ops and
+//replaying them into viz a block at a time so the level is never lowered whole
+template<class Visualizer>
+class LSystemLowering final : public LSystemVisualizer
+{
+public:
+    enum { BLOCK = 1 << 12 };
 
-    void ProcessSymbol(const char c)
-    {
-        LSystemState* state = stateVec_.back();
-        SymbolRef r = referenceMap_[c];
-        if (r.str.size())
-        {
-            if (state->state_.size() > 0)
-            {
-                int oldSize = state->state_.size();
-                state->state_.resize(state->state_.size() + r.str.size());
-                memcpy(state->state_.data() + oldSize, r.str.c_str(), r.str.size());
-            }
-            else
-            {
-                state->state_.resize(r.str.size());
-                memcpy(state->state_.data(), r.str.c_str(), r.str.size());
-            }
-        }
-        else
-        {
-            state->state_.push_back(c);
-        }
+    LSystemLowering(Visualizer* viz, LSystemOpcodes* ops) :viz_(viz), ops_(ops){}
 
-        if (r.func)
-        {
-            r.func(state);
-        }
+    void SetState(LSystemState* state)override
+    {
+        ops_->Clear();
+        viz_->SetState(state);
     }
-
-    void CallKey(int key,LSystemVisualizer* viz)
+    void Init(LSystemDrawInfo* info)override
     {
-        switch (key)
-        {
-        case(KEY_DRAW) :
-            viz->DrawLine();
-            break;
-        case(KEY_PLUS_ROTATE) :
-            viz->RotatePositive();
-            break;
-        case(KEY_MINUS_ROTATE) :
-            viz->RotateNegative();
-            break;
-        case(KEY_PUSH) :
-            viz->PushStack();
-            break;
-        case(KEY_POP) :
-            viz->PopStack();
-            break;
-        case(KEY_LEAF) :
-            viz->DrawLeaf();
-            break;
-        case(KEY_ROTATE) :
-            viz->Rotate();
-            break;
-        case(KEY_CUSTOM) :
-            viz->Custom();
-            break;
-        }
+        viz_->Init(info);
+        ops_->SetCancelTurns(viz_->CanCancelTurns(info));
+    }
+    void DrawLine()override
+    {
+        ops_->DrawLine();
+    }
+    void RotatePositive()override
+    {
+        ops_->RotatePositive();
+        Check();
+    }
+    void RotateNegative()override
+    {
+        ops_->RotateNegative();
+        Check();
+    }
+    void PushStack()override
+    {
+        ops_->PushStack();
+        Check();
+    }
+    void PopStack()override
+    {
+        ops_->PopStack();
+        Check();
+    }
+    void DrawLeaf()override
+    {
+        ops_->DrawLeaf();
+        Check();
+    }
+    void Rotate()override
+    {
+        ops_->Rotate();
+        Check();
+    }
+    void Custom()override
+    {
+        ops_->Custom();
+        Check();
+    }
+    void Finished()override
+    {
+        Drain();
+        viz_->Finished();
+    }
+    int GetVertexCount() const override
+    {
+        return viz_->GetVertexCount();
+    }
+    bool CanDefer() const override
+    {
+        return viz_->CanDefer();
+    }
+    //what was recorded belongs to the batch being left
+    void SetBatch(LSystemGeometryBatch* batch)override
+    {
+        Drain();
+        viz_->SetBatch(batch);
+    }
+    void BuildGeometry(const LSystemGeometryBatch& batch)override
+    {
+        viz_->BuildGeometry(batch);
+    }
+    void SetParameters(const float* params, int count)override
+    {
+        Drain();
+        viz_->SetParameters(params, count);
     }
 
 private:
-    LSystemDrawInfo* info_;
+    void Check()
+    {
+        if (ops_->GetOpCount() >= BLOCK)ops_->Drain(viz_);
+    }
+    void Drain()
+    {
+        ops_->Flush();
+        ops_->Drain(viz_);
+    }
 
-    octet::dynarray<LSystemState*> stateVec_;
-    octet::hash_map<char, SymbolRef> referenceMap_;
-    octet::dynarray<char> axiom_;
-    octet::dynarray<char> alphabet_;
+    Visualizer* viz_;
+    LSystemOpcodes* ops_;
 };
 
-#include <fstream>
-//the importer kept seperate from the LSystem for reduction in function count and use
-//only one public function, to read into an LSystem
-class LSystemImporter
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <chrono>
+//a fixed set of worker threads running indexed tasks, each worker owns a slice of the
+//indices and steals from the back of the other slices once its own runs dry
+class LSystemThreadPool
 {
 public:
-    LSystemImporter(){}
-    ~LSystemImporter(){}
+    typedef std::function<void(int)> Task;
 
-    bool Load(LSystem* lSys, const char* filename)
+    //threads counts the calling thread too, 0 uses every hardware thread
+    LSystemThreadPool(int threads = 0) :task_(NULL), generation_(0), active_(0), quit_(false)
     {
-        std::fstream file;
-
-        file.open(filename, std::ios::in);
-        if (!file.is_open())
+        if (threads <= 0)threads = std::thread::hardware_concurrency();
+        if (threads <= 0)threads = 1;
+        queues_ = new Queue[threads];
+        queueCount_ = threads;
+        for (int i = 1; i < threads; ++i)
         {
-            assert(0);
+            workers_.push_back(std::thread(&LSystemThreadPool::WorkerLoop, this, i));
         }
-
-        file.seekg(0, file.end);
-        int length = file.tellg();
-        file.seekg(0, file.beg);
-
-        read_.resize(length);
-        file.read(read_.data(), length);
-        CleanWhiteSpace();
-
-        file.close();
-
-        octet::string str(read_.data(), read_.size());
-        bool check = false;
-        check = LoadKeyDeclerations(lSys, str);
-        if (!check)return false;
-        check = LoadAlphabet(lSys, str);
-        if (!check)return false;
-        check = LoadAxiom(lSys, str);
-        if (!check)return false;
-        check = LoadRules(lSys, str);
-        if (!check)return false;
-        check = LoadDrawInfo(lSys, str);
-        if (!check) return false;
-
-        read_.resize(0);
-        tempAlphabet_.resize(0);
-
-        return true;
     }
-private:
-    //load the symbol alphabet from the text file containing all non-inbuilt symbols in the L system
-    //a local version is stored for error checking in the Axiom and Rule sections
-    bool LoadAlphabet(LSystem* lSys, octet::string& str)
+    ~LSystemThreadPool()
     {
-        int startLoc = str.find("Alphabet");
-
-        if (startLoc == -1)
         {
-            printf("%s", "Could not find the Alphabet subsection.\n");
-            assert(false);
-            return false;
+            std::lock_guard<std::mutex> lock(wakeLock_);
+            quit_ = true;
         }
-        startLoc += 8;//size of "Alphabet"
-        int endLoc = FindSymbolAfter('}', startLoc);
-        if (endLoc == -1)
+        wake_.notify_all();
+        for (int i = 0; i < workers_.size(); ++i)
         {
-            printf("%s", "No close brackets after Alphabet section.\n");
-            assert(false);
-            return false;
+            workers_[i].join();
         }
-        int counter = 0;
+        delete[] queues_;
+    }
 
-        for (int i = startLoc; i < endLoc; ++i)
+    int GetThreadCount() const
+    {
+        return queueCount_;
+    }
+
+    //runs task(0) to task(count-1) across the pool and returns once all of them are done
+    void Run(int count, const Task& task)
+    {
+        if (count <= 0)return;
         {
-            if (IsNotGrammer(read_[i]))
+            std::lock_guard<std::mutex> lock(wakeLock_);
+            //a worker late from the last run may still be popping, so the task and count go out
+            //before the ranges and each range is set under the lock Pop and Steal read it with;
+            //whoever takes an index of this run then sees this run's task_ and remaining_
+            task_ = &task;
+            remaining_ = count;
+            for (int i = 0; i < queueCount_; ++i)
             {
-                lSys->AddAlphabetSymbol(read_[i]);
-                tempAlphabet_.push_back(read_[i]);
-                ++counter;
+                std::lock_guard<std::mutex> queueLock(queues_[i].lock);
+                queues_[i].begin = (int)((long long)count * i / queueCount_);
+                queues_[i].end = (int)((long long)count * (i + 1) / queueCount_);
             }
+            ++generation_;
         }
-        return true;
+        wake_.notify_all();
+        Work(0);
+        std::unique_lock<std::mutex> lock(wakeLock_);
+        done_.wait(lock, [this]{ return remaining_ == 0 && active_ == 0; });
+        task_ = NULL;
     }
 
-    //load the axiom, fairly simple, find the first string and load all of it
-    //grammer inside the axiom will be ignored, but it will complain
-    bool LoadAxiom(LSystem* lSys, octet::string& str)
+private:
+    struct Queue
     {
-        int startLoc = str.find("Axiom");
+        Queue() :begin(0), end(0){}
+        std::mutex lock;
+        int begin;
+        int end;
+    };
 
-        if (startLoc == -1)
-        {
-            printf("%s\n", "Could not find the Axiom subsection.\n");
-            assert(false);
-            return false;
-        }
-        startLoc += 5;//size of "Axiom"
-        int endLoc = FindSymbolAfter('}', startLoc);
-        if (endLoc == -1)
-        {
-            printf("%s\n", "No close brackets after Axiom section.\n");
-            assert(false);
-            return false;
-        }
-        octet::dynarray<char> arr;
-        for (int i = startLoc; i < endLoc; ++i)
+    void WorkerLoop(int worker)
+    {
+        int seen = 0;
+        for (;;)
         {
-            if (IsNotGrammer(read_[i]))
             {
-                if (IsInAlphabet(read_[i]))
-                {
-                    arr.push_back(read_[i]);
-                }
-                else
-                {
-                    printf("%s%c%s\n", "Symbol ", read_[i], " is not in the Alphabet, but is in the Axiom");
-                }
+                std::unique_lock<std::mutex> lock(wakeLock_);
+                wake_.wait(lock, [&]{ return quit_ || generation_ != seen; });
+                if (quit_)return;
+                seen = generation_;
+                ++active_;
             }
-            else if (read_[i] == ';')//if we find semicolon, be consistant and exit early
+            Work(worker);
             {
-                break;
+                std::lock_guard<std::mutex> lock(wakeLock_);
+                --active_;
             }
-            else //otherwise complain about grammer inside Axiom, we dont care but they should
+            done_.notify_all();
+        }
+    }
+
+    void Work(int worker)
+    {
+        int index;
+        while (Pop(worker, index) || Steal(worker, index))
+        {
+            (*task_)(index);
+            if (--remaining_ == 0)
             {
-                if (arr.size() > 0)
-                {
-                    printf("%s\n", "Grammer found in Axiom will be ignored, consider removing it.");
-                }
+                std::lock_guard<std::mutex> lock(wakeLock_);
+                done_.notify_all();
             }
-        }//END OF FOR
-        if (arr.size() == 0)
-        {
-            printf("%s\n", "No axiom was found");
-            assert(false);
-            return false;
         }
-        lSys->SetAxiom(arr.data(), arr.size());
+    }
+
+    bool Pop(int worker, int& index)
+    {
+        Queue& q = queues_[worker];
+        std::lock_guard<std::mutex> lock(q.lock);
+        if (q.begin == q.end)return false;
+        index = q.begin++;
         return true;
     }
 
-    //loads the simple symbol replacement rules
-    //will only read single chracter replacements ie(F=FF is fine, FF=FF not ok(read as F=FF))
-    bool LoadRules(LSystem* lSys, octet::string& str)
+    bool Steal(int worker, int& index)
     {
-        int startLoc = str.find("Rules");
-        if (startLoc == -1)
+        for (int i = 1; i < queueCount_; ++i)
         {
-            printf("%s", "Could not find the Rules subsection.\n");
-            assert(false);
-            return false;
+            Queue& q = queues_[(worker + i) % queueCount_];
+            std::lock_guard<std::mutex> lock(q.lock);
+            if (q.begin != q.end)
+            {
+                index = --q.end;
+                return true;
+            }
         }
-        startLoc += 6;//size of "Rules"
-        int endLoc = FindSymbolAfter('}', startLoc);
-        if (endLoc == -1)
+        return false;
+    }
+
+    Queue* queues_;
+    int queueCount_;
+    std::vector<std::thread> workers_;
+
+    std::mutex wakeLock_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const Task* task_;
+    int generation_;
+    int active_;
+    std::atomic<int> remaining_;
+    bool quit_;
+};
+
+//a bounded queue between two threads, Push blocks while it is full and Pop while it is empty,
+//Close wakes both sides for good; the seconds each side spent blocked are kept for stall reporting
+template<class T> class LSystemQueue
+{
+public:
+    LSystemQueue(int capacity) :pushWait(0), popWait(0), capacity_(capacity), closed_(false){}
+
+    //false once the queue is closed
+    bool Push(const T& item)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (items_.size() >= capacity_ && !closed_)
         {
-            printf("%s", "No close brackets after Rules section.\n");
-            assert(false);
-            return false;
+            auto start = std::chrono::high_resolution_clock::now();
+            notFull_.wait(lock, [this]{ return items_.size() < capacity_ || closed_; });
+            pushWait += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
         }
+        if (closed_)return false;
+        items_.push_back(item);
+        notEmpty_.notify_one();
+        return true;
+    }
 
-        for (int i = startLoc; i < endLoc; ++i)
+    //false once the queue is closed and empty
+    bool Pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (items_.empty() && !closed_)
         {
-            if (read_[i] == '=')
-            {
-                char symbol(read_[i - 1]);
-                if (IsNotGrammer(symbol))
-                {
-                    if (IsInAlphabet(symbol))
-                    {
-                        int ruleEndLoc = FindSymbolAfter(';', i);
-                        if (ruleEndLoc>endLoc || ruleEndLoc == -1)
-                        {
-                            printf("%s%c%s\n", "No semicolon after ", symbol, "'s rule");
-                            assert(false);
-                            return false;
-                        }
-                        lSys->AddBasicRules(symbol, octet::string(&read_[i + 1], ruleEndLoc - 1 - i));// take the chracters till the ;, excluding the ;
-                        i = ruleEndLoc + 1;//skip the rule we just read for effiency
-                    }
-                    else
-                    {
-                        printf("%s%c%s\n", "Symbol ", symbol, " is not in Alphabet, but is in Rules");
-                    }
-                }
-            }//END OF GRAMMER
-        }//END OF FOR
+            auto start = std::chrono::high_resolution_clock::now();
+            notEmpty_.wait(lock, [this]{ return !items_.empty() || closed_; });
+            popWait += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        }
+        if (items_.empty())return false;
+        item = items_.front();
+        items_.pop_front();
+        notFull_.notify_one();
         return true;
     }
 
-    //loads any special key replacements, by default +,-,[,],F are reserved for special use
-    //Any of these can be overloaded with their own custom symbol
-    bool LoadKeyDeclerations(LSystem* lSys, octet::string& str)
+    void Close()
     {
+        std::lock_guard<std::mutex> lock(lock_);
+        closed_ = true;
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
 
-        int startLoc = str.find("KeyDecl");
-        lSys->SetKeyDecl('F', LSystem::KEY_DRAW);
-        lSys->SetKeyDecl('[', LSystem::KEY_PUSH);
-        lSys->SetKeyDecl(']', LSystem::KEY_POP);
-        lSys->SetKeyDecl('+', LSystem::KEY_PLUS_ROTATE);
-        lSys->SetKeyDecl('-', LSystem::KEY_MINUS_ROTATE);
+    double pushWait;//seconds Push waited for room
+    double popWait;//seconds Pop waited for an item
 
-        if (startLoc == -1)
-        {
-            return true;
-        }
-        startLoc += 7; //size of the string KeyDecl
-        int endLoc = FindSymbolAfter('}', startLoc);
-        if (endLoc == -1)
-        {
-            printf("%s", "No close brackets after KeyDecl section.\n");
-            assert(false);
-            return false;
-        }
+private:
+    std::mutex lock_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_;
+};
 
-        for (int i = startLoc; i < endLoc; ++i)
+//counters of a generation written by the thread running it and read by any other,
+//setting cancel stops LSystem::Iterate between levels and LSystem::Visualize between chunks
+struct LSystemProgress
+{
+    LSystemProgress() :symbols(0), vertices(0), cancel(false){}
+
+    void Reset()
+    {
+        symbols = 0;
+        vertices = 0;
+        cancel = false;
+    }
+
+    std::atomic<unsigned long long> symbols;//symbols derived or streamed
+    std::atomic<int> vertices;//vertices emitted by the visualizer
+    std::atomic<bool> cancel;
+};
+
+//x86 builds classify symbols 16 or 32 at a time, picked at runtime by what the CPU supports
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define LSYSTEM_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define LSYSTEM_TARGET_SSSE3
+#define LSYSTEM_TARGET_AVX2
+#else
+#define LSYSTEM_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define LSYSTEM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+enum LSYSTEM_SIMD{
+    LSYSTEM_SIMD_NONE = 0,
+    LSYSTEM_SIMD_SSSE3,
+    LSYSTEM_SIMD_AVX2,
+};
+
+inline LSYSTEM_SIMD LSystemDetectSimd()
+{
+#if defined(LSYSTEM_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool ssse3 = (info[2] & (1 << 9)) != 0;
+    bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if (maxLeaf >= 7 && osAvx)
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+    return avx2 ? LSYSTEM_SIMD_AVX2 : ssse3 ? LSYSTEM_SIMD_SSSE3 : LSYSTEM_SIMD_NONE;
+#elif defined(LSYSTEM_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))return LSYSTEM_SIMD_AVX2;
+    if (__builtin_cpu_supports("ssse3"))return LSYSTEM_SIMD_SSSE3;
+    return LSYSTEM_SIMD_NONE;
+#else
+    return LSYSTEM_SIMD_NONE;
+#endif
+}
+
+//index of the lowest set bit, m must not be 0
+inline int LSystemLowestBit(unsigned int m)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, m);
+    return (int)index;
+#else
+    return __builtin_ctz(m);
+#endif
+}
+
+//appends bit fields to a byte buffer low bit first, 64 bits at a time
+class LSystemBitWriter
+{
+public:
+    LSystemBitWriter(unsigned char* out) :out_(out), acc_(0), bits_(0){}
+
+    //value must fit in count bits, count is at most 64
+    void Append(unsigned long long value, int count)
+    {
+        acc_ |= value << bits_;
+        if (bits_ + count >= 64)
         {
-            if (read_[i] == '=')
+            memcpy(out_, &acc_, 8);
+            out_ += 8;
+            acc_ = bits_ ? value >> (64 - bits_) : 0;
+            bits_ = bits_ + count - 64;
+        }
+        else
+        {
+            bits_ += count;
+        }
+    }
+
+    void Flush()
+    {
+        memcpy(out_, &acc_, (bits_ + 7) / 8);
+        out_ += (bits_ + 7) / 8;
+        acc_ = 0;
+        bits_ = 0;
+    }
+
+private:
+    unsigned char* out_;
+    unsigned long long acc_;
+    int bits_;
+};
+
+//the left and right neighbours of every symbol of a level along its branch, bracketed
+//sub-branches are skipped and ignored symbols are never anyone's neighbour, so a context
+//lookup is one array read per context symbol; built in one pass each way
+class LSystemBracketIndex
+{
+public:
+    enum CLASS{
+        SYMBOL = 0,
+        IGNORED,//skipped when looking for a neighbour
+        PUSH,//opens a branch
+        POP,//closes a branch
+    };
+
+    //classes holds the CLASS of every byte value
+    void Build(const char* symbols, int size, const unsigned char classes[256])
+    {
+        left_.resize(size);
+        right_.resize(size);
+        match_.resize(size);
+        stack_.resize(0);
+
+        //a branch starts with the symbol before its bracket as left neighbour,
+        //and the symbols after the branch continue from that same symbol
+        int last = -1;
+        for (int i = 0; i < size; ++i)
+        {
+            match_[i] = -1;
+            left_[i] = last;
+            switch (classes[(unsigned char)symbols[i]])
             {
-                char newSymbol;
-                if (IsNotGrammer(read_[i - 1]))
+            case(SYMBOL) :
+                last = i;
+                break;
+            case(PUSH) :
+                stack_.push_back(i);
+                break;
+            case(POP) :
+                if (stack_.size() > 0)
                 {
-                    newSymbol = read_[i - 1];
-                    int end = FindSymbolAfter(';', i);
-                    octet::string key(&read_[i + 1], end - 1 - i);
-                    LSystem::KEY_SYMBOLS keyNum = KeyFromString(key);
-                    if (keyNum != LSystem::KEY_NULL)
-                    {
-                        lSys->SetKeyDecl(newSymbol, keyNum);
-                        i += key.size();
-                    }
-                    else
-                    {
-                        printf("%s%s%s\n", "Malformed KeyDecl assignment, ", key.c_str(), " not recognised");
-                    }
+                    int open = stack_.back();
+                    stack_.pop_back();
+                    match_[open] = i;
+                    match_[i] = open;
+                    last = left_[open];
+                    left_[i] = last;
                 }
-                else
+                break;
+            }
+        }
+
+        //the last symbol of a branch has no right neighbour, a symbol before a branch
+        //has the first symbol after the branch
+        stack_.resize(0);
+        int next = -1;
+        for (int i = size - 1; i >= 0; --i)
+        {
+            right_[i] = next;
+            switch (classes[(unsigned char)symbols[i]])
+            {
+            case(SYMBOL) :
+                next = i;
+                break;
+            case(POP) :
+                stack_.push_back(i);
+                next = -1;
+                break;
+            case(PUSH) :
+                if (stack_.size() > 0)
                 {
-                    printf("%s%c%s\n", "Malformed KeyDecl assignment, ", newSymbol, " is grammer");
-                   
+                    next = right_[stack_.back()];
+                    stack_.pop_back();
+                    right_[i] = next;
                 }
-            }//END OF READ IF
-        }//END OF FOR
+                break;
+            }
+        }
+    }
+
+    //-1 when there is no neighbour
+    int Left(int i) const
+    {
+        return left_[i];
+    }
+
+    int Right(int i) const
+    {
+        return right_[i];
+    }
+
+    //the matching bracket, -1 for unmatched brackets and other symbols
+    int Match(int i) const
+    {
+        return match_[i];
+    }
+
+    int GetSize() const
+    {
+        return left_.size();
+    }
+
+private:
+    octet::dynarray<int> left_;
+    octet::dynarray<int> right_;
+    octet::dynarray<int> match_;
+    octet::dynarray<int> stack_;
+};
+
+//one instruction of a compiled parameter expression, value is the constant or the parameter slot
+struct LSystemOp
+{
+    int code;
+    float value;
+};
+
+//parameter expressions compiled once to a small stack bytecode, evaluated a batch of
+//symbols at a time so each instruction is one tight loop over the batch
+class LSystemExpression
+{
+public:
+    enum OP{
+        OP_CONST = 0,
+        OP_PARAM,
+        OP_ADD,
+        OP_SUB,
+        OP_MUL,
+        OP_DIV,
+        OP_NEG,
+        OP_LESS,
+        OP_GREATER,
+    };
+    enum { MAX_DEPTH = 8, BATCH = 256 };
+
+    //appends the code of text to code, names holds the single letter formal parameters in slot order
+    //returns false and prints the problem when text is not an expression
+    static bool Compile(const char* text, int size, const char* names, int nameCount, octet::dynarray<LSystemOp>& code)
+    {
+        LSystemExpression parser(text, size, names, nameCount, code);
+        bool ok = parser.ParseCompare() && parser.pos_ == size;
+        if (!ok)
+        {
+            printf("%s%s\n", "Malformed parameter expression ", octet::string(text, size).c_str());
+        }
+        else if (parser.maxDepth_ > MAX_DEPTH)
+        {
+            printf("%s%s\n", "Parameter expression nests too deep ", octet::string(text, size).c_str());
+            ok = false;
+        }
+        return ok;
+    }
+
+    //out[j] is the expression for the symbol at rows[j], whose slot k parameter is columns[k][rows[j]],
+    //count is at most BATCH
+    static void Evaluate(const LSystemOp* code, int length, const float* const* columns, const int* rows, int count, float* out)
+    {
+        float stack[MAX_DEPTH][BATCH];
+        int top = -1;
+        for (int op = 0; op < length; ++op)
+        {
+            int opCode = code[op].code;
+            if (opCode == OP_CONST)
+            {
+                float* dst = stack[++top];
+                for (int j = 0; j < count; ++j)dst[j] = code[op].value;
+                continue;
+            }
+            if (opCode == OP_PARAM)
+            {
+                float* dst = stack[++top];
+                const float* column = columns[(int)code[op].value];
+                for (int j = 0; j < count; ++j)dst[j] = column[rows[j]];
+                continue;
+            }
+            if (opCode == OP_NEG)
+            {
+                float* a = stack[top];
+                for (int j = 0; j < count; ++j)a[j] = -a[j];
+                continue;
+            }
+            //binary operators fold the top entry into the one below it
+            float* a = stack[--top];
+            const float* b = stack[top + 1];
+            switch (opCode)
+            {
+            case(OP_ADD) :
+                for (int j = 0; j < count; ++j)a[j] += b[j];
+                break;
+            case(OP_SUB) :
+                for (int j = 0; j < count; ++j)a[j] -= b[j];
+                break;
+            case(OP_MUL) :
+                for (int j = 0; j < count; ++j)a[j] *= b[j];
+                break;
+            case(OP_DIV) :
+                for (int j = 0; j < count; ++j)a[j] /= b[j];
+                break;
+            case(OP_LESS) :
+                for (int j = 0; j < count; ++j)a[j] = a[j] < b[j] ? 1.0f : 0.0f;
+                break;
+            case(OP_GREATER) :
+                for (int j = 0; j < count; ++j)a[j] = a[j] > b[j] ? 1.0f : 0.0f;
+                break;
+            }
+        }
+        memcpy(out, stack[0], sizeof(float) * count);
+    }
+
+private:
+    LSystemExpression(const char* text, int size, const char* names, int nameCount, octet::dynarray<LSystemOp>& code) :
+        text_(text), size_(size), pos_(0), names_(names), nameCount_(nameCount), code_(code), depth_(0), maxDepth_(0){}
+
+    //compare := sum [('<' | '>') sum]
+    bool ParseCompare()
+    {
+        if (!ParseSum())return false;
+        if (pos_ < size_ && (text_[pos_] == '<' || text_[pos_] == '>'))
+        {
+            int op = text_[pos_++] == '<' ? OP_LESS : OP_GREATER;
+            if (!ParseSum())return false;
+            Emit(op, 0, -1);
+        }
+        return true;
+    }
+
+    //sum := product {('+' | '-') product}
+    bool ParseSum()
+    {
+        if (!ParseProduct())return false;
+        while (pos_ < size_ && (text_[pos_] == '+' || text_[pos_] == '-'))
+        {
+            int op = text_[pos_++] == '+' ? OP_ADD : OP_SUB;
+            if (!ParseProduct())return false;
+            Emit(op, 0, -1);
+        }
+        return true;
+    }
+
+    //product := unary {('*' | '/') unary}
+    bool ParseProduct()
+    {
+        if (!ParseUnary())return false;
+        while (pos_ < size_ && (text_[pos_] == '*' || text_[pos_] == '/'))
+        {
+            int op = text_[pos_++] == '*' ? OP_MUL : OP_DIV;
+            if (!ParseUnary())return false;
+            Emit(op, 0, -1);
+        }
         return true;
     }
 
-    bool LoadDrawInfo(LSystem* lSys, octet::string& str)
+    //unary := '-' unary | number | name | '(' compare ')'
+    bool ParseUnary()
+    {
+        if (pos_ >= size_)return false;
+        char c = text_[pos_];
+        if (c == '-')
+        {
+            ++pos_;
+            if (!ParseUnary())return false;
+            Emit(OP_NEG, 0, 0);
+            return true;
+        }
+        if (c == '(')
+        {
+            ++pos_;
+            if (!ParseCompare() || pos_ >= size_ || text_[pos_] != ')')return false;
+            ++pos_;
+            return true;
+        }
+        if ((c >= '0' && c <= '9') || c == '.')
+        {
+            int start = pos_;
+            while (pos_ < size_ && ((text_[pos_] >= '0' && text_[pos_] <= '9') || text_[pos_] == '.'))
+            {
+                ++pos_;
+            }
+            Emit(OP_CONST, (float)atof(octet::string(text_ + start, pos_ - start).c_str()), 1);
+            return true;
+        }
+        for (int k = 0; k < nameCount_; ++k)
+        {
+            if (names_[k] == c)
+            {
+                ++pos_;
+                Emit(OP_PARAM, (float)k, 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Emit(int code, float value, int push)
+    {
+        LSystemOp op;
+        op.code = code;
+        op.value = value;
+        code_.push_back(op);
+        depth_ += push;
+        if (depth_ > maxDepth_)maxDepth_ = depth_;
+    }
+
+    const char* text_;
+    int size_;
+    int pos_;
+    const char* names_;
+    int nameCount_;
+    octet::dynarray<LSystemOp>& code_;
+    int depth_;
+    int maxDepth_;
+};
+
+//FNV-1a over size bytes carried on from hash, start from LSYSTEM_HASH_SEED
+#define LSYSTEM_HASH_SEED 14695981039346656037ull
+inline unsigned long long LSystemHash(unsigned long long hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+//Philox 2x32 with 10 rounds, a counter based generator: the two outputs depend only on the key
+//and the counter, so any thread can draw the numbers for any position in any order
+inline void LSystemPhilox(unsigned int key, unsigned int counterHi, unsigned int counterLo, unsigned int out[2])
+{
+    unsigned int hi = counterHi;
+    unsigned int lo = counterLo;
+    for (int round = 0; round < 10; ++round)
+    {
+        unsigned long long product = (unsigned long long)0xD256D193u * hi;
+        hi = (unsigned int)(product >> 32) ^ key ^ lo;
+        lo = (unsigned int)product;
+        key += 0x9E3779B9u;
+    }
+    out[0] = hi;
+    out[1] = lo;
+}
+
+#include <chrono>
+//the recursion engine for use in parsing each LSystem recursion to the next, holds most of the information about rules
+class LSystem
+{ //make these variables private
+public:
+    enum KEY_SYMBOLS{
+        KEY_NULL = 0,
+        KEY_DRAW,
+        KEY_PLUS_ROTATE,
+        KEY_MINUS_ROTATE,
+        KEY_PUSH,
+        KEY_POP,
+        KEY_ROTATE,
+        KEY_LEAF,
+        KEY_CUSTOM,
+
+        KEY_MAX
+    };
+
+
+    enum REWRITE_MODE{
+        REWRITE_SERIAL = 0,//appends symbol by symbol, the original path
+        REWRITE_TWO_PASS,//counts the output length first, then fills a single allocation
+        REWRITE_PARALLEL,//two pass over chunks of the previous level, spread across a LSystemThreadPool
+    };
+
+    enum RETAIN_POLICY{
+        RETAIN_ALL = 0,//every level is kept
+        RETAIN_LAST,//only the newest levels are kept
+        RETAIN_CHECKPOINT,//every n-th level is kept, the ones between are rebuilt when needed
+        RETAIN_NONE,//only the axiom and the current level, two level buffers ping-pong through the state pool
+    };
+
+    //timing of the most recent Iterate, for throughput reporting
+    struct IterateStats
+    {
+        IterateStats() :symbolsRead(0), symbolsWritten(0), seconds(0){}
+        double SymbolsPerSecond() const
+        {
+            return seconds > 0 ? symbolsWritten / seconds : 0;
+        }
+        int symbolsRead;
+        int symbolsWritten;
+        double seconds;
+    };
+
+    enum PIPELINE_STAGE{
+        STAGE_DERIVE = 0,//produces the symbols of the level
+        STAGE_INTERPRET,//runs the turtle over them
+        STAGE_MESH,//builds the geometry the turtle recorded
+        PIPELINE_STAGES
+    };
+
+    //timing of the most recent VisualizePipelined, a stage that is mostly starved waits on the
+    //stage before it and one that is mostly blocked waits on the stage after it
+    struct PipelineStats
+    {
+        PipelineStats() :symbols(0), chunks(0), seconds(0)
+        {
+            memset(busy, 0, sizeof(busy));
+            memset(starved, 0, sizeof(starved));
+            memset(blocked, 0, sizeof(blocked));
+        }
+        //symbols per second the stage would manage on its own
+        double StageRate(int stage) const
+        {
+            return busy[stage] > 0 ? symbols / busy[stage] : 0;
+        }
+        double SymbolsPerSecond() const
+        {
+            return seconds > 0 ? symbols / seconds : 0;
+        }
+        unsigned long long symbols;
+        int chunks;
+        double seconds;
+        double busy[PIPELINE_STAGES];//seconds spent working
+        double starved[PIPELINE_STAGES];//seconds waiting for input
+        double blocked[PIPELINE_STAGES];//seconds waiting for room for output
+    };
+
+    typedef void(*VarFunc)(LSystemState*);
+    typedef void(*BatchFunc)(const LSystemBatch& batch);
+
+    //produces the symbols of a level depth first from the axiom without building the level
+    //keeps one cursor per recursion depth, so memory is O(level) rather than O(symbols)
+    class Stream
+    {
+    public:
+        //a level of a grammar that needs stored levels cannot be streamed, the stream is then empty
+        Stream(LSystem* lSys, int level) :lSys_(lSys), level_(level)
+        {
+            assert(lSys->stateVec_.size() > 0);
+            if (!lSys->compiled_)lSys->Compile();
+            if (!Streamable(lSys, level))return;
+            stack_.reserve(level + 1);
+            const LSystemState* axiom = lSys->stateVec_[0];
+            Push(axiom->state_.data(), axiom->state_.size());
+        }
+
+        //starts the stream at symbol index start of the level, positioned using the expansion lengths
+        Stream(LSystem* lSys, int level, unsigned long long start) :lSys_(lSys), level_(level)
+        {
+            assert(lSys->stateVec_.size() > 0);
+            if (!lSys->compiled_)lSys->Compile();
+            if (!Streamable(lSys, level))return;
+            lSys->ComputeExpansionLengths(level);
+            stack_.reserve(level + 1);
+            const LSystemState* axiom = lSys->stateVec_[0];
+            Push(axiom->state_.data(), axiom->state_.size());
+            for (int depth = 0;; ++depth)
+            {
+                Cursor& cur = stack_.back();
+                while (cur.pos < cur.size)
+                {
+                    unsigned long long len = lSys->ExpansionLength(level - depth, cur.symbols[cur.pos]);
+                    if (start < len)break;
+                    start -= len;
+                    ++cur.pos;
+                }
+                if (cur.pos == cur.size || depth == level)return;
+                const SymbolEntry& r = lSys->table_[(unsigned char)cur.symbols[cur.pos]];
+                if (!r.length)return;
+                ++cur.pos;
+                Push(r.production, r.length);
+            }
+        }
+
+        //writes up to max symbols into out and returns how many were written, 0 at the end of the level
+        int Read(char* out, int max)
+        {
+            int count = 0;
+            while (count < max && stack_.size() > 0)
+            {
+                Cursor& cur = stack_.back();
+                if (cur.pos == cur.size)
+                {
+                    stack_.pop_back();
+                    continue;
+                }
+                if ((int)stack_.size() - 1 == level_)
+                {
+                    //deepest level, the remaining symbols are output as they are
+                    int n = cur.size - cur.pos < max - count ? cur.size - cur.pos : max - count;
+                    memcpy(out + count, cur.symbols + cur.pos, n);
+                    cur.pos += n;
+                    count += n;
+                    continue;
+                }
+                unsigned char c = cur.symbols[cur.pos++];
+                const SymbolEntry& r = lSys_->table_[c];
+                if (r.length)
+                {
+                    Push(r.production, r.length);
+                }
+                else
+                {
+                    //no rule, the symbol is the same at every deeper level
+                    out[count++] = c;
+                }
+            }
+            return count;
+        }
+
+        bool Next(char& c)
+        {
+            return Read(&c, 1) == 1;
+        }
+
+    private:
+        struct Cursor
+        {
+            const char* symbols;
+            int size;
+            int pos;
+        };
+
+        static bool Streamable(const LSystem* lSys, int level)
+        {
+            if (level == 0 || !lSys->NeedsStoredLevels())return true;
+            printf("level %d cannot be streamed, the grammar needs its levels stored\n", level);
+            assert(0);
+            return false;
+        }
+
+        void Push(const char* symbols, int size)
+        {
+            Cursor cur;
+            cur.symbols = symbols;
+            cur.size = size;
+            cur.pos = 0;
+            stack_.push_back(cur);
+        }
+
+        const LSystem* lSys_;
+        int level_;
+        octet::dynarray<Cursor> stack_;
+    };
+    friend class Stream;
+
+public:
+    enum { STREAM_CHUNK = 4096, REWRITE_CHUNK = 1 << 16, CALLBACK_BATCH = 256, SPAN_BLOCK = 1024,
+        PIPELINE_CHUNK = 1 << 14, PIPELINE_DEPTH = 4, TURTLE_CHUNK = 1 << 14, STATE_POOL = 2, MATCH_WINDOW = 256 };
+
+    LSystem() :info_(NULL), rewriteMode_(REWRITE_TWO_PASS), ruleFunctionCount_(0), batchFunctionCount_(0), compiled_(false), pool_(NULL),
+        simd_(LSystemDetectSimd()), retainPolicy_(RETAIN_ALL), retainCount_(1), retainBytes_(0),
+        packRequested_(false), packBits_(0), codeCount_(0), grammarStorage_(false), prefixBlock_(0),
+        seed_(0), stochasticCount_(0), contextCount_(0), paramColumns_(0), stringCount_(0), matchMaxLength_(0), levelsStale_(false), staleMixed_(false), staleSymbol_(0),
+        progress_(NULL), lowerTurtle_(false)
+    {
+        memset(ignored_, 0, sizeof(ignored_));
+        memset(arity_, 0, sizeof(arity_));
+        memset(symbolCode_, 0xff, sizeof(symbolCode_));
+        memset(declared_, 0, sizeof(declared_));
+        memset(table_, 0, sizeof(table_));
+    }
+    ~LSystem()
+    {
+        delete(info_);
+        for (int i = 0; i < stateVec_.size(); ++i)
+        {
+            delete stateVec_[i];
+        }
+        TrimStatePool();
+    }
+
+    void Iterate(int n)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            if (!Report(0, NULL))return;
+            Iterate();
+        }
+    }
+    void Iterate()
+    {
+        assert(stateVec_.size()>0);
+        if (levelsStale_)UpdateLevels();
+        if (!compiled_)Compile();
+        LSystemState* state = NewState(stateVec_.back());
+        state->level = stateVec_.back()->level + 1;
+        stateVec_.push_back(state);
+        Derive(state);
+        if (progress_)
+        {
+            Report(state->IsGrammar() ? GetLevelLength(state->level - stateVec_[0]->level) : state->GetSymbolCount(), NULL);
+        }
+        ApplyRetention();
+    }
+
+    //counters updated while iterating and visualizing, once their cancel flag is set Iterate
+    //stops before the next level and Visualize returns without calling Finished,
+    //the levels derived so far are kept so the next Iterate carries on from them
+    void SetProgress(LSystemProgress* progress)
+    {
+        progress_ = progress;
+    }
+    LSystemProgress* GetProgress()
+    {
+        return progress_;
+    }
+
+    void Decrement(int n)
+    {
+        if (levelsStale_)UpdateLevels();
+        for (int i = 0; i < n && stateVec_.size() > 1; ++i)
+        {
+            FreeState(stateVec_.back());
+            stateVec_.pop_back();
+        }
+        RestoreTop();
+        //the dropped levels wait in the pool, which counts against the byte cap
+        ApplyRetention();
+    }
+    void Decrement()
+    {
+        Decrement(1);
+    }
+
+    //moves the current state to the given level, iterating up or dropping levels and
+    //rebuilding from the nearest kept level when the target was evicted
+    void SeekLevel(int level)
+    {
+        if (levelsStale_)UpdateLevels();
+        int top = stateVec_.back()->level;
+        if (level > top)
+        {
+            Iterate(level - top);
+        }
+        else if (level < top)
+        {
+            Decrement(top - level);
+        }
+    }
+
+    //makes the current level the new root, every other level is freed; a grammar level too long to
+    //unpack leaves the history as it was
+    void Collapse()
+    {
+        if (levelsStale_)UpdateLevels();
+        LSystemState* top = stateVec_.back();
+        if (top->IsPacked() || top->IsGrammar())
+        {
+            //grammar levels expand from the axiom, so materialize before it goes
+            LSystemArray<char> symbols;
+            if (!Unpack(top, symbols))return;
+            top->state_.Swap(symbols);
+            top->packed_.reset();
+            top->packBits_ = 0;
+            top->grammar_ = false;
+        }
+        for (int i = 0; i < stateVec_.size() - 1; ++i)
+        {
+            delete stateVec_[i];
+        }
+        stateVec_.resize(1);
+        stateVec_[0] = top;
+        top->prevState = nullptr;
+        TrimStatePool();
+        compiled_ = false;
+    }
+
+    //frees the level buffers kept for reuse by Iterate
+    void TrimStatePool()
+    {
+        for (int i = 0; i < statePool_.size(); ++i)
+        {
+            delete statePool_[i];
+        }
+        statePool_.reset();
+    }
+
+    //how much level history is kept, the axiom and the current level are always kept
+    //count is the number of newest levels for RETAIN_LAST and the spacing for RETAIN_CHECKPOINT,
+    //on top of that the oldest levels are evicted while the history is over maxBytes (0 for no cap)
+    void SetRetention(RETAIN_POLICY policy, int count, size_t maxBytes)
+    {
+        retainPolicy_ = policy;
+        retainCount_ = count > 0 ? count : 1;
+        retainBytes_ = maxBytes;
+        ApplyRetention();
+    }
+
+    //bytes of symbols currently held by the level history, the level buffers waiting in the state pool included
+    size_t GetHistoryBytes() const
+    {
+        size_t bytes = 0;
+        for (int i = 0; i < stateVec_.size(); ++i)
+        {
+            if (stateVec_[i])bytes += stateVec_[i]->GetByteSize();
+        }
+        for (int i = 0; i < statePool_.size(); ++i)
+        {
+            bytes += statePool_[i]->GetByteSize();
+        }
+        return bytes;
+    }
+
+    //the symbols the grammar uses in code order, set by the importer, up to 4 symbols
+    //pack at 2 bits per symbol and up to 16 at 4 bits
+    void SetCodeTable(const char* symbols, int count)
+    {
+        memset(symbolCode_, 0xff, sizeof(symbolCode_));
+        codeCount_ = count <= 16 ? count : 0;
+        for (int i = 0; i < codeCount_; ++i)
+        {
+            symbolCode_[(unsigned char)symbols[i]] = i;
+            codeSymbol_[i] = symbols[i];
+        }
+        compiled_ = false;
+    }
+
+    //new levels are stored packed when the code table covers the grammar, the axiom stays as bytes
+    void SetPackedStorage(bool packed)
+    {
+        packRequested_ = packed;
+        compiled_ = false;
+    }
+
+    //new levels are stored as a straight line program over the productions instead of a buffer,
+    //so every level costs one row of nodes and the whole history of a deep tree fits in memory,
+    //grammars with rule functions are still stored as symbols
+    void SetGrammarStorage(bool grammar)
+    {
+        grammarStorage_ = grammar;
+    }
+
+    //symbol index of a level in any storage form, 0 past the end
+    char GetSymbol(const LSystemState* state, unsigned long long index)
+    {
+        if (state->IsGrammar())
+        {
+            return GetSymbolAt(state->level - stateVec_[0]->level, index);
+        }
+        if (index >= (unsigned long long)state->GetSymbolCount())return 0;
+        if (state->IsPacked())
+        {
+            unsigned long long bit = index * state->packBits_;
+            return codeSymbol_[(state->packed_.data()[bit >> 3] >> (bit & 7)) & ((1 << state->packBits_) - 1)];
+        }
+        return state->state_[(int)index];
+    }
+
+    //the byte form of any level, packed, grammar or plain
+    //false, with out empty, for a grammar level too long for a buffer
+    bool Unpack(const LSystemState* state, octet::dynarray<char>& out)
+    {
+        if (state->IsGrammar())
+        {
+            int steps = state->level - stateVec_[0]->level;
+            unsigned long long length = GetLevelLength(steps);
+            if (length > 0x7fffffff)
+            {
+                printf("level %d has %llu symbols, too many to unpack\n", state->level, length);
+                out.resize(0);
+                return false;
+            }
+            out.resize((int)length);
+            Stream stream(this, steps);
+            stream.Read(out.data(), out.size());
+            return true;
+        }
+        if (!state->IsPacked())
+        {
+            out.resize(state->state_.size());
+            memcpy(out.data(), state->state_.data(), state->state_.size());
+            return true;
+        }
+        out.resize(state->packedCount_);
+        int bits = state->packBits_;
+        int mask = (1 << bits) - 1;
+        const unsigned char* src = state->packed_.data();
+        for (int i = 0; i < state->packedCount_; ++i)
+        {
+            unsigned long long bit = (unsigned long long)i * bits;
+            out[i] = codeSymbol_[(src[bit >> 3] >> (bit & 7)) & mask];
+        }
+        return true;
+    }
+
+    //the Visualize functions are templates on the visualizer so that a concrete final visualizer such as
+    //DrawHelper3D gets its handlers called directly and inlined into the symbol loop, passing an
+    //LSystemVisualizer* instead dispatches every symbol through the virtual interface
+    template<class Visualizer>
+    void Visualize(Visualizer* viz){
+        if (!viz)return;
+        if (levelsStale_)UpdateLevels();
+        if (!compiled_)Compile();
+        if (lowerTurtle_ && !paramColumns_)
+        {
+            LSystemLowering<Visualizer> lowered(viz, &opcodes_);
+            VisualizeLevel(&lowered);
+            return;
+        }
+        VisualizeLevel(viz);
+    }
+
+    //visualizes the given level straight from a Stream, the level is never stored
+    //so only the turtle geometry costs memory, rule functions are not run
+    //weighted, context and parametric rules need the previous level, so those levels are derived and stored instead
+    template<class Visualizer>
+    void Visualize(Visualizer* viz, int level)
+    {
+        if (!viz)return;
+        if (levelsStale_)UpdateLevels();
+        if (!compiled_)Compile();
+        if (lowerTurtle_ && !paramColumns_)
+        {
+            LSystemLowering<Visualizer> lowered(viz, &opcodes_);
+            StreamLevel(&lowered, level);
+            return;
+        }
+        StreamLevel(viz, level);
+    }
+
+    //visualizes the given level with derivation, the turtle and the geometry each on their own thread,
+    //the level flows through in PIPELINE_CHUNK symbol chunks, at most PIPELINE_DEPTH chunks and
+    //geometry batches wait between stages so the level is never held whole; a visualizer that can't
+    //defer its geometry builds it on the turtle's thread, stored levels are read in chunks when the
+    //grammar needs them and parametric levels are visualized in one go
+    template<class Visualizer>
+    void VisualizePipelined(Visualizer* viz, int level)
+    {
+        if (!viz)return;
+        if (levelsStale_)UpdateLevels();
+        if (!compiled_)Compile();
+        if (lowerTurtle_ && !paramColumns_)
+        {
+            LSystemLowering<Visualizer> lowered(viz, &opcodes_);
+            PipelineLevel(&lowered, level);
+            return;
+        }
+        PipelineLevel(viz, level);
+    }
+
+    //visualizes the stored level with the turtle itself spread over the thread pool: the level is cut into
+    //TURTLE_CHUNK symbol chunks, the visualizer summarizes every chunk on its own, scans the summaries in
+    //order for the turtle each chunk starts with and where its geometry goes, then every chunk draws at once;
+    //runs are never merged as they would stop at the chunk edges, and visualizers that can't split,
+    //grammar and parametric levels and systems without a pool are visualized as Visualize would
+    template<class Visualizer>
+    void VisualizeParallel(Visualizer* viz)
+    {
+        if (!viz)return;
+        if (levelsStale_)UpdateLevels();
+        if (!compiled_)Compile();
+        LSystemState* state = stateVec_.back();
+        int passes = viz->GetSplitPasses();
+        if (!pool_ || !passes || state->IsGrammar() || state->paramCount_)
+        {
+            Visualize(viz);
+            return;
+        }
+        viz->SetState(state);
+        info_ ? viz->Init(info_) : viz->Init(NULL);
+        int chunks = (state->GetSymbolCount() + TURTLE_CHUNK - 1) / TURTLE_CHUNK;
+        viz->BeginSplit(chunks);
+        for (int pass = 0; pass <= passes; ++pass)
+        {
+            if (!Report(0, viz))return;
+            pool_->Run(chunks, [&](int c)
+            {
+                unsigned char keys[TURTLE_CHUNK];
+                int count = ChunkKeys(state, c, keys);
+                if (pass < passes)viz->SummarizeChunk(pass, c, keys, count);
+                else viz->EmitChunk(c, keys, count);
+            });
+            if (pass < passes)viz->ScanSplit(pass);
+        }
+        if (Report(0, viz))viz->Finished();
+    }
+
+    //runs of draws and rotations reach the visualizer as single DrawLines and Turn calls through
+    //an LSystemOpcodes stream, parametric grammars are always visualized symbol by symbol
+    void SetTurtleLowering(bool lower)
+    {
+        lowerTurtle_ = lower;
+    }
+    bool GetTurtleLowering() const
+    {
+        return lowerTurtle_;
+    }
+
+    //number of symbols in the given level, worked out from the production counts without deriving it;
+    //weighted, context, parametric and multi symbol rules change the counts with where a symbol is,
+    //so for those grammars the level has to be stored and false is returned when it is not
+    bool GetLevelLength(int level, unsigned long long& length)
+    {
+        if (!compiled_)Compile();
+        if (NeedsStoredLevels())
+        {
+            const LSystemState* state = StoredLevel(level);
+            length = state ? state->GetSymbolCount() : 0;
+            return state != NULL;
+        }
+        ComputeExpansionLengths(level);
+        const LSystemState* axiom = stateVec_[0];
+        length = 0;
+        for (int i = 0; i < axiom->state_.size(); ++i)
+        {
+            length = SaturatingAdd(length, ExpansionLength(level, axiom->state_[i]));
+        }
+        return true;
+    }
+
+    unsigned long long GetLevelLength(int level)
+    {
+        unsigned long long length;
+        if (!GetLevelLength(level, length))printf("level %d is not stored, its length depends on the derivation\n", level);
+        return length;
+    }
+
+    //the symbol at index of the given level, found by walking down the derivation from the axiom,
+    //or read from the stored level for grammars the counts cannot follow
+    //returns 0 when the index is past the end of the level
+    char GetSymbolAt(int level, unsigned long long index)
+    {
+        if (!compiled_)Compile();
+        if (NeedsStoredLevels())
+        {
+            const LSystemState* state = StoredLevel(level);
+            if (!state)printf("level %d is not stored, its symbols depend on the derivation\n", level);
+            return state ? GetSymbol(state, index) : 0;
+        }
+        ComputeExpansionLengths(level);
+        const char* symbols = stateVec_[0]->state_.data();
+        int size = stateVec_[0]->state_.size();
+        int i = 0;
+        for (; i < size; ++i)
+        {
+            unsigned long long len = ExpansionLength(level, symbols[i]);
+            if (index < len)break;
+            index -= len;
+        }
+        if (i == size)return 0;
+        //below the axiom each node (symbol, depth) has the prefix sums of its children,
+        //so each step down is a binary search
+        char c = symbols[i];
+        for (int depth = level; depth > 0; --depth)
+        {
+            const SymbolEntry& r = table_[(unsigned char)c];
+            if (!r.length)return c;
+            const unsigned long long* prefix = ChildPrefix(depth, c);
+            int lo = 0;
+            int hi = r.length - 1;
+            while (lo < hi)
+            {
+                int mid = (lo + hi) / 2;
+                if (prefix[mid] > index)hi = mid;
+                else lo = mid + 1;
+            }
+            if (lo > 0)index -= prefix[lo - 1];
+            c = r.production[lo];
+        }
+        return c;
+    }
+
+    //how many times each symbol occurs in the given level, indexed by the symbol; like GetLevelLength
+    //they are counted from the stored level for grammars the counts cannot follow, false when it is not stored
+    bool GetSymbolCounts(int level, unsigned long long counts[256])
+    {
+        if (!compiled_)Compile();
+        memset(counts, 0, sizeof(unsigned long long) * 256);
+        if (NeedsStoredLevels())
+        {
+            const LSystemState* state = StoredLevel(level);
+            if (!state)return false;
+            if (state->IsPacked())
+            {
+                ForEachCode(state, [&](int code)
+                {
+                    ++counts[(unsigned char)codeSymbol_[code]];
+                });
+                return true;
+            }
+            for (int i = 0; i < state->state_.size(); ++i)
+            {
+                ++counts[(unsigned char)state->state_[i]];
+            }
+            return true;
+        }
+        int n = activeSymbols_.size();
+        octet::dynarray<unsigned long long> cur;
+        octet::dynarray<unsigned long long> next;
+        cur.resize(n);
+        next.resize(n);
+        memset(cur.data(), 0, sizeof(unsigned long long) * n);
+        const LSystemState* axiom = stateVec_[0];
+        for (int i = 0; i < axiom->state_.size(); ++i)
+        {
+            ++cur[activeIndex_[(unsigned char)axiom->state_[i]]];
+        }
+        for (int d = 0; d < level; ++d)
+        {
+            memset(next.data(), 0, sizeof(unsigned long long) * n);
+            for (int a = 0; a < n; ++a)
+            {
+                if (!cur[a])continue;
+                const int* row = productionCounts_.data() + a * n;
+                for (int b = 0; b < n; ++b)
+                {
+                    if (row[b])next[b] = SaturatingAdd(next[b], SaturatingMul(cur[a], row[b]));
+                }
+            }
+            memcpy(cur.data(), next.data(), sizeof(unsigned long long) * n);
+        }
+        for (int a = 0; a < n; ++a)
+        {
+            counts[(unsigned char)activeSymbols_[a]] = cur[a];
+        }
+        return true;
+    }
+
+    void AddAlphabetSymbol(char symb)
+    {
+        alphabet_.push_back(symb);
+    }
+
+    void SetAxiom(const char* c, int size)
+    {
+        if (stateVec_.size() == 0)
+        {
+            axiom_.resize(size);
+            memcpy(axiom_.data(), c, size);
+            stateVec_.push_back(new LSystemState());
+            stateVec_.back()->state_ = axiom_;
+            stateVec_.back()->level = 0;
+            compiled_ = false;
+        }
+    }
+
+    //once levels are derived a changed rule leaves them out of date until UpdateLevels, which
+    //the calls that read levels make first, so a run of edits costs a single update
+    void AddBasicRules(char c, octet::string& str)
+    {
+        if (stateVec_.size() < 2)
+        {
+            referenceMap_[c].str = str;
+            Declare(c);
+            return;
+        }
+        if (!compiled_)Compile();
+        if (!levelsStale_)
+        {
+            const SymbolEntry& r = table_[(unsigned char)c];
+            staleProduction_.resize(r.length);
+            if (r.length)memcpy(staleProduction_.data(), r.production, r.length);
+            staleSymbol_ = c;
+            staleMixed_ = false;
+            levelsStale_ = true;
+        }
+        else if (c != staleSymbol_)
+        {
+            staleMixed_ = true;
+        }
+        referenceMap_[c].str = str;
+        Declare(c);
+        compiled_ = false;
+    }
+
+    //brings the levels up to date with the rules edited since they were derived, edits to a single
+    //symbol are spliced through when Rederive expects that to pay and anything else rebuilds them
+    void UpdateLevels()
+    {
+        if (!levelsStale_)return;
+        levelsStale_ = false;
+        Compile();
+        const SymbolEntry& r = table_[(unsigned char)staleSymbol_];
+        if (!staleMixed_ && r.length == staleProduction_.size() && memcmp(r.production, staleProduction_.data(), r.length) == 0)return;
+        if (staleMixed_ || !Rederive(staleSymbol_, staleProduction_.data(), staleProduction_.size()))RebuildLevels();
+    }
+
+    //adds a rule for a run of symbols, FF=F; the level is read left to right and the longest
+    //predecessor starting at each symbol wins, symbols no run matches use their own rules;
+    //a later rule for the same run replaces the earlier one
+    void AddStringRule(const char* predecessor, int predSize, const char* str, int size)
+    {
+        if (predSize == 1)
+        {
+            octet::string production(str, size);
+            AddBasicRules(predecessor[0], production);
+            return;
+        }
+        StringRule rule;
+        rule.predBegin = AddRuleText(predecessor, predSize);
+        rule.predLength = predSize;
+        rule.begin = AddRuleText(str, size);
+        rule.length = size;
+        stringRules_.push_back(rule);
+        compiled_ = false;
+    }
+
+    //adds one weighted alternative for c, a symbol with weighted rules ignores its basic rule and
+    //picks an alternative per occurrence from the seed, the level and the index it is read from
+    void AddStochasticRule(char c, float weight, const char* str, int size)
+    {
+        StochasticRule rule;
+        rule.symbol = c;
+        rule.weight = weight;
+        rule.begin = AddRuleText(str, size);
+        rule.length = size;
+        stochasticRules_.push_back(rule);
+        Declare(c);
+    }
+
+    //adds left<c>right=str, left is matched backwards from c and right forwards along the branch,
+    //either context may be empty; context rules are tried in the order added before the other rules of c
+    void AddContextRule(char c, const char* left, int leftSize, const char* right, int rightSize, const char* str, int size)
+    {
+        ContextRule rule;
+        rule.symbol = c;
+        rule.leftBegin = AddRuleText(left, leftSize);
+        rule.leftLength = leftSize;
+        rule.rightBegin = AddRuleText(right, rightSize);
+        rule.rightLength = rightSize;
+        rule.begin = AddRuleText(str, size);
+        rule.length = size;
+        contextRules_.push_back(rule);
+        Declare(c);
+    }
+
+    //symbols skipped by context matching, like the turtle's rotations
+    void AddIgnoredSymbol(char c)
+    {
+        ignored_[(unsigned char)c] = true;
+        compiled_ = false;
+    }
+
+    //sets parameter slot of axiom symbol index, the axiom becomes a parametric level
+    void SetAxiomParameter(int index, int slot, float value)
+    {
+        assert(stateVec_.size() > 0 && slot < LSystemState::MAX_PARAMS);
+        LSystemState* axiom = stateVec_[0];
+        SetParameterColumns(axiom, slot + 1);
+        axiom->params_[slot][index] = value;
+        NoteArity(axiom->state_[index], slot + 1);
+        compiled_ = false;
+    }
+
+    //adds c(formals):condition=str, code holds the condition (conditionLength ops, 0 when there is none)
+    //followed by one expression per argument written in str, argLengths gives their op counts and
+    //moduleArgs how many arguments each symbol of str was written with
+    void AddParametricRule(char c, int formalCount, const LSystemOp* code, int conditionLength, const int* argLengths,
+        const int* moduleArgs, const char* str, int size)
+    {
+        ParametricRule rule;
+        rule.symbol = c;
+        rule.codeBegin = paramCode_.size();
+        rule.conditionLength = conditionLength;
+        rule.argBegin = paramArgLengths_.size();
+        rule.moduleBegin = paramModuleArgs_.size();
+        rule.begin = AddRuleText(str, size);
+        rule.length = size;
+        int codeLength = conditionLength;
+        int args = 0;
+        for (int p = 0; p < size; ++p)
+        {
+            paramModuleArgs_.push_back(moduleArgs[p]);
+            NoteArity(str[p], moduleArgs[p]);
+            for (int k = 0; k < moduleArgs[p]; ++k, ++args)
+            {
+                paramArgLengths_.push_back(argLengths[args]);
+                codeLength += argLengths[args];
+            }
+        }
+        for (int op = 0; op < codeLength; ++op)
+        {
+            paramCode_.push_back(code[op]);
+        }
+        NoteArity(c, formalCount);
+        paramRules_.push_back(rule);
+        Declare(c);
+    }
+
+    //the production of c's basic rule, NULL when c has none
+    const char* GetRule(char c, int& length)
+    {
+        if (!compiled_)Compile();
+        length = table_[(unsigned char)c].length;
+        return table_[(unsigned char)c].production;
+    }
+
+    //number of parameters c carries in a parametric grammar
+    int GetArity(char c) const
+    {
+        return arity_[(unsigned char)c];
+    }
+
+    //the neighbour index of the level last rewritten with context rules
+    const LSystemBracketIndex& GetBracketIndex() const
+    {
+        return contextIndex_;
+    }
+
+    //a tree is fully described by its grammar and seed, changing the seed rederives the current level
+    void SetSeed(unsigned int seed)
+    {
+        if (seed == seed_)return;
+        seed_ = seed;
+        if (stochasticRules_.size() == 0 || stateVec_.size() < 2)return;
+        RebuildLevels();
+    }
+
+    unsigned int GetSeed() const
+    {
+        return seed_;
+    }
+
+    void SetKeyDecl(char c, KEY_SYMBOLS k)
+    {
+        referenceMap_[c].key = k;
+        Declare(c);
+    }
+
+    void AddRuleFunction(char c, VarFunc func)
+    {
+        SymbolRef& r = referenceMap_[c];
+        if (!r.func && func)++ruleFunctionCount_;
+        if (r.func && !func)--ruleFunctionCount_;
+        r.func = func;
+        Declare(c);
+    }
+
+    //func is handed every occurrence of c once its production is written, CALLBACK_BATCH at a time,
+    //unlike rule functions these keep the two pass and parallel rewrites; context is passed back in
+    //every batch, a NULL func removes it; not run for grammar, streamed or parametric levels
+    void AddBatchFunction(char c, BatchFunc func, void* context)
+    {
+        SymbolRef& r = referenceMap_[c];
+        if (!r.batch && func)++batchFunctionCount_;
+        if (r.batch && !func)--batchFunctionCount_;
+        r.batch = func;
+        r.batchContext = context;
+        Declare(c);
+    }
+
+    //flattens referenceMap_ into the byte indexed table read by Iterate and Visualize,
+    //called by the importer once the grammar is loaded and again lazily after any rule edit
+    void Compile()
+    {
+        int poolSize = ruleText_.size();
+        for (int c = 0; c < 256; ++c)
+        {
+            if (declared_[c])poolSize += referenceMap_[(char)c].str.size();
+        }
+        productionPool_.resize(poolSize);
+
+        char* write = productionPool_.data();
+        for (int c = 0; c < 256; ++c)
+        {
+            SymbolEntry& e = table_[c];
+            e.production = NULL;
+            e.length = 0;
+            e.func = NULL;
+            e.key = KEY_NULL;
+            e.batch = NULL;
+            e.batchContext = NULL;
+            e.choiceBegin = 0;
+            e.choiceCount = 0;
+            e.contextBegin = 0;
+            e.contextCount = 0;
+            e.paramBegin = 0;
+            e.paramCount = 0;
+            if (declared_[c])
+            {
+                const SymbolRef& r = referenceMap_[(char)c];
+                e.length = r.str.size();
+                e.production = e.length ? write : NULL;
+                e.func = r.func;
+                e.key = r.key;
+                e.batch = r.batch;
+                e.batchContext = r.batchContext;
+                memcpy(write, r.str.c_str(), e.length);
+                write += e.length;
+            }
+        }
+        write = CompileStochasticRules(write);
+        write = CompileContextRules(write);
+        write = CompileParametricRules(write);
+        write = CompileStringRules(write);
+        BuildRuleMask();
+        BuildProductionCounts();
+        BuildPackedProductions();
+        compiled_ = true;
+    }
+
+    void SetRewriteMode(REWRITE_MODE mode)
+    {
+        rewriteMode_ = mode;
+    }
+
+    //the pool used by REWRITE_PARALLEL, not owned so one pool can be shared by every LSystem
+    void SetThreadPool(LSystemThreadPool* pool)
+    {
+        pool_ = pool;
+    }
+
+    //caps the instruction set used by the rewriter, it never goes above what the CPU reports
+    void SetSimd(LSYSTEM_SIMD simd)
+    {
+        LSYSTEM_SIMD supported = LSystemDetectSimd();
+        simd_ = simd < supported ? simd : supported;
+    }
+
+    const IterateStats& GetIterateStats() const
+    {
+        return stats_;
+    }
+
+    const PipelineStats& GetPipelineStats() const
+    {
+        return pipeStats_;
+    }
+
+    void SetDrawInfo(LSystemDrawInfo* info)
+    {
+        info_ = info;
+    }
+
+    LSystemDrawInfo* GetDrawInfo(){
+        return info_;
+    }
+
+    //identifies what the grammar derives and how it is drawn: the axiom, every rule and key,
+    //the ignored symbols, the seed and the draw info; 0 when rule or batch functions take part
+    //or the grammar is parametric, as those levels can't be told apart by their rules
+    unsigned long long GetGrammarHash()
+    {
+        if (!compiled_)Compile();
+        if (ruleFunctionCount_ || batchFunctionCount_ || paramColumns_)return 0;
+        unsigned long long hash = LSYSTEM_HASH_SEED;
+        const LSystemState* axiom = stateVec_[0];
+        int axiomSize = axiom->state_.size();
+        hash = LSystemHash(hash, &axiomSize, sizeof(axiomSize));
+        hash = LSystemHash(hash, axiom->state_.data(), axiomSize);
+        for (int c = 0; c < 256; ++c)
+        {
+            const SymbolEntry& r = table_[c];
+            int fields[] = { r.key, r.length, r.choiceCount, r.contextCount, r.paramCount };
+            hash = LSystemHash(hash, fields, sizeof(fields));
+            if (r.length)hash = LSystemHash(hash, r.production, r.length);
+        }
+        //the weighted, context and multi symbol rules, with where each one's text starts
+        for (int i = 0; i < stochasticRules_.size(); ++i)
+        {
+            const StochasticRule& rule = stochasticRules_[i];
+            hash = LSystemHash(hash, &rule.symbol, sizeof(rule.symbol));
+            hash = LSystemHash(hash, &rule.weight, sizeof(rule.weight));
+            hash = LSystemHash(hash, &rule.begin, sizeof(rule.begin));
+            hash = LSystemHash(hash, &rule.length, sizeof(rule.length));
+        }
+        for (int i = 0; i < contextRules_.size(); ++i)
+        {
+            const ContextRule& rule = contextRules_[i];
+            int fields[] = { rule.symbol, rule.leftBegin, rule.leftLength, rule.rightBegin, rule.rightLength, rule.begin, rule.length };
+            hash = LSystemHash(hash, fields, sizeof(fields));
+        }
+        for (int i = 0; i < stringRules_.size(); ++i)
+        {
+            const StringRule& rule = stringRules_[i];
+            int fields[] = { rule.predBegin, rule.predLength, rule.begin, rule.length };
+            hash = LSystemHash(hash, fields, sizeof(fields));
+        }
+        hash = LSystemHash(hash, ruleText_.data(), ruleText_.size());
+        hash = LSystemHash(hash, ignored_, sizeof(ignored_));
+        hash = LSystemHash(hash, &seed_, sizeof(seed_));
+        if (info_)
+        {
+            float fields[] = { info_->sectionLength, info_->sectionLengthReduction, info_->sectionWidth, info_->sectionWidthReduction,
+                info_->minXRot, info_->minYRot, info_->minZRot, info_->maxXRot, info_->maxYRot, info_->maxZRot };
+            hash = LSystemHash(hash, fields, sizeof(fields));
+            hash = LSystemHash(hash, &info_->randomize, sizeof(info_->randomize));
+        }
+        return hash;
+    }
+
+    //makes symbols the current level, for levels kept outside the LSystem such as a disk cache,
+    //they must be what this grammar derives at that level; the levels between the axiom and it
+    //start out evicted and are rebuilt from the axiom if they are needed
+    void AdoptLevel(int level, const char* symbols, int count)
+    {
+        assert(level > stateVec_[0]->level);
+        levelsStale_ = false;
+        if (!compiled_)Compile();
+        Decrement(stateVec_.size() - 1);
+        for (int l = stateVec_[0]->level + 1; l < level; ++l)
+        {
+            stateVec_.push_back(NULL);
+        }
+        LSystemState* state = NewState(NULL);
+        state->level = level;
+        state->state_.resize(count);
+        if (count)memcpy(state->state_.data(), symbols, count);
+        if (packBits_)Pack(state);
+        stateVec_.push_back(state);
+        ApplyRetention();
+    }
+
+    const LSystemState* GetCurrentState()
+    {
+        if (levelsStale_)UpdateLevels();
+        return stateVec_.back();
+    }
+private:
+    struct SymbolRef
+    {
+        SymbolRef() : func(NULL), key(KEY_NULL), batch(NULL), batchContext(NULL){}
+        octet::string str;
+        VarFunc func;
+        KEY_SYMBOLS key;
+        BatchFunc batch;
+        void* batchContext;
+    };
+
+    //compiled SymbolRef, the production points into productionPool_
+    //symbols with weighted rules have choiceCount alternatives in choices_, production is the first
+    struct SymbolEntry
+    {
+        const char* production;
+        int length;
+        VarFunc func;
+        KEY_SYMBOLS key;
+        BatchFunc batch;
+        void* batchContext;
+        int choiceBegin;
+        int choiceCount;
+        int contextBegin;
+        int contextCount;
+        int paramBegin;
+        int paramCount;
+    };
+
+    //an alternative as added, the text is kept in ruleText_
+    struct StochasticRule
+    {
+        char symbol;
+        float weight;
+        int begin;
+        int length;
+    };
+
+    //a parametric rule as added, the code and argument counts are in paramCode_, paramArgLengths_
+    //and paramModuleArgs_, one entry of paramModuleArgs_ per symbol of the production
+    struct ParametricRule
+    {
+        char symbol;
+        int codeBegin;
+        int conditionLength;
+        int argBegin;
+        int moduleBegin;
+        int begin;
+        int length;
+    };
+
+    //a parametric rule as compiled, the production points into productionPool_ and
+    //assignments lists which expression fills which parameter of which output symbol
+    struct ParametricMatch
+    {
+        const char* production;
+        int length;
+        int conditionBegin;
+        int conditionLength;
+        int assignBegin;
+        int assignCount;
+    };
+
+    struct ParametricAssign
+    {
+        int position;
+        int slot;
+        int codeBegin;
+        int codeLength;
+    };
+
+    //a rule with a multi symbol predecessor as added, offsets into ruleText_
+    struct StringRule
+    {
+        int predBegin;
+        int predLength;
+        int begin;
+        int length;
+    };
+
+    //a multi symbol rule as compiled, the production points into productionPool_
+    struct StringMatch
+    {
+        const char* production;
+        int length;
+        int predLength;
+    };
+
+    //a multi symbol rule matched at position by the count pass, rule indexes stringMatches_
+    struct MatchRun
+    {
+        int position;
+        int rule;
+    };
+
+    //a context rule as added, offsets into ruleText_
+    struct ContextRule
+    {
+        char symbol;
+        int leftBegin;
+        int leftLength;
+        int rightBegin;
+        int rightLength;
+        int begin;
+        int length;
+    };
+
+    //a context rule as compiled, the strings point into productionPool_
+    struct ContextMatch
+    {
+        const char* left;
+        int leftLength;
+        const char* right;
+        int rightLength;
+        const char* production;
+        int length;
+    };
+
+    //a run of a level rebuilt by Rederive
+    struct Splice
+    {
+        int kind;
+        int write;//start in the new level
+        int length;//symbols written
+        int from;//start in the old level, the new previous level or c's new production, by kind
+        int count;//symbols of the new previous level a SPLICE_REWRITE reads
+    };
+
+    enum SPLICE_KIND{
+        SPLICE_COPY = 0,//unchanged, copied from the old level
+        SPLICE_REWRITE,//rewritten from the new previous level
+        SPLICE_PRODUCTION,//part of c's new production the old one does not share
+    };
+
+    //an alternative as compiled, picked when the random draw is at most threshold
+    struct Choice
+    {
+        const char* production;
+        int length;
+        unsigned int threshold;
+    };
+
+private:
+    void Declare(char c)
+    {
+        declared_[(unsigned char)c] = true;
+        compiled_ = false;
+    }
+
+    //copies the weighted alternatives into the pool grouped by symbol, the weights become
+    //cumulative thresholds over the full 32 bit range, returns the end of what was written
+    char* CompileStochasticRules(char* write)
+    {
+        choices_.resize(0);
+        stochasticCount_ = 0;
+        for (int c = 0; c < 256; ++c)
+        {
+            float total = 0;
+            for (int i = 0; i < stochasticRules_.size(); ++i)
+            {
+                if ((unsigned char)stochasticRules_[i].symbol == c)total += stochasticRules_[i].weight;
+            }
+            if (total <= 0)continue;
+
+            SymbolEntry& e = table_[c];
+            e.choiceBegin = choices_.size();
+            float sum = 0;
+            for (int i = 0; i < stochasticRules_.size(); ++i)
+            {
+                const StochasticRule& rule = stochasticRules_[i];
+                if ((unsigned char)rule.symbol != c)continue;
+                sum += rule.weight;
+                Choice choice;
+                choice.production = rule.length ? write : NULL;
+                choice.length = rule.length;
+                choice.threshold = (unsigned int)((double)sum / total * 4294967295.0);
+                memcpy(write, ruleText_.data() + rule.begin, rule.length);
+                write += rule.length;
+                choices_.push_back(choice);
+            }
+            e.choiceCount = choices_.size() - e.choiceBegin;
+            choices_.back().threshold = 0xffffffffu;
+            e.production = choices_[e.choiceBegin].production;
+            e.length = choices_[e.choiceBegin].length;
+            ++stochasticCount_;
+        }
+        return write;
+    }
+
+    //copies the context rules into the pool grouped by symbol, keeping their order,
+    //and classifies every byte for the bracket index
+    char* CompileContextRules(char* write)
+    {
+        contexts_.resize(0);
+        contextCount_ = 0;
+        for (int c = 0; c < 256; ++c)
+        {
+            int begin = contexts_.size();
+            for (int i = 0; i < contextRules_.size(); ++i)
+            {
+                const ContextRule& rule = contextRules_[i];
+                if ((unsigned char)rule.symbol != c)continue;
+                ContextMatch match;
+                match.left = write;
+                match.leftLength = rule.leftLength;
+                memcpy(write, ruleText_.data() + rule.leftBegin, rule.leftLength);
+                write += rule.leftLength;
+                match.right = write;
+                match.rightLength = rule.rightLength;
+                memcpy(write, ruleText_.data() + rule.rightBegin, rule.rightLength);
+                write += rule.rightLength;
+                match.production = write;
+                match.length = rule.length;
+                memcpy(write, ruleText_.data() + rule.begin, rule.length);
+                write += rule.length;
+                contexts_.push_back(match);
+            }
+            table_[c].contextBegin = begin;
+            table_[c].contextCount = contexts_.size() - begin;
+            if (table_[c].contextCount)++contextCount_;
+        }
+
+        for (int c = 0; c < 256; ++c)
+        {
+            contextClass_[c] = ignored_[c] ? LSystemBracketIndex::IGNORED : LSystemBracketIndex::SYMBOL;
+            if (table_[c].key == KEY_PUSH)contextClass_[c] = LSystemBracketIndex::PUSH;
+            if (table_[c].key == KEY_POP)contextClass_[c] = LSystemBracketIndex::POP;
+        }
+        return write;
+    }
+
+    //copies the parametric rules into the pool grouped by symbol, keeping their order, and
+    //resolves where each written argument goes; arguments past a symbol's arity are dropped
+    char* CompileParametricRules(char* write)
+    {
+        paramMatches_.resize(0);
+        paramAssigns_.resize(0);
+        paramSymbols_.resize(0);
+        paramColumns_ = 0;
+        for (int c = 0; c < 256; ++c)
+        {
+            if (arity_[c] > paramColumns_)paramColumns_ = arity_[c];
+        }
+        if (paramColumns_ > LSystemState::MAX_PARAMS)
+        {
+            printf("%s%d%s\n", "Symbols carry at most ", (int)LSystemState::MAX_PARAMS, " parameters");
+            paramColumns_ = LSystemState::MAX_PARAMS;
+        }
+
+        for (int c = 0; c < 256; ++c)
+        {
+            int begin = paramMatches_.size();
+            for (int i = 0; i < paramRules_.size(); ++i)
+            {
+                const ParametricRule& rule = paramRules_[i];
+                if ((unsigned char)rule.symbol != c)continue;
+                ParametricMatch match;
+                match.production = write;
+                match.length = rule.length;
+                memcpy(write, ruleText_.data() + rule.begin, rule.length);
+                write += rule.length;
+                match.conditionBegin = rule.codeBegin;
+                match.conditionLength = rule.conditionLength;
+                match.assignBegin = paramAssigns_.size();
+
+                int arg = rule.argBegin;
+                int codeBegin = rule.codeBegin + rule.conditionLength;
+                for (int p = 0; p < rule.length; ++p)
+                {
+                    int written = paramModuleArgs_[rule.moduleBegin + p];
+                    for (int k = 0; k < written; ++k, ++arg)
+                    {
+                        ParametricAssign assign;
+                        assign.position = p;
+                        assign.slot = k;
+                        assign.codeBegin = codeBegin;
+                        assign.codeLength = paramArgLengths_[arg];
+                        codeBegin += assign.codeLength;
+                        if (k < paramColumns_)paramAssigns_.push_back(assign);
+                    }
+                }
+                match.assignCount = paramAssigns_.size() - match.assignBegin;
+                paramMatches_.push_back(match);
+            }
+            table_[c].paramBegin = begin;
+            table_[c].paramCount = paramMatches_.size() - begin;
+            if (table_[c].paramCount)paramSymbols_.push_back((char)c);
+        }
+        if (paramColumns_ && stateVec_.size() > 0)SetParameterColumns(stateVec_[0], paramColumns_);
+        return write;
+    }
+
+    //builds the predecessor trie of the multi symbol rules as a dense transition table, row 0 is
+    //the root, then turns it into an Aho-Corasick automaton so one scan finds every predecessor
+    //in the level with one lookup per symbol; the productions are copied into the pool
+    char* CompileStringRules(char* write)
+    {
+        matchNext_.resize(0);
+        matchRule_.resize(0);
+        matchFail_.resize(0);
+        matchOutput_.resize(0);
+        matchMaxLength_ = 0;
+        stringMatches_.resize(0);
+        stringCount_ = 0;
+        if (stringRules_.size() == 0)return write;
+        if (paramColumns_)
+        {
+            printf("%s\n", "Multi symbol rules are ignored in parametric grammars");
+            return write;
+        }
+        AddMatchState();
+        for (int i = 0; i < stringRules_.size(); ++i)
+        {
+            const StringRule& rule = stringRules_[i];
+            if (rule.predLength > MATCH_WINDOW)
+            {
+                printf("%s%d%s\n", "Multi symbol predecessors over ", MATCH_WINDOW, " symbols are ignored");
+                continue;
+            }
+            const unsigned char* pred = (const unsigned char*)ruleText_.data() + rule.predBegin;
+            int s = 0;
+            for (int k = 0; k < rule.predLength; ++k)
+            {
+                if (!matchNext_[s * 256 + pred[k]])
+                {
+                    int next = AddMatchState();
+                    matchNext_[s * 256 + pred[k]] = next;
+                }
+                s = matchNext_[s * 256 + pred[k]];
+            }
+            StringMatch match;
+            match.production = write;
+            match.length = rule.length;
+            match.predLength = rule.predLength;
+            memcpy(write, ruleText_.data() + rule.begin, rule.length);
+            write += rule.length;
+            if (matchRule_[s] < 0)++stringCount_;
+            matchRule_[s] = stringMatches_.size();
+            stringMatches_.push_back(match);
+            if (rule.predLength > matchMaxLength_)matchMaxLength_ = rule.predLength;
+        }
+        BuildMatchLinks();
+        return write;
+    }
+
+    //failure links breadth first, a node's failure is always shallower so it is finished first;
+    //missing transitions are taken from the failure node, which makes the table a full automaton
+    void BuildMatchLinks()
+    {
+        int states = matchRule_.size();
+        matchFail_.resize(states);
+        matchOutput_.resize(states);
+        int* next = matchNext_.data();
+        octet::dynarray<int> order;
+        matchFail_[0] = 0;
+        matchOutput_[0] = 0;
+        for (int c = 0; c < 256; ++c)
+        {
+            int t = next[c];
+            if (!t)continue;
+            matchFail_[t] = 0;
+            order.push_back(t);
+        }
+        for (int head = 0; head < order.size(); ++head)
+        {
+            int s = order[head];
+            matchOutput_[s] = matchRule_[s] >= 0 ? s : matchOutput_[matchFail_[s]];
+            int fail = matchFail_[s];
+            for (int c = 0; c < 256; ++c)
+            {
+                int t = next[s * 256 + c];
+                if (t)
+                {
+                    matchFail_[t] = next[fail * 256 + c];
+                    order.push_back(t);
+                }
+                else
+                {
+                    next[s * 256 + c] = next[fail * 256 + c];
+                }
+            }
+        }
+    }
+
+    int AddMatchState()
+    {
+        int s = matchRule_.size();
+        matchNext_.resize((s + 1) * 256);
+        memset(matchNext_.data() + s * 256, 0, sizeof(int) * 256);
+        matchRule_.push_back(-1);
+        return s;
+    }
+
+    //the count pass of a level with multi symbol rules, reads src from begin taking the longest
+    //predecessor at each symbol and sums what the parse writes; the automaton reports every
+    //predecessor ending at a symbol, a start is decided once the longest predecessor it could begin
+    //is read, so only MATCH_WINDOW starts are kept; the matched runs go to runs for the write pass
+    //and exit is where the parse stops, at or past end; given the runs of another parse of the
+    //same symbols it stops where the two meet instead, returning true
+    bool ParseMatches(const unsigned char* src, int size, int begin, int end, int level, LSystemArray<MatchRun>& runs,
+        int& total, int& exit, const LSystemArray<MatchRun>* other) const
+    {
+        int window[MATCH_WINDOW];
+        memset(window, 0, sizeof(window));
+        const int* next = matchNext_.data();
+        const int* output = matchOutput_.data();
+        const int* fail = matchFail_.data();
+        bool positional = HasPositionalRules();
+        int longest = matchMaxLength_;
+        int to = end + longest - 1 < size ? end + longest - 1 : size;
+        int otherIndex = 0;
+        int s = 0;
+        int p = begin;
+        total = 0;
+        for (int j = begin; j < to && p < end; ++j)
+        {
+            s = next[s * 256 + src[j]];
+            for (int t = output[s]; t; t = output[fail[t]])
+            {
+                int rule = matchRule_[t];
+                int start = j + 1 - stringMatches_[rule].predLength;
+                if (start >= p)window[start & (MATCH_WINDOW - 1)] = rule + 1;
+            }
+            while (p < end && (j >= p + longest - 1 || j == to - 1))
+            {
+                if (other)
+                {
+                    while (otherIndex < other->size() &&
+                        (*other)[otherIndex].position + stringMatches_[(*other)[otherIndex].rule].predLength <= p)
+                    {
+                        ++otherIndex;
+                    }
+                    if (otherIndex == other->size() || (*other)[otherIndex].position >= p)
+                    {
+                        exit = p;
+                        return true;
+                    }
+                }
+                int rule = window[p & (MATCH_WINDOW - 1)] - 1;
+                if (rule >= 0)
+                {
+                    const StringMatch& match = stringMatches_[rule];
+                    MatchRun run;
+                    run.position = p;
+                    run.rule = rule;
+                    runs.push_back(run);
+                    total += match.length;
+                    for (int k = 0; k < match.predLength; ++k)
+                    {
+                        window[(p + k) & (MATCH_WINDOW - 1)] = 0;
+                    }
+                    p += match.predLength;
+                }
+                else
+                {
+                    int len = table_[src[p]].length;
+                    if (positional)
+                    {
+                        const char* production;
+                        Select(src, p, level, production, len);
+                    }
+                    total += len ? len : 1;
+                    ++p;
+                }
+            }
+        }
+        exit = p;
+        return false;
+    }
+
+    void NoteArity(char c, int arity)
+    {
+        if (arity > arity_[(unsigned char)c])arity_[(unsigned char)c] = arity;
+    }
+
+    //gives state count parameter columns as long as its symbols, new entries are 0
+    void SetParameterColumns(LSystemState* state, int count)
+    {
+        for (int k = 0; k < count; ++k)
+        {
+            int size = state->params_[k].size();
+            state->params_[k].resize(state->state_.size());
+            for (int i = size; i < state->state_.size(); ++i)
+            {
+                state->params_[k][i] = 0;
+            }
+        }
+        if (count > state->paramCount_)state->paramCount_ = count;
+    }
+
+    int AddRuleText(const char* str, int size)
+    {
+        int begin = ruleText_.size();
+        ruleText_.resize(begin + size);
+        memcpy(ruleText_.data() + begin, str, size);
+        return begin;
+    }
+
+    //weighted and context rules depend on where a symbol is
+    bool HasPositionalRules() const
+    {
+        return stochasticCount_ || contextCount_;
+    }
+
+    //positional, parametric and multi symbol levels are derived from the stored previous level, never streamed
+    bool NeedsStoredLevels() const
+    {
+        return HasPositionalRules() || paramColumns_ || stringCount_;
+    }
+
+    //the history's copy of the level so many steps from the axiom, NULL when it was never derived or was evicted
+    const LSystemState* StoredLevel(int level)
+    {
+        if (levelsStale_)UpdateLevels();
+        if (level < 0 || level >= stateVec_.size())return NULL;
+        const LSystemState* state = stateVec_[level];
+        return state && !state->IsGrammar() ? state : NULL;
+    }
+
+    //builds the neighbour index of the previous level before any context rule is matched in it
+    void PrepareContext(const char* src, int size)
+    {
+        if (contextCount_)contextIndex_.Build(src, size, contextClass_);
+    }
+
+    bool MatchContext(const ContextMatch& match, const unsigned char* src, int index) const
+    {
+        int j = index;
+        for (int k = match.leftLength - 1; k >= 0; --k)
+        {
+            j = contextIndex_.Left(j);
+            if (j < 0 || src[j] != (unsigned char)match.left[k])return false;
+        }
+        j = index;
+        for (int k = 0; k < match.rightLength; ++k)
+        {
+            j = contextIndex_.Right(j);
+            if (j < 0 || src[j] != (unsigned char)match.right[k])return false;
+        }
+        return true;
+    }
+
+    //the production src[index] rewrites to while deriving level from src, the first matching
+    //context rule wins, then weighted symbols draw from the counter based generator so every
+    //thread makes the same pick
+    void Select(const unsigned char* src, int index, int level, const char*& production, int& length) const
+    {
+        unsigned char c = src[index];
+        const SymbolEntry& r = table_[c];
+        for (int i = 0; i < r.contextCount; ++i)
+        {
+            const ContextMatch& match = contexts_[r.contextBegin + i];
+            if (MatchContext(match, src, index))
+            {
+                production = match.production;
+                length = match.length;
+                return;
+            }
+        }
+        production = r.production;
+        length = r.length;
+        if (!r.choiceCount)return;
+        unsigned int random[2];
+        LSystemPhilox(seed_, (unsigned int)level, (unsigned int)index, random);
+        const Choice* choice = choices_.data() + r.choiceBegin;
+        int i = 0;
+        while (i < r.choiceCount - 1 && random[0] > choice[i].threshold)
+        {
+            ++i;
+        }
+        production = choice[i].production;
+        length = choice[i].length;
+    }
+
+    //the 256 bit set of symbols that have a rule, laid out by nibble for the shuffle lookup:
+    //bit h of ruleNibbleLo_[l] is symbol h*16+l for h < 8, ruleNibbleHi_ covers h >= 8
+    void BuildRuleMask()
+    {
+        memset(ruleNibbleLo_, 0, sizeof(ruleNibbleLo_));
+        memset(ruleNibbleHi_, 0, sizeof(ruleNibbleHi_));
+        for (int c = 0; c < 256; ++c)
+        {
+            if (table_[c].length)
+            {
+                int hi = c >> 4;
+                int lo = c & 15;
+                if (hi < 8)ruleNibbleLo_[lo] |= 1 << hi;
+                else ruleNibbleHi_[lo] |= 1 << (hi - 8);
+            }
+        }
+    }
+
+    //collects the symbols reachable from the axiom and the matrix of how many of each
+    //symbol every production writes, a symbol without a rule produces itself
+    void BuildProductionCounts()
+    {
+        memset(activeIndex_, -1, sizeof(activeIndex_));
+        activeSymbols_.resize(0);
+        if (stateVec_.size() > 0)
+        {
+            const LSystemState* axiom = stateVec_[0];
+            for (int i = 0; i < axiom->state_.size(); ++i)
+            {
+                Activate(axiom->state_[i]);
+            }
+        }
+        for (int a = 0; a < activeSymbols_.size(); ++a)
+        {
+            const SymbolEntry& r = table_[(unsigned char)activeSymbols_[a]];
+            for (int i = 0; i < r.length; ++i)
+            {
+                Activate(r.production[i]);
+            }
+            for (int k = 1; k < r.choiceCount; ++k)
+            {
+                const Choice& choice = choices_[r.choiceBegin + k];
+                for (int i = 0; i < choice.length; ++i)
+                {
+                    Activate(choice.production[i]);
+                }
+            }
+            for (int k = 0; k < r.contextCount; ++k)
+            {
+                const ContextMatch& match = contexts_[r.contextBegin + k];
+                for (int i = 0; i < match.length; ++i)
+                {
+                    Activate(match.production[i]);
+                }
+            }
+            for (int k = 0; k < r.paramCount; ++k)
+            {
+                const ParametricMatch& match = paramMatches_[r.paramBegin + k];
+                for (int i = 0; i < match.length; ++i)
+                {
+                    Activate(match.production[i]);
+                }
+            }
+        }
+
+        int n = activeSymbols_.size();
+        productionCounts_.resize(n * n);
+        memset(productionCounts_.data(), 0, sizeof(int) * n * n);
+        for (int a = 0; a < n; ++a)
+        {
+            const SymbolEntry& r = table_[(unsigned char)activeSymbols_[a]];
+            int* row = productionCounts_.data() + a * n;
+            if (!r.length)
+            {
+                row[a] = 1;
+            }
+            for (int i = 0; i < r.length; ++i)
+            {
+                ++row[activeIndex_[(unsigned char)r.production[i]]];
+            }
+        }
+        //level 0 of the expansion lengths, every symbol is itself
+        expansionLength_.resize(n);
+        for (int a = 0; a < n; ++a)
+        {
+            expansionLength_[a] = 1;
+        }
+
+        prefixOffset_.resize(n);
+        prefixBlock_ = 0;
+        for (int a = 0; a < n; ++a)
+        {
+            prefixOffset_[a] = prefixBlock_;
+            prefixBlock_ += table_[(unsigned char)activeSymbols_[a]].length;
+        }
+        childPrefix_.resize(0);
+    }
+
+    void Activate(char c)
+    {
+        if (activeIndex_[(unsigned char)c] == -1)
+        {
+            activeIndex_[(unsigned char)c] = activeSymbols_.size();
+            activeSymbols_.push_back(c);
+        }
+    }
+
+    //extends the per level table of how many symbols each active symbol expands to
+    void ComputeExpansionLengths(int level)
+    {
+        int n = activeSymbols_.size();
+        if (n == 0)return;
+        int computed = expansionLength_.size() / n - 1;
+        if (computed >= level)return;
+        expansionLength_.resize((level + 1) * n);
+        for (int d = computed + 1; d <= level; ++d)
+        {
+            const unsigned long long* prev = expansionLength_.data() + (d - 1) * n;
+            unsigned long long* cur = expansionLength_.data() + d * n;
+            for (int a = 0; a < n; ++a)
+            {
+                const int* row = productionCounts_.data() + a * n;
+                unsigned long long sum = 0;
+                for (int b = 0; b < n; ++b)
+                {
+                    if (row[b])sum = SaturatingAdd(sum, SaturatingMul(prev[b], row[b]));
+                }
+                cur[a] = sum;
+            }
+        }
+
+        childPrefix_.resize(level * prefixBlock_);
+        for (int d = computed + 1; d <= level; ++d)
+        {
+            const unsigned long long* prev = expansionLength_.data() + (d - 1) * n;
+            for (int a = 0; a < n; ++a)
+            {
+                const SymbolEntry& r = table_[(unsigned char)activeSymbols_[a]];
+                unsigned long long* prefix = childPrefix_.data() + (d - 1) * prefixBlock_ + prefixOffset_[a];
+                unsigned long long sum = 0;
+                for (int i = 0; i < r.length; ++i)
+                {
+                    sum = SaturatingAdd(sum, prev[activeIndex_[(unsigned char)r.production[i]]]);
+                    prefix[i] = sum;
+                }
+            }
+        }
+    }
+
+    //running lengths of the children of node (c, depth), ComputeExpansionLengths must cover depth
+    const unsigned long long* ChildPrefix(int depth, char c) const
+    {
+        return childPrefix_.data() + (depth - 1) * prefixBlock_ + prefixOffset_[activeIndex_[(unsigned char)c]];
+    }
+
+    //symbols c expands to after the given number of rewrites, ComputeExpansionLengths must cover it
+    unsigned long long ExpansionLength(int steps, char c) const
+    {
+        return expansionLength_[steps * activeSymbols_.size() + activeIndex_[(unsigned char)c]];
+    }
+
+    //level lengths grow exponentially, clamp instead of wrapping
+    static unsigned long long SaturatingAdd(unsigned long long a, unsigned long long b)
+    {
+        return a + b < a ? ~0ULL : a + b;
+    }
+
+    static unsigned long long SaturatingMul(unsigned long long a, unsigned long long b)
+    {
+        return b && a > ~0ULL / b ? ~0ULL : a * b;
+    }
+
+
+
+    //rewrites state->prevState into state with the fastest path the grammar allows
+    void Derive(LSystemState* state)
+    {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        const LSystemState* prevState = state->prevState;
+        int steps = state->level - stateVec_[0]->level;
+        if (paramColumns_)
+        {
+            DeriveParametric(prevState, state);
+        }
+        else if (grammarStorage_ && ruleFunctionCount_ == 0 && batchFunctionCount_ == 0 && !NeedsStoredLevels())
+        {
+            //nothing to write, only the node rows for the new depth
+            state->grammar_ = true;
+            ComputeExpansionLengths(steps);
+        }
+        else if (prevState->IsGrammar())
+        {
+            //the previous level was never materialized, stream this one from the axiom,
+            //unless it is too long for a buffer and has to stay a grammar level too
+            unsigned long long length = GetLevelLength(steps);
+            if (length > 0x7fffffff)
+            {
+                printf("level %d has %llu symbols, too many for a buffer, kept as a grammar\n", state->level, length);
+                state->grammar_ = true;
+                ComputeExpansionLengths(steps);
+            }
+            else
+            {
+                state->state_.resize((int)length);
+                Stream stream(this, steps);
+                stream.Read(state->state_.data(), state->state_.size());
+                if (packBits_)Pack(state);
+            }
+        }
+        else if (packBits_ || prevState->IsPacked())
+        {
+            DerivePacked(prevState, state);
+        }
+        //rule functions observe the state while it grows, so they keep the symbol by symbol path
+        else if (rewriteMode_ == REWRITE_PARALLEL && pool_ && pool_->GetThreadCount() > 1 && ruleFunctionCount_ == 0 &&
+            prevState->state_.size() >= REWRITE_CHUNK * 2)
+        {
+            RewriteParallel(prevState, state);
+        }
+        else if (rewriteMode_ != REWRITE_SERIAL && ruleFunctionCount_ == 0)
+        {
+            RewriteTwoPass(prevState, state);
+        }
+        else
+        {
+            DeriveSerial(prevState, state);
+        }
+        std::chrono::duration<double> time = std::chrono::high_resolution_clock::now() - start;
+        stats_.symbolsRead = state->IsGrammar() || prevState->IsGrammar() ? 0 : prevState->GetSymbolCount();
+        stats_.symbolsWritten = state->GetSymbolCount();
+        stats_.seconds = time.count();
+    }
+
+    bool IsRetained(int index) const
+    {
+        if (index == 0 || index == stateVec_.size() - 1)return true;
+        switch (retainPolicy_)
+        {
+        case(RETAIN_LAST) :
+            return index >= (int)stateVec_.size() - retainCount_;
+        case(RETAIN_CHECKPOINT) :
+            return stateVec_[index]->level % retainCount_ == 0;
+        case(RETAIN_NONE) :
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    //only RETAIN_NONE hands evicted buffers to the state pool for the next level, the other policies
+    //and the byte cap really free them
+    void Evict(int index, bool recycle)
+    {
+        if (recycle)FreeState(stateVec_[index]);
+        else delete stateVec_[index];
+        stateVec_[index] = NULL;
+        if (index + 1 < stateVec_.size() && stateVec_[index + 1])
+        {
+            stateVec_[index + 1]->prevState = NULL;
+        }
+    }
+
+    //frees the levels the policy does not keep, then the oldest ones while over the byte cap
+    void ApplyRetention()
+    {
+        int top = stateVec_.size() - 1;
+        for (int i = 1; i < top; ++i)
+        {
+            if (stateVec_[i] && !IsRetained(i))Evict(i, retainPolicy_ == RETAIN_NONE);
+        }
+        if (retainBytes_)
+        {
+            size_t bytes = GetHistoryBytes();
+            if (bytes > retainBytes_)
+            {
+                TrimStatePool();
+                bytes = GetHistoryBytes();
+            }
+            for (int i = 1; i < top && bytes > retainBytes_; ++i)
+            {
+                if (stateVec_[i])
+                {
+                    bytes -= stateVec_[i]->GetByteSize();
+                    Evict(i, false);
+                }
+            }
+        }
+    }
+
+    //levels come from the pool first so Iterate/Decrement cycles reuse the buffers of dropped levels
+    LSystemState* NewState(LSystemState* prev)
+    {
+        if (statePool_.size() == 0)return new LSystemState(prev);
+        LSystemState* state = statePool_.back();
+        statePool_.pop_back();
+        state->Recycle(prev);
+        return state;
+    }
+
+    //the pool keeps at most STATE_POOL buffers, enough for two levels to ping-pong
+    void FreeState(LSystemState* state)
+    {
+        if (!state)return;
+        if (statePool_.size() < STATE_POOL)statePool_.push_back(state);
+        else delete state;
+    }
+
+    //after levels are dropped the new top may have been evicted, rederive it from the nearest kept level
+    void RestoreTop()
+    {
+        int top = stateVec_.size() - 1;
+        if (stateVec_[top])return;
+        if (!compiled_)Compile();
+        int from = top;
+        while (!stateVec_[from])
+        {
+            --from;
+        }
+        for (int i = from + 1; i <= top; ++i)
+        {
+            LSystemState* state = NewState(stateVec_[i - 1]);
+            state->level = stateVec_[i - 1]->level + 1;
+            stateVec_[i] = state;
+            Derive(state);
+            if (i - 1 > from && !IsRetained(i - 1))Evict(i - 1, retainPolicy_ == RETAIN_NONE);
+        }
+        ApplyRetention();
+    }
+
+    //derives every level again from the axiom
+    void RebuildLevels()
+    {
+        levelsStale_ = false;
+        int level = stateVec_.back()->level;
+        Decrement(stateVec_.size() - 1);
+        SeekLevel(level);
+    }
+
+    //brings every level up to date after c's rule changed from oldProduction, one level at a time:
+    //runs of the new previous level that were copied from the old one rewrite to the same runs as
+    //before, found through the old level's spans, up to the next c; each c writes its new production
+    //with the parts it shares with the old one still copied, as those symbols expand as before, and
+    //everything else is rewritten; returns false when the levels are not in a form that can be spliced
+    bool Rederive(char c, const char* oldProduction, int oldLength)
+    {
+        if (ruleFunctionCount_ || batchFunctionCount_ || NeedsStoredLevels())return false;
+        int top = stateVec_.size() - 1;
+        for (int l = 1; l <= top; ++l)
+        {
+            const LSystemState* state = stateVec_[l];
+            if (!state || state->IsPacked() || state->IsGrammar() ||
+                (stateVec_[l - 1]->state_.size() && !state->spanRead_.size()))return false;
+        }
+
+        //a symbol without a rule writes itself
+        const char* newProduction = table_[(unsigned char)c].production;
+        int newLength = table_[(unsigned char)c].length;
+        if (!oldLength)
+        {
+            oldProduction = &c;
+            oldLength = 1;
+        }
+        if (!newLength)
+        {
+            newProduction = &c;
+            newLength = 1;
+        }
+        int oldLengths[256];
+        for (int x = 0; x < 256; ++x)
+        {
+            oldLengths[x] = table_[x].length ? table_[x].length : 1;
+        }
+        oldLengths[(unsigned char)c] = oldLength;
+        //every copy run looks up its offset in the old level's spans, a walk of up to SPAN_BLOCK
+        //symbols, so the runs between c's descendants have to be long for the splice to pay: when
+        //c is common in the old next to last level the levels are derived in full in place instead
+        if (top >= 2)
+        {
+            const LSystemState* last = stateVec_[top - 1];
+            const char* symbols = last->state_.data();
+            int size = last->state_.size();
+            int count = 0;
+            for (int i = 0; i < size; ++i)
+            {
+                count += symbols[i] == c;
+            }
+            if ((long long)count * SPAN_BLOCK > size)
+            {
+                DeriveInPlace(1);
+                return true;
+            }
+        }
+        MatchProductions(oldProduction, oldLength, newProduction, newLength);
+
+        spliceOld_.resize(0);
+        AppendSplice(spliceOld_, SPLICE_COPY, 0, stateVec_[0]->state_.size(), 0, 0);
+        LSystemArray<char> oldLevel;
+        LSystemArray<char> scratch;
+        const unsigned char* oldSrc = (const unsigned char*)stateVec_[0]->state_.data();
+        for (int l = 1; l <= top; ++l)
+        {
+            LSystemState* state = stateVec_[l];
+            const LSystemState* prevState = stateVec_[l - 1];
+            const unsigned char* src = (const unsigned char*)prevState->state_.data();
+            int total = PlanSplices(c, src, oldSrc, oldLengths, newLength, state);
+            //once c's descendants are everywhere the splices average only a few symbols and cost more
+            //than they save, the rest is derived in full; small levels cost nothing either way
+            if (total >= STREAM_CHUNK && splices_.size() * 16 > total)
+            {
+                DeriveInPlace(l);
+                break;
+            }
+
+            scratch.resize(total);
+            char* dst = scratch.data();
+            for (int i = 0; i < splices_.size(); ++i)
+            {
+                const Splice& splice = splices_[i];
+                switch (splice.kind)
+                {
+                case(SPLICE_COPY) :
+                    memcpy(dst + splice.write, state->state_.data() + splice.from, splice.length);
+                    break;
+                case(SPLICE_REWRITE) :
+                    WriteRange(src + splice.from, splice.count, dst + splice.write, dst + splice.write + splice.length);
+                    break;
+                default:
+                    memcpy(dst + splice.write, newProduction + splice.from, splice.length);
+                    break;
+                }
+            }
+            //the old level stays around as the old previous level of the next one
+            state->state_.Swap(scratch);
+            oldLevel.Swap(scratch);
+            oldSrc = (const unsigned char*)oldLevel.data();
+            state->spanRead_.Swap(spliceRead_);
+            state->spanWrite_.Swap(spliceWrite_);
+            state->readIndex = prevState->state_.size() - 1;
+            spliceOld_.Swap(splices_);
+        }
+        spliceOld_.reset();
+        splices_.reset();
+        spliceRead_.reset();
+        spliceWrite_.reset();
+        return true;
+    }
+
+    //derives levels from onwards again over their own states, which keeps their buffers
+    void DeriveInPlace(int from)
+    {
+        for (int l = from; l < stateVec_.size(); ++l)
+        {
+            int level = stateVec_[l]->level;
+            stateVec_[l]->Recycle(stateVec_[l - 1]);
+            stateVec_[l]->level = level;
+            Derive(stateVec_[l]);
+        }
+    }
+
+    //lays out level state from the new previous level src and spliceOld_, the splices that built it;
+    //oldSrc is the old previous level and state still holds the old level and its spans,
+    //fills splices_ and the new spans in spliceRead_ and spliceWrite_, returns the new length
+    int PlanSplices(char c, const unsigned char* src, const unsigned char* oldSrc, const int* oldLengths, int newLength,
+        const LSystemState* state)
+    {
+        splices_.resize(0);
+        spliceRead_.resize(0);
+        spliceWrite_.resize(0);
+        const int* oldRead = state->spanRead_.data();
+        const int* oldWrite = state->spanWrite_.data();
+        int oldSpans = state->spanRead_.size();
+
+        //where symbol target of the old previous level wrote to, targets only ever increase so the
+        //cursor jumps to the last span before the target and counts on from there
+        int span = 0;
+        int read = 0;
+        int written = 0;
+        auto offset = [&](int target) -> int
+        {
+            if (span < oldSpans && oldRead[span] <= target)
+            {
+                int lo = span;
+                int hi = oldSpans - 1;
+                while (lo < hi)
+                {
+                    int mid = (lo + hi + 1) / 2;
+                    if (oldRead[mid] <= target)lo = mid;
+                    else hi = mid - 1;
+                }
+                if (oldRead[lo] > read)
+                {
+                    read = oldRead[lo];
+                    written = oldWrite[lo];
+                }
+                span = lo + 1;
+            }
+            for (; read < target; ++read)
+            {
+                written += oldLengths[oldSrc[read]];
+            }
+            return written;
+        };
+
+        int write = 0;
+        for (int i = 0; i < spliceOld_.size(); ++i)
+        {
+            const Splice& prev = spliceOld_[i];
+            int begin = prev.write;
+            int end = prev.write + prev.length;
+            if (prev.kind != SPLICE_COPY)
+            {
+                //new symbols, rewritten in full
+                for (int b = begin; b < end; b += SPAN_BLOCK)
+                {
+                    int count = end - b < SPAN_BLOCK ? end - b : SPAN_BLOCK;
+                    int length = CountRange(src + b, count);
+                    AddSpliceSpan(b, write);
+                    AppendSplice(splices_, SPLICE_REWRITE, write, length, b, count);
+                    write += length;
+                }
+                continue;
+            }
+            int shift = prev.from - begin;
+            for (int p = begin; p < end;)
+            {
+                const unsigned char* hit = (const unsigned char*)memchr(src + p, (unsigned char)c, end - p);
+                int q = hit ? (int)(hit - src) : end;
+                if (q > p)
+                {
+                    int from = offset(p + shift);
+                    AddSpliceSpan(p, write);
+                    //the old spans inside the run carry over so the next edit finds its offsets as quickly
+                    for (int k = span; k < oldSpans && oldRead[k] < q + shift; ++k)
+                    {
+                        AddSpliceSpan(oldRead[k] - shift, oldWrite[k] - from + write);
+                    }
+                    int length = offset(q + shift) - from;
+                    AppendSplice(splices_, SPLICE_COPY, write, length, from, 0);
+                    write += length;
+                }
+                if (q < end)
+                {
+                    int from = offset(q + shift);
+                    AddSpliceSpan(q, write);
+                    for (int k = 0; k < splicePieces_.size(); ++k)
+                    {
+                        const Splice& piece = splicePieces_[k];
+                        AppendSplice(splices_, piece.kind, write + piece.write, piece.length,
+                            piece.kind == SPLICE_COPY ? from + piece.from : piece.from, 0);
+                    }
+                    write += newLength;
+                }
+                p = q + 1;
+            }
+        }
+        return write;
+    }
+
+    void AddSpliceSpan(int read, int write)
+    {
+        if (spliceRead_.size() && spliceRead_.back() >= read)return;
+        spliceRead_.push_back(read);
+        spliceWrite_.push_back(write);
+    }
+
+    //adds a splice, extending the last one when it carries straight on
+    static void AppendSplice(octet::dynarray<Splice>& splices, int kind, int write, int length, int from, int count)
+    {
+        if (splices.size())
+        {
+            Splice& last = splices.back();
+            if (last.kind == kind && last.write + last.length == write &&
+                (kind == SPLICE_REWRITE ? last.from + last.count == from : last.from + last.length == from))
+            {
+                last.length += length;
+                last.count += count;
+                return;
+            }
+        }
+        Splice splice;
+        splice.kind = kind;
+        splice.write = write;
+        splice.length = length;
+        splice.from = from;
+        splice.count = count;
+        splices.push_back(splice);
+    }
+
+    //splits c's new production into splicePieces_, pieces copied from the old production along
+    //their longest common subsequence and pieces only the new production has
+    void MatchProductions(const char* oldProduction, int oldLength, const char* newProduction, int newLength)
+    {
+        splicePieces_.resize(0);
+        int stride = newLength + 1;
+        octet::dynarray<int> common;
+        common.resize((oldLength + 1) * stride);
+        for (int i = oldLength; i >= 0; --i)
+        {
+            for (int j = newLength; j >= 0; --j)
+            {
+                int& n = common[i * stride + j];
+                if (i == oldLength || j == newLength)n = 0;
+                else if (oldProduction[i] == newProduction[j])n = common[(i + 1) * stride + j + 1] + 1;
+                else n = common[(i + 1) * stride + j] > common[i * stride + j + 1] ? common[(i + 1) * stride + j] : common[i * stride + j + 1];
+            }
+        }
+        int i = 0;
+        for (int j = 0; j < newLength;)
+        {
+            if (i < oldLength && oldProduction[i] == newProduction[j])
+            {
+                AppendSplice(splicePieces_, SPLICE_COPY, j, 1, i, 0);
+                ++i;
+                ++j;
+            }
+            else if (i < oldLength && common[(i + 1) * stride + j] >= common[i * stride + j + 1])
+            {
+                ++i;
+            }
+            else
+            {
+                AppendSplice(splicePieces_, SPLICE_PRODUCTION, j, 1, j, 0);
+                ++j;
+            }
+        }
+    }
+
+    //packed levels are rewritten code by code, each production is appended as whole 64 bit words
+    //of pre-packed codes; with rule or batch functions the level goes through a byte copy instead
+    //so the functions still see byte strings in state_
+    void DerivePacked(const LSystemState* prevState, LSystemState* state)
+    {
+        if (ruleFunctionCount_ || batchFunctionCount_ || HasPositionalRules() || !packBits_)
+        {
+            LSystemState bytePrev(*prevState);
+            Unpack(prevState, bytePrev.state_);
+            bytePrev.packed_.resize(0);
+            bytePrev.packBits_ = 0;
+            state->prevState = &bytePrev;
+            if (ruleFunctionCount_)
+            {
+                DeriveSerial(&bytePrev, state);
+            }
+            else
+            {
+                RewriteTwoPass(&bytePrev, state);
+            }
+            state->prevState = prevState;
+            if (packBits_)Pack(state);
+            return;
+        }
+
+        int total = 0;
+        ForEachCode(prevState, [&](int code)
+        {
+            int len = packedLength_[code];
+            total += len ? len : 1;
+        });
+
+        state->packBits_ = packBits_;
+        state->packedCount_ = total;
+        state->packed_.resize(((long long)total * packBits_ + 7) / 8);
+        LSystemBitWriter writer(state->packed_.data());
+        ForEachCode(prevState, [&](int code)
+        {
+            int len = packedLength_[code];
+            if (!len)
+            {
+                writer.Append(code, packBits_);
+                return;
+            }
+            const unsigned long long* words = packedPool_.data() + packedOffset_[code];
+            int bits = len * packBits_;
+            for (; bits > 64; bits -= 64)
+            {
+                writer.Append(*words++, 64);
+            }
+            writer.Append(*words, bits);
+        });
+        writer.Flush();
+        state->readIndex = prevState->GetSymbolCount() - 1;
+    }
+
+    //calls fn with the code of every symbol of a level in order, packed or not
+    template<class Fn> void ForEachCode(const LSystemState* state, Fn fn) const
+    {
+        if (!state->IsPacked())
+        {
+            for (int i = 0; i < state->state_.size(); ++i)
+            {
+                fn(symbolCode_[(unsigned char)state->state_[i]]);
+            }
+            return;
+        }
+        int bits = state->packBits_;
+        int mask = (1 << bits) - 1;
+        int perByte = 8 / bits;
+        const unsigned char* src = state->packed_.data();
+        for (int i = 0; i < state->packedCount_; i += perByte)
+        {
+            unsigned int byte = src[i / perByte];
+            int n = state->packedCount_ - i < perByte ? state->packedCount_ - i : perByte;
+            for (int k = 0; k < n; ++k)
+            {
+                fn((byte >> (k * bits)) & mask);
+            }
+        }
+    }
+
+    //replaces the byte form of a level with its packed form
+    void Pack(LSystemState* state) const
+    {
+        int count = state->state_.size();
+        state->packBits_ = packBits_;
+        state->packedCount_ = count;
+        state->packed_.resize(((long long)count * packBits_ + 7) / 8);
+        LSystemBitWriter writer(state->packed_.data());
+        for (int i = 0; i < count; ++i)
+        {
+            writer.Append(symbolCode_[(unsigned char)state->state_[i]], packBits_);
+        }
+        writer.Flush();
+        state->state_.reset();
+    }
+
+    //decides the pack width for the compiled grammar and packs every production into 64 bit words
+    void BuildPackedProductions()
+    {
+        packBits_ = 0;
+        if (!packRequested_ || codeCount_ == 0)return;
+        if (paramColumns_ || stringCount_)
+        {
+            printf("%s\n", paramColumns_ ? "Parametric levels are not packed" : "Levels with multi symbol rules are not packed");
+            return;
+        }
+        for (int a = 0; a < activeSymbols_.size(); ++a)
+        {
+            if (symbolCode_[(unsigned char)activeSymbols_[a]] == 0xff)
+            {
+                printf("%s%c%s\n", "Symbol ", activeSymbols_[a], " has no code, levels will not be packed");
+                return;
+            }
+        }
+        packBits_ = codeCount_ <= 4 ? 2 : 4;
+
+        packedPool_.resize(0);
+        for (int code = 0; code < codeCount_; ++code)
+        {
+            const SymbolEntry& r = table_[(unsigned char)codeSymbol_[code]];
+            packedLength_[code] = r.length;
+            packedOffset_[code] = packedPool_.size();
+            int words = (r.length * packBits_ + 63) / 64;
+            for (int w = 0; w < words; ++w)
+            {
+                unsigned long long word = 0;
+                for (int k = 0; k < 64 / packBits_; ++k)
+                {
+                    int i = w * (64 / packBits_) + k;
+                    if (i < r.length)word |= (unsigned long long)symbolCode_[(unsigned char)r.production[i]] << (k * packBits_);
+                }
+                packedPool_.push_back(word);
+            }
+        }
+    }
+
+    //parametric levels are rewritten in batches of LSystemExpression::BATCH symbols: the first pass
+    //picks each symbol's rule by evaluating the conditions over the batch and sums the output
+    //lengths, the second writes the productions and then evaluates every argument of a rule over
+    //all the batch's symbols using it, scattering into the parameter columns; rule functions are not run
+    void DeriveParametric(const LSystemState* prevState, LSystemState* state)
+    {
+        const unsigned char* src = (const unsigned char*)prevState->state_.data();
+        int n = prevState->state_.size();
+        const float* columns[LSystemState::MAX_PARAMS];
+        paramZero_.resize(n);
+        memset(paramZero_.data(), 0, sizeof(float) * n);
+        for (int k = 0; k < paramColumns_; ++k)
+        {
+            columns[k] = k < prevState->paramCount_ ? prevState->params_[k].data() : paramZero_.data();
+        }
+        PrepareContext(prevState->state_.data(), n);
+        paramRule_.resize(n);
+        paramOffset_.resize(n + 1);
+
+        int rows[LSystemExpression::BATCH];
+        float values[LSystemExpression::BATCH];
+        int total = 0;
+        for (int b = 0; b < n; b += LSystemExpression::BATCH)
+        {
+            int end = b + LSystemExpression::BATCH < n ? b + LSystemExpression::BATCH : n;
+            for (int i = b; i < end; ++i)
+            {
+                paramRule_[i] = -1;
+            }
+            for (int s = 0; s < paramSymbols_.size(); ++s)
+            {
+                unsigned char c = paramSymbols_[s];
+                const SymbolEntry& r = table_[c];
+                int count = 0;
+                for (int i = b; i < end; ++i)
+                {
+                    if (src[i] == c)rows[count++] = i;
+                }
+                for (int m = 0; m < r.paramCount && count; ++m)
+                {
+                    const ParametricMatch& match = paramMatches_[r.paramBegin + m];
+                    if (!match.conditionLength)
+                    {
+                        for (int j = 0; j < count; ++j)paramRule_[rows[j]] = r.paramBegin + m;
+                        break;
+                    }
+                    LSystemExpression::Evaluate(paramCode_.data() + match.conditionBegin, match.conditionLength, columns, rows, count, values);
+                    int left = 0;
+                    for (int j = 0; j < count; ++j)
+                    {
+                        if (values[j] != 0)paramRule_[rows[j]] = r.paramBegin + m;
+                        else rows[left++] = rows[j];
+                    }
+                    count = left;
+                }
+            }
+            for (int i = b; i < end; ++i)
+            {
+                paramOffset_[i] = total;
+                int len;
+                if (paramRule_[i] >= 0)len = paramMatches_[paramRule_[i]].length;
+                else
+                {
+                    const char* production;
+                    Select(src, i, state->level, production, len);
+                }
+                total += len ? len : 1;
+            }
+        }
+        paramOffset_[n] = total;
+
+        state->state_.resize(total);
+        for (int k = 0; k < paramColumns_; ++k)
+        {
+            state->params_[k].resize(total);
+            memset(state->params_[k].data(), 0, sizeof(float) * total);
+        }
+        state->paramCount_ = paramColumns_;
+        char* dst = state->state_.data();
+        for (int b = 0; b < n; b += LSystemExpression::BATCH)
+        {
+            int end = b + LSystemExpression::BATCH < n ? b + LSystemExpression::BATCH : n;
+            for (int i = b; i < end; ++i)
+            {
+                const char* production;
+                int len;
+                if (paramRule_[i] >= 0)
+                {
+                    production = paramMatches_[paramRule_[i]].production;
+                    len = paramMatches_[paramRule_[i]].length;
+                }
+                else
+                {
+                    Select(src, i, state->level, production, len);
+                }
+                if (len)
+                {
+                    memcpy(dst + paramOffset_[i], production, len);
+                    continue;
+                }
+                //no rule, the symbol keeps its parameters
+                dst[paramOffset_[i]] = src[i];
+                for (int k = 0; k < paramColumns_; ++k)
+                {
+                    state->params_[k][paramOffset_[i]] = columns[k][i];
+                }
+            }
+            for (int m = 0; m < paramMatches_.size(); ++m)
+            {
+                const ParametricMatch& match = paramMatches_[m];
+                if (!match.assignCount)continue;
+                int count = 0;
+                for (int i = b; i < end; ++i)
+                {
+                    if (paramRule_[i] == m)rows[count++] = i;
+                }
+                if (!count)continue;
+                for (int a = 0; a < match.assignCount; ++a)
+                {
+                    const ParametricAssign& assign = paramAssigns_[match.assignBegin + a];
+                    LSystemExpression::Evaluate(paramCode_.data() + assign.codeBegin, assign.codeLength, columns, rows, count, values);
+                    float* column = state->params_[assign.slot].data() + assign.position;
+                    for (int j = 0; j < count; ++j)
+                    {
+                        column[paramOffset_[rows[j]]] = values[j];
+                    }
+                }
+            }
+        }
+        state->readIndex = n - 1;
+    }
+
+    //the bodies of the Visualize functions, viz may be the LSystemLowering in front of the caller's visualizer
+    template<class Visualizer>
+    void VisualizeLevel(Visualizer* viz)
+    {
+        LSystemState* state = stateVec_.back();
+        if (state->IsGrammar())
+        {
+            StreamLevel(viz, state->level - stateVec_[0]->level);
+            return;
+        }
+        viz->SetState(state);
+        info_ ? viz->Init(info_) : viz->Init(NULL);
+        bool finished;
+        if (state->IsPacked())
+        {
+            finished = VisualizePacked(state, viz);
+        }
+        else if (state->paramCount_)
+        {
+            finished = VisualizeParametric(state, viz);
+        }
+        else
+        {
+            const unsigned char* symbols = (const unsigned char*)state->state_.data();
+            int size = state->state_.size();
+            finished = true;
+            for (int begin = 0; begin < size && (finished = Report(0, viz)); begin += STREAM_CHUNK)
+            {
+                int end = size - begin < STREAM_CHUNK ? size : begin + STREAM_CHUNK;
+                for (int i = begin; i < end; ++i)
+                {
+                    CallKey(table_[symbols[i]].key, viz);
+                }
+            }
+        }
+        if (finished && Report(0, viz))viz->Finished();
+    }
+
+    template<class Visualizer>
+    void StreamLevel(Visualizer* viz, int level)
+    {
+        if (NeedsStoredLevels())
+        {
+            SeekLevel(level);
+            VisualizeLevel(viz);
+            return;
+        }
+        Stream stream(this, level);
+        viz->SetState(stateVec_[0]);
+        info_ ? viz->Init(info_) : viz->Init(NULL);
+        char buffer[STREAM_CHUNK];
+        int count;
+        while ((count = stream.Read(buffer, STREAM_CHUNK)) > 0)
+        {
+            if (!Report(count, viz))return;
+            for (int i = 0; i < count; ++i)
+            {
+                CallKey(table_[(unsigned char)buffer[i]].key, viz);
+            }
+        }
+        if (Report(0, viz))viz->Finished();
+    }
+
+    template<class Visualizer>
+    void PipelineLevel(Visualizer* viz, int level)
+    {
+        const LSystemState* stored = NULL;
+        if (NeedsStoredLevels())
+        {
+            SeekLevel(level);
+            if (!Report(0, NULL))return;
+            stored = stateVec_.back();
+            if (stored->paramCount_ || stored->IsGrammar())
+            {
+                VisualizeLevel(viz);
+                return;
+            }
+        }
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        pipeStats_ = PipelineStats();
+        viz->SetState(stored ? stateVec_.back() : stateVec_[0]);
+        info_ ? viz->Init(info_) : viz->Init(NULL);
+
+        int slots = PIPELINE_DEPTH + 2;//one chunk held by each stage on top of the queued ones
+        pipeSymbols_.resize(slots * PIPELINE_CHUNK);
+        pipeCounts_.resize(slots);
+        pipeBatches_.resize(slots);
+        LSystemQueue<int> freeSymbols(slots);
+        LSystemQueue<int> fullSymbols(slots);
+        LSystemQueue<int> freeBatches(slots);
+        LSystemQueue<int> fullBatches(slots);
+        for (int i = 0; i < slots; ++i)
+        {
+            freeSymbols.Push(i);
+            freeBatches.Push(i);
+        }
+        double seconds[PIPELINE_STAGES];
+        bool cancelled = false;
+
+        std::thread derive([&]()
+        {
+            std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+            Stream stream(this, stored ? 0 : level);
+            int read = 0;
+            int slot;
+            while (freeSymbols.Pop(slot))
+            {
+                char* out = pipeSymbols_.data() + slot * PIPELINE_CHUNK;
+                int count;
+                if (stored)
+                {
+                    count = stored->GetSymbolCount() - read < PIPELINE_CHUNK ? stored->GetSymbolCount() - read : PIPELINE_CHUNK;
+                    if (stored->IsPacked())
+                    {
+                        for (int i = 0; i < count; ++i)
+                        {
+                            out[i] = GetSymbol(stored, read + i);
+                        }
+                    }
+                    else
+                    {
+                        memcpy(out, stored->state_.data() + read, count);
+                    }
+                    read += count;
+                }
+                else
+                {
+                    count = stream.Read(out, PIPELINE_CHUNK);
+                }
+                if (count <= 0)break;
+                pipeCounts_[slot] = count;
+                if (!fullSymbols.Push(slot))break;
+            }
+            fullSymbols.Close();
+            seconds[STAGE_DERIVE] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+        });
+
+        std::thread interpret([&]()
+        {
+            std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+            bool defer = viz->CanDefer();
+            int slot;
+            int batch;
+            while (fullSymbols.Pop(slot))
+            {
+                int count = pipeCounts_[slot];
+                if (!Report(stored ? 0 : count, viz))
+                {
+                    cancelled = true;
+                    freeSymbols.Close();
+                    freeBatches.Close();
+                    break;
+                }
+                if (!freeBatches.Pop(batch))break;
+                pipeBatches_[batch].Clear();
+                if (defer)viz->SetBatch(&pipeBatches_[batch]);
+                const unsigned char* symbols = (const unsigned char*)pipeSymbols_.data() + slot * PIPELINE_CHUNK;
+                for (int i = 0; i < count; ++i)
+                {
+                    CallKey(table_[symbols[i]].key, viz);
+                }
+                if (defer)viz->SetBatch(NULL);
+                pipeStats_.symbols += count;
+                ++pipeStats_.chunks;
+                freeSymbols.Push(slot);
+                if (!fullBatches.Push(batch))break;
+            }
+            viz->SetBatch(NULL);
+            fullBatches.Close();
+            seconds[STAGE_INTERPRET] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+        });
+
+        //the geometry is built on the calling thread
+        std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+        int batch;
+        while (fullBatches.Pop(batch))
+        {
+            viz->BuildGeometry(pipeBatches_[batch]);
+            freeBatches.Push(batch);
+        }
+        seconds[STAGE_MESH] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+        interpret.join();
+        derive.join();
+
+        pipeStats_.starved[STAGE_INTERPRET] = fullSymbols.popWait;
+        pipeStats_.starved[STAGE_MESH] = fullBatches.popWait;
+        pipeStats_.blocked[STAGE_DERIVE] = freeSymbols.popWait;
+        pipeStats_.blocked[STAGE_INTERPRET] = freeBatches.popWait;
+        for (int i = 0; i < PIPELINE_STAGES; ++i)
+        {
+            pipeStats_.busy[i] = seconds[i] - pipeStats_.starved[i] - pipeStats_.blocked[i];
+        }
+        pipeStats_.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        if (!cancelled && Report(0, viz))viz->Finished();
+    }
+
+    //every symbol of a parametric level hands its parameters to the visualizer before its key,
+    //false when the generation was cancelled part way
+    template<class Visualizer>
+    bool VisualizeParametric(const LSystemState* state, Visualizer* viz)
+    {
+        const unsigned char* symbols = (const unsigned char*)state->state_.data();
+        float params[LSystemState::MAX_PARAMS];
+        for (int i = 0; i < state->state_.size(); ++i)
+        {
+            if (i % STREAM_CHUNK == 0 && !Report(0, viz))return false;
+            int count = arity_[symbols[i]] < state->paramCount_ ? arity_[symbols[i]] : state->paramCount_;
+            for (int k = 0; k < count; ++k)
+            {
+                params[k] = state->params_[k][i];
+            }
+            viz->SetParameters(params, count);
+            CallKey(table_[symbols[i]].key, viz);
+        }
+        return true;
+    }
+
+    //the original symbol by symbol path, rule functions see the level as it grows,
+    //a run matched by a multi symbol rule is written as one and runs no rule functions
+    void DeriveSerial(const LSystemState* prevState, LSystemState* state)
+    {
+        const unsigned char* src = (const unsigned char*)prevState->state_.data();
+        int size = prevState->state_.size();
+        PrepareContext(prevState->state_.data(), size);
+        const LSystemArray<MatchRun>* runs = NULL;
+        int run = 0;
+        if (stringCount_)
+        {
+            int total;
+            int exit;
+            ResetMatchRuns(1);
+            ParseMatches(src, size, 0, size, state->level, chunkRuns_[0], total, exit, NULL);
+            runs = &chunkRuns_[0];
+        }
+        BatchCollector batch(this, prevState, state);
+        int nextSpan = 0;
+        for (int i = 0; i < size;)
+        {
+            state->readIndex = i;
+            if (i >= nextSpan)
+            {
+                state->spanRead_.push_back(i);
+                state->spanWrite_.push_back(state->state_.size());
+                nextSpan = i + SPAN_BLOCK;
+            }
+            if (runs && run < runs->size() && (*runs)[run].position == i)
+            {
+                const StringMatch& match = stringMatches_[(*runs)[run++].rule];
+                int oldSize = state->state_.size();
+                state->state_.resize(oldSize + match.length);
+                if (match.length)memcpy(state->state_.data() + oldSize, match.production, match.length);
+                i += match.predLength;
+                continue;
+            }
+            int write = state->state_.size();
+            ProcessSymbol(state, prevState->state_[i]);
+            if (table_[src[i]].batch)batch.Add(i, write, src[i]);
+            ++i;
+        }
+        batch.Flush();
+    }
+
+    void ProcessSymbol(LSystemState* state, const char c)
+    {
+        const SymbolEntry& r = table_[(unsigned char)c];
+        const char* production;
+        int length;
+        Select((const unsigned char*)state->prevState->state_.data(), state->readIndex, state->level, production, length);
+        if (length)
+        {
+            if (state->state_.size() > 0)
+            {
+                int oldSize = state->state_.size();
+                state->state_.resize(state->state_.size() + length);
+                memcpy(state->state_.data() + oldSize, production, length);
+            }
+            else
+            {
+                state->state_.resize(length);
+                memcpy(state->state_.data(), production, length);
+            }
+        }
+        else
+        {
+            state->state_.push_back(c);
+        }
+
+        if (r.func)
+        {
+            r.func(state);
+        }
+    }
+
+    //first pass sums the production lengths so the level is allocated once,
+    //the second pass writes every production straight into place
+    void RewriteTwoPass(const LSystemState* prevState, LSystemState* state)
+    {
+        const unsigned char* src = (const unsigned char*)prevState->state_.data();
+        int srcSize = prevState->state_.size();
+        if (stringCount_)
+        {
+            PrepareContext(prevState->state_.data(), srcSize);
+            ResetMatchRuns(1);
+            int total;
+            int exit;
+            ParseMatches(src, srcSize, 0, srcSize, state->level, chunkRuns_[0], total, exit, NULL);
+            state->state_.resize(total);
+            WriteRangeMatched(src, 0, srcSize, state->level, chunkRuns_[0], state->state_.data(), state->state_.data() + total);
+        }
+        else if (HasPositionalRules())
+        {
+            PrepareContext(prevState->state_.data(), srcSize);
+            state->state_.resize(CountRangePositional(src, 0, srcSize, state->level));
+            WriteRangePositional(src, 0, srcSize, state->level, state->state_.data());
+        }
+        else
+        {
+            ResizeSpans(state, srcSize);
+            state->state_.resize(CountSpans(src, 0, srcSize, state));
+            WriteRange(src, srcSize, state->state_.data(), state->state_.data() + state->state_.size());
+        }
+        if (batchFunctionCount_)RunBatches(prevState, state, 0, srcSize, 0, stringCount_ ? &chunkRuns_[0] : NULL);
+        state->readIndex = srcSize - 1;
+    }
+
+    //the same two passes per chunk, a prefix sum over the chunk lengths gives each chunk
+    //its write offset so the output matches RewriteTwoPass byte for byte
+    void RewriteParallel(const LSystemState* prevState, LSystemState* state)
+    {
+        const unsigned char* src = (const unsigned char*)prevState->state_.data();
+        int srcSize = prevState->state_.size();
+        int chunks = (srcSize + REWRITE_CHUNK - 1) / REWRITE_CHUNK;
+        int level = state->level;
+        bool positional = HasPositionalRules();
+        bool matched = stringCount_ != 0;
+        //the neighbour index is built once up front, the chunks only read it
+        if (positional || matched)PrepareContext(prevState->state_.data(), srcSize);
+        else ResizeSpans(state, srcSize);
+        if (matched)ResetMatchRuns(chunks);
+        chunkOffsets_.resize(chunks + 1);
+        int* offsets = chunkOffsets_.data();
+        chunkEntries_.resize(chunks + 1);
+        int* entries = chunkEntries_.data();
+        entries[0] = 0;
+
+        pool_->Run(chunks, [&](int c)
+        {
+            int begin = c * REWRITE_CHUNK;
+            int end = begin + REWRITE_CHUNK < srcSize ? begin + REWRITE_CHUNK : srcSize;
+            if (matched)ParseMatches(src, srcSize, begin, end, level, chunkRuns_[c], offsets[c + 1], entries[c + 1], NULL);
+            else offsets[c + 1] = positional ? CountRangePositional(src, begin, end, level) : CountSpans(src, begin, end, state);
+        });
+        if (matched)ResyncChunks(src, srcSize, chunks, level);
+        offsets[0] = 0;
+        for (int c = 0; c < chunks; ++c)
+        {
+            offsets[c + 1] += offsets[c];
+        }
+        //the chunks counted their spans from their own start
+        for (int k = 0; k < state->spanWrite_.size(); ++k)
+        {
+            state->spanWrite_[k] += offsets[k * SPAN_BLOCK / REWRITE_CHUNK];
+        }
+
+        state->state_.resize(offsets[chunks]);
+        char* dst = state->state_.data();
+        pool_->Run(chunks, [&](int c)
+        {
+            int begin = c * REWRITE_CHUNK;
+            int end = begin + REWRITE_CHUNK < srcSize ? begin + REWRITE_CHUNK : srcSize;
+            if (matched)WriteRangeMatched(src, entries[c], end, level, chunkRuns_[c], dst + offsets[c], dst + offsets[c + 1]);
+            else if (positional)WriteRangePositional(src, begin, end, level, dst + offsets[c]);
+            else WriteRange(src + begin, end - begin, dst + offsets[c], dst + offsets[c + 1]);
+            if (batchFunctionCount_)RunBatches(prevState, state, matched ? entries[c] : begin, end, offsets[c], matched ? &chunkRuns_[c] : NULL);
+        });
+        state->readIndex = srcSize - 1;
+    }
+
+    //gathers the occurrences of batched symbols in one run and hands them to their functions
+    //CALLBACK_BATCH at a time, occurrences sharing a function and context go in one call;
+    //it lives on the stack of the thread deriving the run so nothing is shared or allocated
+    class BatchCollector
+    {
+    public:
+        BatchCollector(const LSystem* lSys, const LSystemState* prevState, LSystemState* state) :
+            lSys_(lSys), prevState_(prevState), state_(state), count_(0)
+        {
+        }
+
+        void Add(int read, int write, char symbol)
+        {
+            read_[count_] = read;
+            write_[count_] = write;
+            symbols_[count_] = symbol;
+            if (++count_ == CALLBACK_BATCH)Flush();
+        }
+
+        void Flush()
+        {
+            int left = count_;
+            while (left > 0)
+            {
+                const SymbolEntry& first = lSys_->table_[(unsigned char)symbols_[0]];
+                LSystemBatch batch;
+                batch.readIndex = groupRead_;
+                batch.writeIndex = groupWrite_;
+                batch.symbols = groupSymbols_;
+                batch.count = 0;
+                batch.level = state_->level;
+                batch.prevState = prevState_;
+                batch.state = state_;
+                batch.context = first.batchContext;
+                BatchFunc func = first.batch;
+                int kept = 0;
+                for (int i = 0; i < left; ++i)
+                {
+                    const SymbolEntry& e = lSys_->table_[(unsigned char)symbols_[i]];
+                    if (e.batch == func && e.batchContext == batch.context)
+                    {
+                        groupRead_[batch.count] = read_[i];
+                        groupWrite_[batch.count] = write_[i];
+                        groupSymbols_[batch.count++] = symbols_[i];
+                    }
+                    else
+                    {
+                        read_[kept] = read_[i];
+                        write_[kept] = write_[i];
+                        symbols_[kept++] = symbols_[i];
+                    }
+                }
+                func(batch);
+                left = kept;
+            }
+            count_ = 0;
+        }
+
+    private:
+        const LSystem* lSys_;
+        const LSystemState* prevState_;
+        LSystemState* state_;
+        int count_;
+        int read_[CALLBACK_BATCH];
+        int write_[CALLBACK_BATCH];
+        char symbols_[CALLBACK_BATCH];
+        int groupRead_[CALLBACK_BATCH];
+        int groupWrite_[CALLBACK_BATCH];
+        char groupSymbols_[CALLBACK_BATCH];
+    };
+    friend class BatchCollector;
+
+    //walks the run [begin, end) of the previous level again once its output is written at write,
+    //so the batch functions see finished productions whichever rewrite path wrote them
+    void RunBatches(const LSystemState* prevState, LSystemState* state, int begin, int end, int write,
+        const LSystemArray<MatchRun>* runs) const
+    {
+        const unsigned char* src = (const unsigned char*)prevState->state_.data();
+        bool positional = HasPositionalRules();
+        BatchCollector batch(this, prevState, state);
+        int run = 0;
+        for (int i = begin; i < end;)
+        {
+            const char* production;
+            int len;
+            if (runs && run < runs->size() && (*runs)[run].position == i)
+            {
+                const StringMatch& match = stringMatches_[(*runs)[run++].rule];
+                write += match.length;
+                i += match.predLength;
+                continue;
+            }
+            if (positional)Select(src, i, state->level, production, len);
+            else len = table_[src[i]].length;
+            if (table_[src[i]].batch)batch.Add(i, write, src[i]);
+            write += len ? len : 1;
+            ++i;
+        }
+        batch.Flush();
+    }
+
+    void ResizeSpans(LSystemState* state, int srcSize) const
+    {
+        int blocks = (srcSize + SPAN_BLOCK - 1) / SPAN_BLOCK;
+        state->spanRead_.resize(blocks);
+        state->spanWrite_.resize(blocks);
+    }
+
+    //counts the run [begin, end) a SPAN_BLOCK at a time and records where each block's output
+    //starts, relative to the run, begin is a multiple of SPAN_BLOCK
+    int CountSpans(const unsigned char* src, int begin, int end, LSystemState* state) const
+    {
+        int total = 0;
+        for (int b = begin; b < end; b += SPAN_BLOCK)
+        {
+            state->spanRead_[b / SPAN_BLOCK] = b;
+            state->spanWrite_[b / SPAN_BLOCK] = total;
+            total += CountRange(src + b, end - b < SPAN_BLOCK ? end - b : SPAN_BLOCK);
+        }
+        return total;
+    }
+
+    //number of symbols the given run of the previous level rewrites to
+    int CountRange(const unsigned char* src, int size) const
+    {
+#ifdef LSYSTEM_X86
+        if (simd_ == LSYSTEM_SIMD_AVX2)return CountRangeAVX2(src, size);
+        if (simd_ == LSYSTEM_SIMD_SSSE3)return CountRangeSSSE3(src, size);
+#endif
+        return CountRangeScalar(src, size);
+    }
+
+    //rewrites a run of the previous level into dst, returns the end of the written symbols
+    //nothing is written at or past dstEnd, the end of this run's output
+    char* WriteRange(const unsigned char* src, int size, char* dst, char* dstEnd) const
+    {
+#ifdef LSYSTEM_X86
+        if (simd_ == LSYSTEM_SIMD_AVX2)return WriteRangeAVX2(src, size, dst, dstEnd);
+        if (simd_ == LSYSTEM_SIMD_SSSE3)return WriteRangeSSSE3(src, size, dst, dstEnd);
+#endif
+        return WriteRangeScalar(src, size, dst);
+    }
+
+    //positional rules look at the whole previous level src, the run is src[begin, end)
+    int CountRangePositional(const unsigned char* src, int begin, int end, int level) const
+    {
+        int total = 0;
+        for (int i = begin; i < end; ++i)
+        {
+            const char* production;
+            int len;
+            Select(src, i, level, production, len);
+            total += len ? len : 1;
+        }
+        return total;
+    }
+
+    char* WriteRangePositional(const unsigned char* src, int begin, int end, int level, char* dst) const
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            const char* production;
+            int len;
+            Select(src, i, level, production, len);
+            if (len)
+            {
+                memcpy(dst, production, len);
+                dst += len;
+            }
+            else
+            {
+                *dst++ = src[i];
+            }
+        }
+        return dst;
+    }
+
+    //what the symbols of [begin, end) write through their own rules
+    int CountRangeUnmatched(const unsigned char* src, int begin, int end, int level) const
+    {
+        if (HasPositionalRules())return CountRangePositional(src, begin, end, level);
+        return CountRange(src + begin, end - begin);
+    }
+
+    //the write pass of a level with multi symbol rules, the runs ParseMatches found are copied in
+    //whole and the symbols between them go through the usual range writers
+    char* WriteRangeMatched(const unsigned char* src, int begin, int end, int level, const LSystemArray<MatchRun>& runs,
+        char* dst, char* dstEnd) const
+    {
+        bool positional = HasPositionalRules();
+        int i = begin;
+        for (int k = 0; k <= (int)runs.size(); ++k)
+        {
+            int stop = k < runs.size() ? runs[k].position : end;
+            if (stop > i)
+            {
+                if (positional)dst = WriteRangePositional(src, i, stop, level, dst);
+                else dst = WriteRange(src + i, stop - i, dst, dstEnd);
+            }
+            if (k == runs.size())break;
+            const StringMatch& match = stringMatches_[runs[k].rule];
+            if (match.length)memcpy(dst, match.production, match.length);
+            dst += match.length;
+            i = stop + match.predLength;
+        }
+        return dst;
+    }
+
+    //each chunk parsed itself as if it started on its first symbol, a run matched across the edge
+    //by the chunk before moves the real start; the real parse is redone from there until it meets
+    //the assumed one, a few symbols in, and the chunk's count and runs are patched, or it is
+    //carried to the end of the chunk when they never meet
+    void ResyncChunks(const unsigned char* src, int srcSize, int chunks, int level)
+    {
+        int* offsets = chunkOffsets_.data();
+        int* entries = chunkEntries_.data();
+        for (int c = 1; c < chunks; ++c)
+        {
+            int begin = c * REWRITE_CHUNK;
+            int end = begin + REWRITE_CHUNK < srcSize ? begin + REWRITE_CHUNK : srcSize;
+            if (entries[c] == begin)continue;
+            LSystemArray<MatchRun>& assumed = chunkRuns_[c];
+            resyncRuns_.resize(0);
+            int gained;
+            int meet;
+            if (!ParseMatches(src, srcSize, entries[c], end, level, resyncRuns_, gained, meet, &assumed))
+            {
+                offsets[c + 1] = gained;
+                entries[c + 1] = meet;
+                assumed.Swap(resyncRuns_);
+                continue;
+            }
+            //what the assumed parse wrote before the meeting point
+            int lost = 0;
+            int i = begin;
+            int k = 0;
+            for (; k < assumed.size() && assumed[k].position < meet; ++k)
+            {
+                const StringMatch& match = stringMatches_[assumed[k].rule];
+                lost += CountRangeUnmatched(src, i, assumed[k].position, level) + match.length;
+                i = assumed[k].position + match.predLength;
+            }
+            lost += CountRangeUnmatched(src, i, meet, level);
+            offsets[c + 1] += gained - lost;
+            for (; k < assumed.size(); ++k)
+            {
+                resyncRuns_.push_back(assumed[k]);
+            }
+            assumed.Swap(resyncRuns_);
+        }
+    }
+
+    //one list of matched runs per chunk, emptied
+    void ResetMatchRuns(int chunks)
+    {
+        if ((int)chunkRuns_.size() < chunks)chunkRuns_.resize(chunks);
+        for (int c = 0; c < chunks; ++c)
+        {
+            chunkRuns_[c].resize(0);
+        }
+    }
+
+    int CountRangeScalar(const unsigned char* src, int size) const
+    {
+        int total = 0;
+        for (int i = 0; i < size; ++i)
+        {
+            int len = table_[src[i]].length;
+            total += len ? len : 1;
+        }
+        return total;
+    }
+
+    char* WriteRangeScalar(const unsigned char* src, int size, char* dst) const
+    {
+        for (int i = 0; i < size; ++i)
+        {
+            const SymbolEntry& r = table_[src[i]];
+            int len = r.length;
+            if (len)
+            {
+                memcpy(dst, r.production, len);
+                dst += len;
+            }
+            else
+            {
+                *dst++ = src[i];
+            }
+        }
+        return dst;
+    }
+
+#ifdef LSYSTEM_X86
+    //bit i of the result is set when block[i] has a rule
+    LSYSTEM_TARGET_SSSE3 unsigned int ClassifySSSE3(__m128i block) const
+    {
+        const __m128i tableLo = _mm_loadu_si128((const __m128i*)ruleNibbleLo_);
+        const __m128i tableHi = _mm_loadu_si128((const __m128i*)ruleNibbleHi_);
+        const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        __m128i lo = _mm_and_si128(block, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(block, 4), nibble);
+        __m128i upper = _mm_cmpgt_epi8(hi, _mm_set1_epi8(7));
+        __m128i row = _mm_or_si128(_mm_andnot_si128(upper, _mm_shuffle_epi8(tableLo, lo)),
+            _mm_and_si128(upper, _mm_shuffle_epi8(tableHi, lo)));
+        __m128i bit = _mm_shuffle_epi8(bits, hi);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+    }
+
+    LSYSTEM_TARGET_AVX2 unsigned int ClassifyAVX2(__m256i block) const
+    {
+        const __m256i tableLo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ruleNibbleLo_));
+        const __m256i tableHi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ruleNibbleHi_));
+        const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+            1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        __m256i lo = _mm256_and_si256(block, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble);
+        __m256i upper = _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7));
+        __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(tableLo, lo), _mm256_shuffle_epi8(tableHi, lo), upper);
+        __m256i bit = _mm256_shuffle_epi8(bits, hi);
+        return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+    }
+
+    //only symbols with rules change the length, so each block starts at its own size
+    //and adds the extra length of its rule symbols
+    LSYSTEM_TARGET_SSSE3 int CountRangeSSSE3(const unsigned char* src, int size) const
+    {
+        int total = 0;
+        int i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            unsigned int m = ClassifySSSE3(_mm_loadu_si128((const __m128i*)(src + i)));
+            total += 16;
+            while (m)
+            {
+                total += table_[src[i + LSystemLowestBit(m)]].length - 1;
+                m &= m - 1;
+            }
+        }
+        return total + CountRangeScalar(src + i, size - i);
+    }
+
+    LSYSTEM_TARGET_AVX2 int CountRangeAVX2(const unsigned char* src, int size) const
+    {
+        int total = 0;
+        int i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            unsigned int m = ClassifyAVX2(_mm256_loadu_si256((const __m256i*)(src + i)));
+            total += 32;
+            while (m)
+            {
+                total += table_[src[i + LSystemLowestBit(m)]].length - 1;
+                m &= m - 1;
+            }
+        }
+        return total + CountRangeScalar(src + i, size - i);
+    }
+
+    //runs of symbols without rules are copied with a full width store, later writes overwrite
+    //whatever the store put past the run, so the store is only used when it stays inside
+    //both src and the output range
+    LSYSTEM_TARGET_SSSE3 char* WriteRangeSSSE3(const unsigned char* src, int size, char* dst, char* dstEnd) const
+    {
+        int i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+            unsigned int m = ClassifySSSE3(block);
+            if (!m && dst + 16 <= dstEnd)
+            {
+                _mm_storeu_si128((__m128i*)dst, block);
+                dst += 16;
+                continue;
+            }
+            int pos = 0;
+            for (;;)
+            {
+                int next = m ? LSystemLowestBit(m) : 16;
+                int run = next - pos;
+                if (run)
+                {
+                    if (i + pos + 16 <= size && dst + 16 <= dstEnd)
+                    {
+                        _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)(src + i + pos)));
+                    }
+                    else
+                    {
+                        memcpy(dst, src + i + pos, run);
+                    }
+                    dst += run;
+                }
+                if (!m)break;
+                const SymbolEntry& r = table_[src[i + next]];
+                memcpy(dst, r.production, r.length);
+                dst += r.length;
+                pos = next + 1;
+                m &= m - 1;
+            }
+        }
+        return WriteRangeScalar(src + i, size - i, dst);
+    }
+
+    LSYSTEM_TARGET_AVX2 char* WriteRangeAVX2(const unsigned char* src, int size, char* dst, char* dstEnd) const
+    {
+        int i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            __m256i block = _mm256_loadu_si256((const __m256i*)(src + i));
+            unsigned int m = ClassifyAVX2(block);
+            if (!m && dst + 32 <= dstEnd)
+            {
+                _mm256_storeu_si256((__m256i*)dst, block);
+                dst += 32;
+                continue;
+            }
+            int pos = 0;
+            for (;;)
+            {
+                int next = m ? LSystemLowestBit(m) : 32;
+                int run = next - pos;
+                if (run)
+                {
+                    if (i + pos + 32 <= size && dst + 32 <= dstEnd)
+                    {
+                        _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)(src + i + pos)));
+                    }
+                    else
+                    {
+                        memcpy(dst, src + i + pos, run);
+                    }
+                    dst += run;
+                }
+                if (!m)break;
+                const SymbolEntry& r = table_[src[i + next]];
+                memcpy(dst, r.production, r.length);
+                dst += r.length;
+                pos = next + 1;
+                m &= m - 1;
+            }
+        }
+        return WriteRangeScalar(src + i, size - i, dst);
+    }
+#endif
+
+    //reads the codes a byte at a time and maps each code straight to its key,
+    //false when the generation was cancelled part way
+    template<class Visualizer>
+    bool VisualizePacked(const LSystemState* state, Visualizer* viz)
+    {
+        int keys[16];
+        for (int code = 0; code < 16; ++code)
+        {
+            keys[code] = code < codeCount_ ? table_[(unsigned char)codeSymbol_[code]].key : KEY_NULL;
+        }
+        int bits = state->packBits_;
+        int mask = (1 << bits) - 1;
+        int perByte = 8 / bits;
+        const unsigned char* src = state->packed_.data();
+        for (int i = 0; i < state->packedCount_; i += perByte)
+        {
+            if (i % STREAM_CHUNK == 0 && !Report(0, viz))return false;
+            unsigned int byte = src[i / perByte];
+            int n = state->packedCount_ - i < perByte ? state->packedCount_ - i : perByte;
+            for (int k = 0; k < n; ++k)
+            {
+                CallKey(keys[(byte >> (k * bits)) & mask], viz);
+            }
+        }
+        return true;
+    }
+
+    //the keys of one TURTLE_CHUNK of a stored byte or packed level, returns how many there are
+    int ChunkKeys(const LSystemState* state, int chunk, unsigned char* keys) const
+    {
+        int begin = chunk * TURTLE_CHUNK;
+        int count = state->GetSymbolCount() - begin < TURTLE_CHUNK ? state->GetSymbolCount() - begin : TURTLE_CHUNK;
+        if (!state->IsPacked())
+        {
+            const unsigned char* symbols = (const unsigned char*)state->state_.data() + begin;
+            for (int i = 0; i < count; ++i)
+            {
+                keys[i] = (unsigned char)table_[symbols[i]].key;
+            }
+            return count;
+        }
+        int bits = state->packBits_;
+        int mask = (1 << bits) - 1;
+        const unsigned char* src = state->packed_.data();
+        for (int i = 0; i < count; ++i)
+        {
+            unsigned long long bit = (unsigned long long)(begin + i) * bits;
+            keys[i] = (unsigned char)table_[(unsigned char)codeSymbol_[(src[bit >> 3] >> (bit & 7)) & mask]].key;
+        }
+        return count;
+    }
+
+    //adds to the progress counters, false once the generation has been cancelled
+    bool Report(unsigned long long symbols, const LSystemVisualizer* viz)
+    {
+        if (!progress_)return true;
+        if (symbols)progress_->symbols += symbols;
+        if (viz)progress_->vertices = viz->GetVertexCount();
+        return !progress_->cancel;
+    }
+
+    template<class Visualizer>
+    void CallKey(int key, Visualizer* viz)
+    {
+        switch (key)
+        {
+        case(KEY_DRAW) :
+            viz->DrawLine();
+            break;
+        case(KEY_PLUS_ROTATE) :
+            viz->RotatePositive();
+            break;
+        case(KEY_MINUS_ROTATE) :
+            viz->RotateNegative();
+            break;
+        case(KEY_PUSH) :
+            viz->PushStack();
+            break;
+        case(KEY_POP) :
+            viz->PopStack();
+            break;
+        case(KEY_LEAF) :
+            viz->DrawLeaf();
+            break;
+        case(KEY_ROTATE) :
+            viz->Rotate();
+            break;
+        case(KEY_CUSTOM) :
+            viz->Custom();
+            break;
+        }
+    }
+
+private:
+    LSystemDrawInfo* info_;
+
+    octet::dynarray<LSystemState*> stateVec_;//one entry per level, NULL once a level is evicted
+    octet::hash_map<char, SymbolRef> referenceMap_;
+    octet::dynarray<char> axiom_;
+    octet::dynarray<char> alphabet_;
+
+    REWRITE_MODE rewriteMode_;
+    int ruleFunctionCount_;
+    int batchFunctionCount_;
+    IterateStats stats_;
+    PipelineStats pipeStats_;
+
+    bool declared_[256];//symbols present in referenceMap_
+    bool compiled_;
+    SymbolEntry table_[256];
+    octet::dynarray<char> productionPool_;
+
+    int activeIndex_[256];//index into activeSymbols_, -1 for symbols that never appear
+    octet::dynarray<char> activeSymbols_;
+    octet::dynarray<int> productionCounts_;//activeSymbols_ squared, row a counts the symbols a produces
+    octet::dynarray<unsigned long long> expansionLength_;//one row of activeSymbols_ per level
+    octet::dynarray<unsigned long long> childPrefix_;//one block per depth, the children prefix sums of every production
+    octet::dynarray<int> prefixOffset_;//start of each active symbol's production inside a block
+    int prefixBlock_;
+
+    LSystemThreadPool* pool_;
+    octet::dynarray<int> chunkOffsets_;
+    octet::dynarray<int> chunkEntries_;//where each chunk's parse really starts, for multi symbol rules
+
+    LSYSTEM_SIMD simd_;
+
+    unsigned int seed_;
+    int stochasticCount_;//symbols with weighted rules, their levels can only be derived in full
+    octet::dynarray<StochasticRule> stochasticRules_;
+    octet::dynarray<Choice> choices_;
+    int contextCount_;//symbols with context rules
+    octet::dynarray<ContextRule> contextRules_;
+    octet::dynarray<ContextMatch> contexts_;
+    bool ignored_[256];
+    unsigned char contextClass_[256];//LSystemBracketIndex::CLASS of every byte
+    LSystemBracketIndex contextIndex_;
+    octet::dynarray<char> ruleText_;//text of the weighted, context, parametric and multi symbol rules as added
+    int arity_[256];//parameters carried by each symbol
+    int paramColumns_;//parameter columns of parametric levels, the largest arity, 0 for plain grammars
+    octet::dynarray<ParametricRule> paramRules_;
+    octet::dynarray<LSystemOp> paramCode_;
+    octet::dynarray<int> paramArgLengths_;
+    octet::dynarray<int> paramModuleArgs_;
+    octet::dynarray<ParametricMatch> paramMatches_;
+    octet::dynarray<ParametricAssign> paramAssigns_;
+    octet::dynarray<char> paramSymbols_;//symbols with parametric rules
+    octet::dynarray<int> paramRule_;//match picked for each symbol of the level being rewritten, -1 for none
+    octet::dynarray<int> paramOffset_;//where each symbol's production starts
+    octet::dynarray<float> paramZero_;
+    int stringCount_;//distinct multi symbol predecessors
+    octet::dynarray<StringRule> stringRules_;
+    octet::dynarray<StringMatch> stringMatches_;
+    octet::dynarray<int> matchNext_;//predecessor automaton, 256 entries per node, failure transitions filled in
+    octet::dynarray<int> matchRule_;//stringMatches_ index of the rule ending at each node, -1 for none
+    octet::dynarray<int> matchFail_;//node of the longest proper suffix that is also in the trie
+    octet::dynarray<int> matchOutput_;//nearest node with a rule on the failure chain, the node itself included, 0 for none
+    int matchMaxLength_;//longest predecessor
+    std::vector<LSystemArray<MatchRun> > chunkRuns_;//multi symbol runs the count pass matched, per chunk
+    LSystemArray<MatchRun> resyncRuns_;
+
+    LSystemArray<Splice> spliceOld_;//how Rederive built the previous level
+    LSystemArray<Splice> splices_;
+    octet::dynarray<Splice> splicePieces_;//c's new production against its old one
+    LSystemArray<int> spliceRead_;//spans of the level Rederive is building
+    LSystemArray<int> spliceWrite_;
+    bool levelsStale_;//rules were edited since the levels were derived
+    bool staleMixed_;//the edits touched more than one symbol
+    char staleSymbol_;//the first symbol edited
+    octet::dynarray<char> staleProduction_;//its production when the levels were derived
+
+    LSystemProgress* progress_;
+
+    bool lowerTurtle_;
+    LSystemOpcodes opcodes_;
+
+    //chunks in flight through VisualizePipelined
+    octet::dynarray<char> pipeSymbols_;
+    octet::dynarray<int> pipeCounts_;
+    std::vector<LSystemGeometryBatch> pipeBatches_;
+
+    octet::dynarray<LSystemState*> statePool_;//dropped levels, reused last in first out
+    RETAIN_POLICY retainPolicy_;
+    int retainCount_;
+    size_t retainBytes_;
+
+    bool grammarStorage_;
+    bool packRequested_;
+    int packBits_;//bits per symbol of new levels, 0 when they are stored as bytes
+    int codeCount_;
+    unsigned char symbolCode_[256];//0xff for symbols outside the code table
+    char codeSymbol_[16];
+    int packedLength_[16];//production length per code, 0 when it has no rule
+    int packedOffset_[16];//first word of the production in packedPool_
+    octet::dynarray<unsigned long long> packedPool_;
+    unsigned char ruleNibbleLo_[16];
+    unsigned char ruleNibbleHi_[16];
+};
+
+#include <fstream>
+//the importer kept seperate from the LSystem for reduction in function count and use
+//only one public function, to read into an LSystem
+class LSystemImporter
+{
+public:
+    LSystemImporter(){}
+    ~LSystemImporter(){}
+
+    bool Load(LSystem* lSys, const char* filename)
+    {
+        std::fstream file;
+
+        file.open(filename, std::ios::in);
+        if (!file.is_open())
+        {
+            assert(0);
+        }
+
+        file.seekg(0, file.end);
+        int length = file.tellg();
+        file.seekg(0, file.beg);
+
+        read_.resize(length);
+        file.read(read_.data(), length);
+        CleanWhiteSpace();
+
+        file.close();
+
+        octet::string str(read_.data(), read_.size());
+        bool check = false;
+        check = LoadKeyDeclerations(lSys, str);
+        if (!check)return false;
+        check = LoadAlphabet(lSys, str);
+        if (!check)return false;
+        LoadIgnore(lSys, str);
+        check = LoadAxiom(lSys, str);
+        if (!check)return false;
+        check = LoadRules(lSys, str);
+        if (!check)return false;
+        check = LoadDrawInfo(lSys, str);
+        if (!check) return false;
+        lSys->SetCodeTable(usedSymbols_.data(), usedSymbols_.size());
+        lSys->Compile();
+
+        read_.resize(0);
+        tempAlphabet_.resize(0);
+        usedSymbols_.resize(0);
+
+        return true;
+    }
+private:
+    //load the symbol alphabet from the text file containing all non-inbuilt symbols in the L system
+    //a local version is stored for error checking in the Axiom and Rule sections
+    bool LoadAlphabet(LSystem* lSys, octet::string& str)
+    {
+        int startLoc = str.find("Alphabet");
+
+        if (startLoc == -1)
+        {
+            printf("%s", "Could not find the Alphabet subsection.\n");
+            assert(false);
+            return false;
+        }
+        startLoc += 8;//size of "Alphabet"
+        int endLoc = FindSymbolAfter('}', startLoc);
+        if (endLoc == -1)
+        {
+            printf("%s", "No close brackets after Alphabet section.\n");
+            assert(false);
+            return false;
+        }
+        int counter = 0;
+
+        for (int i = startLoc; i < endLoc; ++i)
+        {
+            if (IsNotGrammer(read_[i]))
+            {
+                lSys->AddAlphabetSymbol(read_[i]);
+                tempAlphabet_.push_back(read_[i]);
+                ++counter;
+            }
+        }
+        return true;
+    }
+
+    //an axiom with parameters, F(1,0.5)[+F(0.5,0.2)]; the arguments are constant expressions
+    bool LoadParametricAxiom(LSystem* lSys, int startLoc, int endLoc)
+    {
+        while (startLoc < endLoc && !IsNotGrammer(read_[startLoc]))
+        {
+            ++startLoc;
+        }
+        int axiomEndLoc = FindSymbolAfter(';', startLoc);
+        if (axiomEndLoc == -1 || axiomEndLoc > endLoc)axiomEndLoc = endLoc;
+        octet::dynarray<char> symbols;
+        octet::dynarray<int> moduleArgs;
+        octet::dynarray<int> argLengths;
+        octet::dynarray<LSystemOp> code;
+        if (!ParseModules(startLoc, axiomEndLoc, NULL, 0, symbols, moduleArgs, argLengths, code) || symbols.size() == 0)
+        {
+            printf("%s\n", "No axiom was found");
+            assert(false);
+            return false;
+        }
+        for (int i = 0; i < symbols.size(); ++i)
+        {
+            if (!IsInAlphabet(symbols[i]))
+            {
+                printf("%s%c%s\n", "Symbol ", symbols[i], " is not in the Alphabet, but is in the Axiom");
+                assert(false);
+                return false;
+            }
+            MarkUsed(symbols[i]);
+        }
+        lSys->SetAxiom(symbols.data(), symbols.size());
+        int arg = 0;
+        int codeLoc = 0;
+        int row = 0;
+        for (int i = 0; i < symbols.size(); ++i)
+        {
+            for (int k = 0; k < moduleArgs[i]; ++k, ++arg)
+            {
+                float value;
+                LSystemExpression::Evaluate(code.data() + codeLoc, argLengths[arg], NULL, &row, 1, &value);
+                codeLoc += argLengths[arg];
+                lSys->SetAxiomParameter(i, k, value);
+            }
+        }
+        return true;
+    }
+
+    //optional, the symbols context rules look past, usually the rotations
+    void LoadIgnore(LSystem* lSys, octet::string& str)
+    {
+        int startLoc = str.find("Ignore");
+        if (startLoc == -1)
+        {
+            return;
+        }
+        startLoc += 6;//size of "Ignore"
+        int endLoc = FindSymbolAfter('}', startLoc);
+        if (endLoc == -1)
+        {
+            printf("%s", "No close brackets after Ignore section.\n");
+            return;
+        }
+        for (int i = startLoc; i < endLoc; ++i)
+        {
+            if (IsNotGrammer(read_[i]))
+            {
+                lSys->AddIgnoredSymbol(read_[i]);
+            }
+        }
+    }
+
+    //load the axiom, fairly simple, find the first string and load all of it
+    //grammer inside the axiom will be ignored, but it will complain
+    bool LoadAxiom(LSystem* lSys, octet::string& str)
+    {
+        int startLoc = str.find("Axiom");
+
+        if (startLoc == -1)
+        {
+            printf("%s\n", "Could not find the Axiom subsection.\n");
+            assert(false);
+            return false;
+        }
+        startLoc += 5;//size of "Axiom"
+        int endLoc = FindSymbolAfter('}', startLoc);
+        if (endLoc == -1)
+        {
+            printf("%s\n", "No close brackets after Axiom section.\n");
+            assert(false);
+            return false;
+        }
+        int paramLoc = FindSymbolAfter('(', startLoc);
+        if (paramLoc != -1 && paramLoc < endLoc)
+        {
+            return LoadParametricAxiom(lSys, startLoc, endLoc);
+        }
+        octet::dynarray<char> arr;
+        for (int i = startLoc; i < endLoc; ++i)
+        {
+            if (IsNotGrammer(read_[i]))
+            {
+                if (IsInAlphabet(read_[i]))
+                {
+                    arr.push_back(read_[i]);
+                }
+                else
+                {
+                    printf("%s%c%s\n", "Symbol ", read_[i], " is not in the Alphabet, but is in the Axiom");
+                }
+            }
+            else if (read_[i] == ';')//if we find semicolon, be consistant and exit early
+            {
+                break;
+            }
+            else //otherwise complain about grammer inside Axiom, we dont care but they should
+            {
+                if (arr.size() > 0)
+                {
+                    printf("%s\n", "Grammer found in Axiom will be ignored, consider removing it.");
+                }
+            }
+        }//END OF FOR
+        if (arr.size() == 0)
+        {
+            printf("%s\n", "No axiom was found");
+            assert(false);
+            return false;
+        }
+        lSys->SetAxiom(arr.data(), arr.size());
+        for (int i = 0; i < arr.size(); ++i)
+        {
+            MarkUsed(arr[i]);
+        }
+        return true;
+    }
+
+    //loads the simple symbol replacement rules
+    //F=FF replaces one symbol, FX=XF replaces the run FX, the longest run wins when several could match
+    bool LoadRules(LSystem* lSys, octet::string& str)
+    {
+        int startLoc = str.find("Rules");
+        if (startLoc == -1)
+        {
+            printf("%s", "Could not find the Rules subsection.\n");
+            assert(false);
+            return false;
+        }
+        startLoc += 6;//size of "Rules"
+        int endLoc = FindSymbolAfter('}', startLoc);
+        if (endLoc == -1)
+        {
+            printf("%s", "No close brackets after Rules section.\n");
+            assert(false);
+            return false;
+        }
+
+        for (int i = startLoc; i < endLoc; ++i)
+        {
+            if (read_[i] == '=')
+            {
+                char symbol(read_[i - 1]);
+                int ruleStartLoc = i - 1;
+                while (ruleStartLoc > startLoc && read_[ruleStartLoc - 1] != ';' && read_[ruleStartLoc - 1] != '{')
+                {
+                    --ruleStartLoc;
+                }
+                //parametric rules, F(l,w):l>1=...; parameters and condition can be left out
+                int paramLoc = -1;
+                int colonLoc = -1;
+                for (int j = ruleStartLoc; j < i; ++j)
+                {
+                    if (read_[j] == '(' && paramLoc == -1)paramLoc = j;
+                    if (read_[j] == ':' && colonLoc == -1)colonLoc = j;
+                }
+                bool parametric = paramLoc != -1 || colonLoc != -1;
+                if (parametric)symbol = read_[ruleStartLoc];
+                //context rules, left<symbol>right=...; either context can be left out
+                int leftLoc = -1;
+                int rightLoc = -1;
+                for (int j = ruleStartLoc; j < i && !parametric; ++j)
+                {
+                    if (read_[j] == '<')leftLoc = j;
+                    if (read_[j] == '>')rightLoc = j;
+                }
+                if (leftLoc != -1 || rightLoc != -1)
+                {
+                    int predLoc = leftLoc != -1 ? leftLoc + 1 : ruleStartLoc;
+                    int predEndLoc = rightLoc != -1 ? rightLoc : i;
+                    if (predEndLoc - predLoc != 1)
+                    {
+                        printf("%s\n", "A context rule needs exactly one symbol between its contexts");
+                        assert(false);
+                        return false;
+                    }
+                    symbol = read_[predLoc];
+                }
+                bool multi = !parametric && leftLoc == -1 && rightLoc == -1 && i - ruleStartLoc > 1;
+                if (multi)symbol = read_[ruleStartLoc];
+                if (IsNotGrammer(symbol))
+                {
+                    if (IsInAlphabet(symbol))
+                    {
+                        int ruleEndLoc = FindSymbolAfter(';', i);
+                        if (ruleEndLoc>endLoc || ruleEndLoc == -1)
+                        {
+                            printf("%s%c%s\n", "No semicolon after ", symbol, "'s rule");
+                            assert(false);
+                            return false;
+                        }
+                        int bodyLoc = i + 1;
+                        int bodyParamLoc = FindSymbolAfter('(', bodyLoc + 1);
+                        if (read_[bodyLoc] != '(' && bodyParamLoc != -1 && bodyParamLoc < ruleEndLoc)parametric = true;
+                        if (parametric)
+                        {
+                            if (!LoadParametricRule(lSys, symbol, paramLoc, colonLoc, i, ruleEndLoc))return false;
+                            i = ruleEndLoc + 1;
+                            continue;
+                        }
+                        if (read_[bodyLoc] == '(' && multi)
+                        {
+                            printf("%s\n", "A weighted rule needs exactly one symbol before the =");
+                            assert(false);
+                            return false;
+                        }
+                        if (read_[bodyLoc] == '(')
+                        {
+                            //weighted alternative, F=(0.33)F[+F]F;
+                            int weightEndLoc = FindSymbolAfter(')', bodyLoc);
+                            if (weightEndLoc > ruleEndLoc || weightEndLoc == -1)
+                            {
+                                printf("%s%c%s\n", "No close bracket after ", symbol, "'s rule weight");
+                                assert(false);
+                                return false;
+                            }
+                            float weight = (float)atof(octet::string(&read_[bodyLoc + 1], weightEndLoc - bodyLoc - 1).c_str());
+                            bodyLoc = weightEndLoc + 1;
+                            lSys->AddStochasticRule(symbol, weight, &read_[bodyLoc], ruleEndLoc - bodyLoc);
+                        }
+                        else if (leftLoc != -1 || rightLoc != -1)
+                        {
+                            int leftSize = leftLoc != -1 ? leftLoc - ruleStartLoc : 0;
+                            int rightSize = rightLoc != -1 ? i - rightLoc - 1 : 0;
+                            lSys->AddContextRule(symbol, &read_[ruleStartLoc], leftSize, &read_[rightLoc + 1], rightSize,
+                                &read_[bodyLoc], ruleEndLoc - bodyLoc);
+                        }
+                        else if (multi)
+                        {
+                            lSys->AddStringRule(&read_[ruleStartLoc], i - ruleStartLoc, &read_[bodyLoc], ruleEndLoc - bodyLoc);
+                            for (int j = ruleStartLoc; j < i; ++j)
+                            {
+                                MarkUsed(read_[j]);
+                            }
+                        }
+                        else
+                        {
+                            lSys->AddBasicRules(symbol, octet::string(&read_[i + 1], ruleEndLoc - 1 - i));// take the chracters till the ;, excluding the ;
+                        }
+                        MarkUsed(symbol);
+                        for (int j = bodyLoc; j < ruleEndLoc; ++j)
+                        {
+                            MarkUsed(read_[j]);
+                        }
+                        i = ruleEndLoc + 1;//skip the rule we just read for effiency
+                    }
+                    else
+                    {
+                        printf("%s%c%s\n", "Symbol ", symbol, " is not in Alphabet, but is in Rules");
+                    }
+                }
+            }//END OF GRAMMER
+        }//END OF FOR
+        return true;
+    }
+
+    //symbol(l,w):condition=production; with single letter parameters, the condition and
+    //every argument in the production are compiled to LSystemExpression code
+    bool LoadParametricRule(LSystem* lSys, char symbol, int paramLoc, int colonLoc, int equalsLoc, int ruleEndLoc)
+    {
+        octet::dynarray<char> names;
+        int headEndLoc = colonLoc != -1 ? colonLoc : equalsLoc;
+        if (paramLoc != -1)
+        {
+            int closeLoc = FindSymbolAfter(')', paramLoc);
+            if (closeLoc == -1 || closeLoc > headEndLoc)
+            {
+                printf("%s%c%s\n", "No close bracket after ", symbol, "'s parameters");
+                assert(false);
+                return false;
+            }
+            for (int j = paramLoc + 1; j < closeLoc; ++j)
+            {
+                if (read_[j] != ',')names.push_back(read_[j]);
+            }
+        }
+        octet::dynarray<LSystemOp> code;
+        int conditionLength = 0;
+        if (colonLoc != -1)
+        {
+            if (!LSystemExpression::Compile(&read_[colonLoc + 1], equalsLoc - colonLoc - 1, names.data(), names.size(), code))
+            {
+                assert(false);
+                return false;
+            }
+            conditionLength = code.size();
+        }
+        octet::dynarray<char> symbols;
+        octet::dynarray<int> moduleArgs;
+        octet::dynarray<int> argLengths;
+        if (!ParseModules(equalsLoc + 1, ruleEndLoc, names.data(), names.size(), symbols, moduleArgs, argLengths, code))
+        {
+            assert(false);
+            return false;
+        }
+        lSys->AddParametricRule(symbol, names.size(), code.data(), conditionLength, argLengths.data(), moduleArgs.data(),
+            symbols.data(), symbols.size());
+        MarkUsed(symbol);
+        for (int j = 0; j < symbols.size(); ++j)
+        {
+            MarkUsed(symbols[j]);
+        }
+        return true;
+    }
+
+    //splits read_[begin, end) into symbols, each optionally followed by (expression,expression...),
+    //the arguments are compiled against names and appended to code
+    bool ParseModules(int begin, int end, const char* names, int nameCount, octet::dynarray<char>& symbols,
+        octet::dynarray<int>& moduleArgs, octet::dynarray<int>& argLengths, octet::dynarray<LSystemOp>& code)
+    {
+        for (int j = begin; j < end; ++j)
+        {
+            symbols.push_back(read_[j]);
+            int args = 0;
+            if (j + 1 < end && read_[j + 1] == '(')
+            {
+                int depth = 0;
+                int argLoc = j + 2;
+                int k = j + 1;
+                for (; k < end; ++k)
+                {
+                    if (read_[k] == '(')++depth;
+                    if (read_[k] == ')' && --depth == 0)break;
+                    if (read_[k] == ',' && depth == 1)
+                    {
+                        if (!CompileArgument(argLoc, k, names, nameCount, argLengths, code))return false;
+                        argLoc = k + 1;
+                        ++args;
+                    }
+                }
+                if (k == end)
+                {
+                    printf("%s%c%s\n", "No close bracket after ", read_[j], "'s arguments");
+                    return false;
+                }
+                if (!CompileArgument(argLoc, k, names, nameCount, argLengths, code))return false;
+                ++args;
+                j = k;
+            }
+            moduleArgs.push_back(args);
+        }
+        return true;
+    }
+
+    bool CompileArgument(int begin, int end, const char* names, int nameCount, octet::dynarray<int>& argLengths,
+        octet::dynarray<LSystemOp>& code)
+    {
+        int size = code.size();
+        if (!LSystemExpression::Compile(&read_[begin], end - begin, names, nameCount, code))return false;
+        argLengths.push_back(code.size() - size);
+        return true;
+    }
+
+    //loads any special key replacements, by default +,-,[,],F are reserved for special use
+    //Any of these can be overloaded with their own custom symbol
+    bool LoadKeyDeclerations(LSystem* lSys, octet::string& str)
+    {
+
+        int startLoc = str.find("KeyDecl");
+        lSys->SetKeyDecl('F', LSystem::KEY_DRAW);
+        lSys->SetKeyDecl('[', LSystem::KEY_PUSH);
+        lSys->SetKeyDecl(']', LSystem::KEY_POP);
+        lSys->SetKeyDecl('+', LSystem::KEY_PLUS_ROTATE);
+        lSys->SetKeyDecl('-', LSystem::KEY_MINUS_ROTATE);
+
+        if (startLoc == -1)
+        {
+            return true;
+        }
+        startLoc += 7; //size of the string KeyDecl
+        int endLoc = FindSymbolAfter('}', startLoc);
+        if (endLoc == -1)
+        {
+            printf("%s", "No close brackets after KeyDecl section.\n");
+            assert(false);
+            return false;
+        }
+
+        for (int i = startLoc; i < endLoc; ++i)
+        {
+            if (read_[i] == '=')
+            {
+                char newSymbol;
+                if (IsNotGrammer(read_[i - 1]))
+                {
+                    newSymbol = read_[i - 1];
+                    int end = FindSymbolAfter(';', i);
+                    octet::string key(&read_[i + 1], end - 1 - i);
+                    LSystem::KEY_SYMBOLS keyNum = KeyFromString(key);
+                    if (keyNum != LSystem::KEY_NULL)
+                    {
+                        lSys->SetKeyDecl(newSymbol, keyNum);
+                        i += key.size();
+                    }
+                    else
+                    {
+                        printf("%s%s%s\n", "Malformed KeyDecl assignment, ", key.c_str(), " not recognised");
+                    }
+                }
+                else
+                {
+                    printf("%s%c%s\n", "Malformed KeyDecl assignment, ", newSymbol, " is grammer");
+                   
+                }
+            }//END OF READ IF
+        }//END OF FOR
+        return true;
+    }
+
+    bool LoadDrawInfo(LSystem* lSys, octet::string& str)
+    {
+        int startPos = str.find("DrawInfo");
+        if (startPos == -1)
+        {
+            return true;
+        }
+        startPos += 9; //size of "DrawInfo{"
+        int endPos = FindSymbolAfter('}', startPos);
+
+        if (endPos == -1)
+        {
+            printf("%s", "No close brackets after DrawInfo section");
+            assert(false);
+            return false;
+        }
+
+        float arr[sizeof(LSystemDrawInfo) / sizeof(float)] = { 0 };
+        int counter = 0;
+        for (int i = startPos; i < endPos; ++i)
+        {
+            int equals = FindSymbolAfter('=', i);
+            int eol = FindSymbolAfter(';',equals);
+            if (eol>endPos)
+            {
+                printf("%s", "No semicolon after statement");
+                assert(false);
+                return false;
+            }
+            octet::string value(&read_[i], equals - i);
+            octet::string key(&read_[equals + 1], (eol - equals)-1);
+            arr[InfoLocFromString(key)] = atof(value);
+            i = eol;
+            counter++;
+        }
+        if (counter > 0)
+        {
+            LSystemDrawInfo* info = new LSystemDrawInfo();
+            memcpy(info, arr, sizeof(info)*sizeof(float));
+            lSys->SetDrawInfo(info);
+        }
+    
+    }
+private:
+    //lineraly searches for the next instance of a symbol after a current point
+    int FindSymbolAfter(char symbol, int loc)
+    {
+        for (int i = loc; i < read_.size(); ++i)
+        {
+            if (read_[i] == symbol)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+    // simple fix for built in types, conversion from string to enum
+    static LSystem::KEY_SYMBOLS KeyFromString(const octet::string& c)
+    {
+        if (c == "KEY_DRAW")
+        {
+            return LSystem::KEY_DRAW;
+        }
+        if (c == "KEY_PLUS_ROTATE")
+        {
+            return LSystem::KEY_PLUS_ROTATE;
+        }
+        if (c == "KEY_MINUS_ROTATE")
+        {
+            return LSystem::KEY_MINUS_ROTATE;
+        }
+        if (c == "KEY_PUSH")
+        {
+            return LSystem::KEY_PUSH;
+        }
+        if (c == "KEY_POP")
+        {
+            return LSystem::KEY_POP;
+        }
+
+        //Possible extension of features
+        if (c == "KEY_LEAF")
+        {
+            return LSystem::KEY_LEAF;
+        }
+        if (c == "KEY_ROTATE")
+        {
+            return LSystem::KEY_ROTATE;
+        }
+        if (c == "KEY_CUSTOM")
+        {
+            return LSystem::KEY_CUSTOM;
+        }
+
+        return LSystem::KEY_NULL;
+    }
+
+    static int InfoLocFromString(const octet::string& c)
+    {
+        if (c == "LENGTH")
+        {
+            return 0;
+        }
+        if (c == "LENGTH_REDUCTION")
+        {
+            return 1;
+        }
+        if (c == "WIDTH")
+        {
+            return 2;
+        }
+        if (c == "WIDTH_REDUCTION")
+        {
+            return 3;
+        }
+        if (c == "MIN_ROT_X")
+        {
+            return 4;
+        }
+        if (c == "MAX_ROT_X")
+        {
+            return 7;
+        }
+        if (c == "MIN_ROT_Y")
+        {
+            return 5;
+        }
+        if (c== "MAX_ROT_Y")
+        {
+            return 8;
+        }
+        if (c == "MIN_ROT_Z")
+        {  
+            return 6;
+        }
+        if (c == "MAX_ROT_Z")
+        {
+            return 9;
+        }
+    }
+
+    //cheks to see if that char is grammer
+    //grammer being defined as the characters in quote marks ||| , { } =  ; |||
+    inline bool IsNotGrammer(char c)
+    {
+        return (c != ','&&c != '{'&&c != '}'&&c != '='&&c != ';');
+    }
+
+    //records a symbol that appears in the axiom or the rules, these make up the code table
+    void MarkUsed(char c)
+    {
+        for (int i = 0; i < usedSymbols_.size(); ++i)
+        {
+            if (usedSymbols_[i] == c)return;
+        }
+        usedSymbols_.push_back(c);
+    }
+
+    //checks to see if that char was seen in our alphabet
+    bool IsInAlphabet(char c)
+    {
+        //instead, make sure that the tempAlphabet vec is sorted,
+        //or have 255 sized array containing bools if the symbol had been added
+        //this will work for now, as it is unlikely the alphabet will be too long
+        for (int i = 0; i < tempAlphabet_.size(); ++i)
+        {
+            if (tempAlphabet_[i] == c)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //clean out whitespace from the data
+    void CleanWhiteSpace()
+    {
+        //looks for new line, space and tabs and deletes them
+        char* readPtr = read_.data();
+        char* writePtr = read_.data();
+        char* endPtr = read_.data() + read_.size();
+        int counter = 0;
+        while (readPtr != endPtr)
+        {
+            if (*readPtr != ' ' && *readPtr != '\n' && *readPtr != '\t')//if its not whitespace
+            {
+                ++counter; //we found a character, so increment eg (A,B,c,d etc...)
+                if (*writePtr == ' ' || *writePtr == '\n' || *writePtr == '\t')// if we can write into whitespace
+                {
+                    *writePtr = *readPtr; //do it
+                    *readPtr = ' ';// and replace our reading character with whitespace
+                }
+                ++readPtr;
+                ++writePtr;
+            }
+            else
+            {
+
+                ++readPtr;//we are going over whitespace, skip it
+            }
+        }
+        read_.resize(counter);//keep the size conistant
+    }
+private:
+    octet::dynarray<char> tempAlphabet_;
+    octet::dynarray<char> read_;
+    octet::dynarray<char> usedSymbols_;
+};
+
+//runs generation jobs one at a time on its own thread so the caller keeps drawing the last result,
+//starting a job cancels the running one through the shared progress, so give that progress to
+//every LSystem the jobs use with LSystem::SetProgress, jobs must not touch GL
+class LSystemGenerator
+{
+public:
+    typedef std::function<void()> Job;
+
+    LSystemGenerator() :hasJob_(false), running_(false), complete_(false), quit_(false)
+    {
+        worker_ = std::thread(&LSystemGenerator::WorkerLoop, this);
+    }
+    ~LSystemGenerator()
+    {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            quit_ = true;
+            hasJob_ = false;
+            if (running_)progress_.cancel = true;
+        }
+        wake_.notify_all();
+        worker_.join();
+    }
+
+    //cancels the running job and queues this one, only the newest queued job is kept
+    void Start(const Job& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            job_ = job;
+            hasJob_ = true;
+            complete_ = false;
+            if (running_)progress_.cancel = true;
+        }
+        wake_.notify_all();
+    }
+
+    //cancels the running job and drops the queued one
+    void Cancel()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        hasJob_ = false;
+        complete_ = false;
+        if (running_)progress_.cancel = true;
+    }
+
+    //true once for each job that ran to the end without being cancelled, what it built
+    //belongs to the caller until the next Start
+    bool Poll()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        bool complete = complete_;
+        complete_ = false;
+        return complete;
+    }
+
+    bool IsBusy()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return running_ || hasJob_;
+    }
+
+    //blocks until the running and queued jobs are done
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        idle_.wait(lock, [this]{ return !running_ && !hasJob_; });
+    }
+
+    LSystemProgress* GetProgress()
+    {
+        return &progress_;
+    }
+
+private:
+    void WorkerLoop()
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        for (;;)
+        {
+            wake_.wait(lock, [this]{ return hasJob_ || quit_; });
+            if (quit_)return;
+            Job job;
+            std::swap(job, job_);
+            hasJob_ = false;
+            running_ = true;
+            progress_.Reset();
+            lock.unlock();
+            job();
+            lock.lock();
+            running_ = false;
+            complete_ = !progress_.cancel && !hasJob_;
+            progress_.cancel = false;
+            idle_.notify_all();
+        }
+    }
+
+    std::thread worker_;
+    std::mutex lock_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    Job job_;
+    bool hasJob_;
+    bool running_;
+    bool complete_;
+    bool quit_;
+    LSystemProgress progress_;
+};
+
+//finished geometry kept on the CPU, laid out as the visualizer that made it uploads it
+struct LSystemMeshData
+{
+    size_t GetByteSize() const
+    {
+        return vertices.size() + indices.size();
+    }
+
+    LSystemArray<char> vertices;
+    LSystemArray<char> indices;
+};
+
+//a mesh with its repeated branches built once: root is drawn as it is and each of its instances places a
+//prototype at a turtle's position and rotation quaternion; a prototype's vertices, indices and the instances
+//of its own sub-branches are ranges of the shared arrays, its indices counting from its first vertex.
+//A prototype starts with a ring of its own for its first section to join, in the flattened mesh that
+//section joins the parent's ring at join instead, and the branch goes where vertex and index say
+struct LSystemInstancedMesh
+{
+    struct Instance
+    {
+        int prototype;
+        int join;//the parent's ring the branch's first section joins, counted as the parent's indices
+        int vertex;//the parent's vertex and index counts when the branch was placed
+        int index;
+        float position[3];
+        float rotation[4];
+    };
+    struct Prototype
+    {
+        int firstVertex;
+        int vertexCount;
+        int firstIndex;
+        int indexCount;
+        int firstInstance;
+        int instanceCount;
+    };
+
+    LSystemInstancedMesh() :ring(0){}
+
+    size_t GetByteSize() const
+    {
+        return root.GetByteSize() + prototypeMesh.GetByteSize() + prototypes.size() * sizeof(Prototype) +
+            (instances.size() + prototypeInstances.size()) * sizeof(Instance);
+    }
+
+    //exchanges the buffers, nothing is copied
+    void Swap(LSystemInstancedMesh& other)
+    {
+        root.vertices.Swap(other.root.vertices);
+        root.indices.Swap(other.root.indices);
+        instances.Swap(other.instances);
+        prototypeMesh.vertices.Swap(other.prototypeMesh.vertices);
+        prototypeMesh.indices.Swap(other.prototypeMesh.indices);
+        prototypeInstances.Swap(other.prototypeInstances);
+        prototypes.Swap(other.prototypes);
+        int r = ring;
+        ring = other.ring;
+        other.ring = r;
+    }
+
+    LSystemMeshData root;
+    LSystemArray<Instance> instances;
+    LSystemMeshData prototypeMesh;
+    LSystemArray<Instance> prototypeInstances;
+    LSystemArray<Prototype> prototypes;
+    int ring;//vertices in a ring
+};
+
+//meshes kept by key under a byte budget, the least recently used go first once it is over
+//but the newest is always kept; shared between the generator's thread and the main thread
+class LSystemMeshCache
+{
+public:
+    LSystemMeshCache(size_t budget) :budget_(budget), bytes_(0), clock_(0){}
+    ~LSystemMeshCache()
+    {
+        for (int i = 0; i < entries_.size(); ++i)
+        {
+            delete entries_[i];
+        }
+    }
+
+    void SetBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        budget_ = bytes;
+        Evict();
+    }
+
+    //takes the buffers out of data, replacing the mesh of the same key; instanced meshes are kept
+    //as they are, so an entry costs what its distinct branches do
+    void Insert(unsigned long long key, LSystemInstancedMesh& data)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        Entry* entry = Find(key);
+        if (!entry)
+        {
+            entry = new Entry();
+            entry->key = key;
+            entries_.push_back(entry);
+        }
+        bytes_ -= entry->data.GetByteSize();
+        entry->data.Swap(data);
+        bytes_ += entry->data.GetByteSize();
+        entry->used = ++clock_;
+        Evict();
+    }
+
+    bool Contains(unsigned long long key)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return Find(key) != NULL;
+    }
+
+    //calls fn with the mesh while it is locked in, so it can be uploaded without a copy,
+    //false when it is not cached
+    template<class Fn> bool Use(unsigned long long key, Fn fn)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        Entry* entry = Find(key);
+        if (!entry)return false;
+        entry->used = ++clock_;
+        fn((const LSystemInstancedMesh&)entry->data);
+        return true;
+    }
+
+    size_t GetBytes()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return bytes_;
+    }
+
+private:
+    struct Entry
+    {
+        unsigned long long key;
+        unsigned long long used;
+        LSystemInstancedMesh data;
+    };
+
+    Entry* Find(unsigned long long key)
+    {
+        for (int i = 0; i < entries_.size(); ++i)
+        {
+            if (entries_[i]->key == key)return entries_[i];
+        }
+        return NULL;
+    }
+
+    void Evict()
+    {
+        while (bytes_ > budget_ && entries_.size() > 1)
+        {
+            int oldest = 0;
+            for (int i = 1; i < entries_.size(); ++i)
+            {
+                if (entries_[i]->used < entries_[oldest]->used)oldest = i;
+            }
+            if (entries_[oldest]->used == clock_)return;
+            bytes_ -= entries_[oldest]->data.GetByteSize();
+            delete entries_[oldest];
+            entries_[oldest] = entries_.back();
+            entries_.pop_back();
+        }
+    }
+
+    std::mutex lock_;
+    octet::dynarray<Entry*> entries_;
+    size_t budget_;
+    size_t bytes_;
+    unsigned long long clock_;
+};
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <direct.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <string>
+//a read only view of a whole file
+class LSystemMappedFile
+{
+public:
+#if defined(_WIN32)
+    LSystemMappedFile() :data_(NULL), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(NULL){}
+#else
+    LSystemMappedFile() :data_(NULL), size_(0){}
+#endif
+    ~LSystemMappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const char* path)
+    {
+        Close();
+#if defined(_WIN32)
+        file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_ == INVALID_HANDLE_VALUE)return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0 || (unsigned long long)size.QuadPart > (size_t)-1)
+        {
+            Close();
+            return false;
+        }
+        mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping_)data_ = (const unsigned char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+        size_ = (size_t)size.QuadPart;
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0 && (unsigned long long)info.st_size <= (size_t)-1)
+        {
+            void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED)
+            {
+                data_ = (const unsigned char*)view;
+                size_ = (size_t)info.st_size;
+            }
+        }
+        close(fd);
+#endif
+        if (!data_)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#if defined(_WIN32)
+        if (data_)UnmapViewOfFile(data_);
+        if (mapping_)CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE)CloseHandle(file_);
+        mapping_ = NULL;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_)munmap((void*)data_, size_);
+#endif
+        data_ = NULL;
+        size_ = 0;
+    }
+
+    const unsigned char* GetData() const
+    {
+        return data_;
+    }
+    size_t GetSize() const
+    {
+        return size_;
+    }
+
+private:
+    const unsigned char* data_;
+    size_t size_;
+#if defined(_WIN32)
+    HANDLE file_;
+    HANDLE mapping_;
+#endif
+};
+
+//derived levels and finished meshes kept on disk between runs, one file per entry named by its
+//key, which should hash everything that went into it (LSystem::GetGrammarHash, the level and the
+//visualizer's settings); every file carries its key, sizes and a checksum and is checked when it
+//is loaded, an index file keeps the sizes and last use so the total stays under the size limit
+//by dropping the least recently used; safe to share between threads
+class LSystemDiskCache
+{
+public:
+    enum KIND{
+        KIND_LEVEL = 1,//the symbols of a level
+        KIND_MESH,//vertex then index bytes, as LSystemMeshData
+        KIND_INSTANCED_MESH,//an InstancedLayout and the arrays it counts, then the vertex and index bytes it sizes
+    };
+
+    LSystemDiskCache() :limit_(0), bytes_(0), clock_(0), dirty_(false), temps_(0){}
+    ~LSystemDiskCache()
+    {
+        Flush();
+    }
+
+    //uses dir for the files, creating it, and reads the index; entries whose file is gone or
+    //the wrong size are dropped
+    bool Open(const char* dir, unsigned long long limit)
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        dir_ = dir;
+#if defined(_WIN32)
+        _mkdir(dir);
+#else
+        mkdir(dir, 0755);
+#endif
+        limit_ = limit;
+        entries_.resize(0);
+        bytes_ = 0;
+        clock_ = 0;
+        FILE* f = fopen(Path("index", 0).c_str(), "rb");
+        if (f)
+        {
+            IndexHeader header;
+            if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == INDEX_MAGIC && header.version == VERSION)
+            {
+                IndexEntry entry;
+                for (unsigned int i = 0; i < header.count && fread(&entry, sizeof(entry), 1, f) == 1; ++i)
+                {
+                    if (entry.kind < KIND_LEVEL || entry.kind > KIND_INSTANCED_MESH)continue;
+                    if (FileSize(Path(EntryName(entry.key).c_str(), entry.kind)) != entry.bytes)continue;
+                    entries_.push_back(entry);
+                    bytes_ += entry.bytes;
+                    if (entry.used > clock_)clock_ = entry.used;
+                }
+            }
+            fclose(f);
+        }
+        dirty_ = true;
+        Evict();
+        return true;
+    }
+
+    //cheap to call every frame, an unchanged limit returns without taking the lock
+    void SetLimit(unsigned long long limit)
+    {
+        if (limit == limit_)return;
+        std::lock_guard<std::mutex> lock(lock_);
+        limit_ = limit;
+        Evict();
+    }
+
+    //writes the entry to a temporary file first, so a crash never leaves a half written entry;
+    //the checksum and the writing happen outside the lock, each writer with its own temporary,
+    //the lock is only held to move the file into place and update the index
+    bool Store(unsigned long long key, KIND kind, const void* first, size_t firstSize, const void* second, size_t secondSize)
+    {
+        if (!limit_ || !key)return false;
+        FileHeader header;
+        header.magic = FILE_MAGIC;
+        header.version = VERSION;
+        header.kind = kind;
+        header.reserved = 0;
+        header.key = key;
+        header.sizes[0] = firstSize;
+        header.sizes[1] = secondSize;
+        header.checksum = LSystemHash(LSystemHash(LSYSTEM_HASH_SEED, first, firstSize), second, secondSize);
+        unsigned long long bytes = sizeof(header) + firstSize + secondSize;
+        if (bytes > limit_)return false;
+
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            path = Path(EntryName(key).c_str(), kind);
+        }
+        char suffix[24];
+        sprintf(suffix, ".%u.tmp", ++temps_);
+        std::string temp = path + suffix;
+        FILE* f = fopen(temp.c_str(), "wb");
+        if (!f)return false;
+        bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            (!firstSize || fwrite(first, firstSize, 1, f) == 1) &&
+            (!secondSize || fwrite(second, secondSize, 1, f) == 1);
+        written = fclose(f) == 0 && written;
+        if (!written)
+        {
+            remove(temp.c_str());
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(lock_);
+        Forget(key, kind);
+        remove(path.c_str());
+        if (rename(temp.c_str(), path.c_str()) != 0)
+        {
+            remove(temp.c_str());
+            return false;
+        }
+        IndexEntry entry;
+        entry.key = key;
+        entry.kind = kind;
+        entry.bytes = bytes;
+        entry.used = ++clock_;
+        entry.reserved = 0;
+        entries_.push_back(entry);
+        bytes_ += bytes;
+        dirty_ = true;
+        Evict();
+        WriteIndex();
+        return true;
+    }
+
+    //maps the entry and checks its header and checksum, first and second point into file,
+    //so they stay valid until it is closed; a damaged entry is deleted; the lock is only held
+    //to look the entry up and to update the index, not while the file is mapped and checked
+    bool Load(unsigned long long key, KIND kind, LSystemMappedFile& file, const char*& first, size_t& firstSize,
+        const char*& second, size_t& secondSize)
+    {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            if (Find(key, kind) < 0)return false;
+            path = Path(EntryName(key).c_str(), kind);
+        }
+        bool valid = false;
+        if (file.Open(path.c_str()) && file.GetSize() >= sizeof(FileHeader))
+        {
+            FileHeader header;
+            memcpy(&header, file.GetData(), sizeof(header));
+            const char* payload = (const char*)file.GetData() + sizeof(header);
+            //each size is checked against what is left so a damaged header cannot wrap the sum
+            size_t payloadSize = file.GetSize() - sizeof(header);
+            valid = header.magic == FILE_MAGIC && header.version == VERSION && header.kind == kind && header.key == key &&
+                header.sizes[0] <= payloadSize && header.sizes[1] <= payloadSize - header.sizes[0] &&
+                header.sizes[0] + header.sizes[1] == payloadSize &&
+                header.checksum == LSystemHash(LSYSTEM_HASH_SEED, payload, (size_t)(header.sizes[0] + header.sizes[1]));
+            if (valid)
+            {
+                first = payload;
+                firstSize = (size_t)header.sizes[0];
+                second = payload + firstSize;
+                secondSize = (size_t)header.sizes[1];
+            }
+        }
+        if (!valid)
+        {
+            printf("%s%s\n", "Dropping damaged cache entry ", path.c_str());
+            file.Close();
+        }
+
+        //another thread may have replaced or evicted the entry in the meantime
+        std::lock_guard<std::mutex> lock(lock_);
+        int index = Find(key, kind);
+        if (!valid)
+        {
+            if (index < 0)return false;
+            Forget(key, kind);
+            remove(path.c_str());
+            WriteIndex();
+            return false;
+        }
+        if (index >= 0)
+        {
+            entries_[index].used = ++clock_;
+            dirty_ = true;
+        }
+        return true;
+    }
+
+    //the current level of lSys, in byte form
+    bool StoreLevel(LSystem* lSys)
+    {
+        unsigned long long hash = lSys->GetGrammarHash();
+        if (!hash)return false;
+        const LSystemState* state = lSys->GetCurrentState();
+        octet::dynarray<char> symbols;
+        if (!lSys->Unpack(state, symbols))return false;
+        return Store(LevelKey(hash, state->level), KIND_LEVEL, symbols.data(), symbols.size(), NULL, 0);
+    }
+
+    //makes the stored level the current level of lSys without deriving it
+    bool LoadLevel(LSystem* lSys, int level)
+    {
+        unsigned long long hash = lSys->GetGrammarHash();
+        if (!hash)return false;
+        LSystemMappedFile file;
+        const char* symbols;
+        size_t count;
+        const char* unused;
+        size_t unusedSize;
+        if (!Load(LevelKey(hash, level), KIND_LEVEL, file, symbols, count, unused, unusedSize) || count > 0x7fffffff)return false;
+        lSys->AdoptLevel(level, symbols, (int)count);
+        return true;
+    }
+
+    bool StoreMesh(unsigned long long key, const LSystemMeshData& data)
+    {
+        return Store(key, KIND_MESH, data.vertices.data(), data.vertices.size(), data.indices.data(), data.indices.size());
+    }
+
+    bool LoadMesh(unsigned long long key, LSystemMeshData& data)
+    {
+        LSystemMappedFile file;
+        const char* vertices;
+        size_t vertexBytes;
+        const char* indices;
+        size_t indexBytes;
+        if (!Load(key, KIND_MESH, file, vertices, vertexBytes, indices, indexBytes))return false;
+        if (vertexBytes > 0x7fffffff || indexBytes > 0x7fffffff)
+        {
+            printf("%s\n", "Cache entry too large for a mesh");
+            return false;
+        }
+        data.vertices.resize((unsigned int)vertexBytes);
+        data.indices.resize((unsigned int)indexBytes);
+        if (vertexBytes)memcpy(data.vertices.data(), vertices, vertexBytes);
+        if (indexBytes)memcpy(data.indices.data(), indices, indexBytes);
+        return true;
+    }
+
+    //a mesh without instances is stored as a plain one
+    bool StoreMesh(unsigned long long key, const LSystemInstancedMesh& mesh)
+    {
+        if (!mesh.instances.size())return StoreMesh(key, mesh.root);
+        InstancedLayout layout;
+        layout.ring = mesh.ring;
+        layout.instances = mesh.instances.size();
+        layout.prototypeInstances = mesh.prototypeInstances.size();
+        layout.prototypes = mesh.prototypes.size();
+        const LSystemArray<char>* buffers[4] = { &mesh.root.vertices, &mesh.root.indices, &mesh.prototypeMesh.vertices, &mesh.prototypeMesh.indices };
+        size_t geometryBytes = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            layout.bytes[i] = buffers[i]->size();
+            geometryBytes += buffers[i]->size();
+        }
+        size_t instanceBytes = (layout.instances + layout.prototypeInstances) * sizeof(LSystemInstancedMesh::Instance);
+        octet::dynarray<char> first;
+        octet::dynarray<char> second;
+        first.resize(sizeof(layout) + instanceBytes + layout.prototypes * sizeof(LSystemInstancedMesh::Prototype));
+        second.resize(geometryBytes);
+        char* out = first.data();
+        memcpy(out, &layout, sizeof(layout));
+        out += sizeof(layout);
+        memcpy(out, mesh.instances.data(), layout.instances * sizeof(LSystemInstancedMesh::Instance));
+        out += layout.instances * sizeof(LSystemInstancedMesh::Instance);
+        memcpy(out, mesh.prototypeInstances.data(), layout.prototypeInstances * sizeof(LSystemInstancedMesh::Instance));
+        out += layout.prototypeInstances * sizeof(LSystemInstancedMesh::Instance);
+        memcpy(out, mesh.prototypes.data(), layout.prototypes * sizeof(LSystemInstancedMesh::Prototype));
+        out = second.data();
+        for (int i = 0; i < 4; ++i)
+        {
+            if (buffers[i]->size())memcpy(out, buffers[i]->data(), buffers[i]->size());
+            out += buffers[i]->size();
+        }
+        return Store(key, KIND_INSTANCED_MESH, first.data(), first.size(), second.data(), second.size());
+    }
+
+    //either kind of stored mesh, a plain one coming back without instances
+    bool LoadMesh(unsigned long long key, LSystemInstancedMesh& mesh)
+    {
+        LSystemMappedFile file;
+        const char* first;
+        size_t firstSize;
+        const char* second;
+        size_t secondSize;
+        if (!Load(key, KIND_INSTANCED_MESH, file, first, firstSize, second, secondSize))
+        {
+            mesh.instances.resize(0);
+            mesh.prototypeInstances.resize(0);
+            mesh.prototypes.resize(0);
+            mesh.prototypeMesh.vertices.resize(0);
+            mesh.prototypeMesh.indices.resize(0);
+            return LoadMesh(key, mesh.root);
+        }
+        InstancedLayout layout;
+        if (firstSize < sizeof(layout))return false;
+        memcpy(&layout, first, sizeof(layout));
+        //every count is checked against what is left, as Load does the sizes
+        size_t left = firstSize - sizeof(layout);
+        size_t instanceBytes = sizeof(LSystemInstancedMesh::Instance);
+        size_t prototypeBytes = sizeof(LSystemInstancedMesh::Prototype);
+        bool valid = layout.instances <= left / instanceBytes && layout.prototypeInstances <= left / instanceBytes - layout.instances &&
+            layout.prototypes <= (left - (layout.instances + layout.prototypeInstances) * instanceBytes) / prototypeBytes &&
+            left == (layout.instances + layout.prototypeInstances) * instanceBytes + layout.prototypes * prototypeBytes;
+        left = secondSize;
+        for (int i = 0; i < 4 && valid; ++i)
+        {
+            valid = layout.bytes[i] <= left && layout.bytes[i] <= 0x7fffffff;
+            left -= valid ? (size_t)layout.bytes[i] : 0;
+        }
+        if (!valid || left)
+        {
+            printf("%s\n", "Cache entry does not hold an instanced mesh");
+            return false;
+        }
+        mesh.ring = layout.ring;
+        mesh.instances.resize(layout.instances);
+        mesh.prototypeInstances.resize(layout.prototypeInstances);
+        mesh.prototypes.resize(layout.prototypes);
+        const char* in = first + sizeof(layout);
+        memcpy(mesh.instances.data(), in, layout.instances * instanceBytes);
+        in += layout.instances * instanceBytes;
+        memcpy(mesh.prototypeInstances.data(), in, layout.prototypeInstances * instanceBytes);
+        in += layout.prototypeInstances * instanceBytes;
+        memcpy(mesh.prototypes.data(), in, layout.prototypes * prototypeBytes);
+        LSystemArray<char>* buffers[4] = { &mesh.root.vertices, &mesh.root.indices, &mesh.prototypeMesh.vertices, &mesh.prototypeMesh.indices };
+        in = second;
+        for (int i = 0; i < 4; ++i)
+        {
+            buffers[i]->resize((unsigned int)layout.bytes[i]);
+            if (layout.bytes[i])memcpy(buffers[i]->data(), in, (size_t)layout.bytes[i]);
+            in += layout.bytes[i];
+        }
+        return true;
+    }
+
+    static unsigned long long LevelKey(unsigned long long grammarHash, int level)
+    {
+        return LSystemHash(grammarHash, &level, sizeof(level));
+    }
+
+    //writes the index when lookups changed the order of use
+    void Flush()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (dirty_)WriteIndex();
+    }
+
+    unsigned long long GetBytes()
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        return bytes_;
+    }
+
+private:
+    enum { FILE_MAGIC = 0x3143534c, INDEX_MAGIC = 0x4943534c, VERSION = 1 };//"LSC1" and "LSCI"
+
+    //what the first part of a KIND_INSTANCED_MESH entry starts with
+    struct InstancedLayout
+    {
+        unsigned int ring;
+        unsigned int instances;
+        unsigned int prototypeInstances;
+        unsigned int prototypes;
+        unsigned long long bytes[4];//root vertices and indices, then the prototypes'
+    };
+
+    struct FileHeader
+    {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int kind;
+        unsigned int reserved;
+        unsigned long long key;
+        unsigned long long sizes[2];
+        unsigned long long checksum;//of both parts
+    };
+
+    struct IndexHeader
+    {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int count;
+        unsigned int reserved;
+    };
+
+    struct IndexEntry
+    {
+        unsigned long long key;
+        unsigned long long bytes;//of the whole file
+        unsigned long long used;
+        unsigned int kind;
+        unsigned int reserved;
+    };
+
+    static std::string EntryName(unsigned long long key)
+    {
+        char name[24];
+        sprintf(name, "%016llx", key);
+        return name;
+    }
+
+    std::string Path(const char* name, int kind) const
+    {
+        const char* extensions[] = { ".lsi", ".lsl", ".lsm", ".lsn" };
+        return dir_ + "/" + name + extensions[kind];
+    }
+
+    //stat rather than ftell, which is 32 bits on Windows
+    static unsigned long long FileSize(const std::string& path)
+    {
+#if defined(_WIN32)
+        struct _stat64 info;
+        if (_stat64(path.c_str(), &info) != 0)return ~0ull;
+#else
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)return ~0ull;
+#endif
+        return (unsigned long long)info.st_size;
+    }
+
+    int Find(unsigned long long key, int kind) const
+    {
+        for (int i = 0; i < entries_.size(); ++i)
+        {
+            if (entries_[i].key == key && entries_[i].kind == kind)return i;
+        }
+        return -1;
+    }
+
+    void Forget(unsigned long long key, int kind)
+    {
+        int index = Find(key, kind);
+        if (index < 0)return;
+        bytes_ -= entries_[index].bytes;
+        entries_[index] = entries_.back();
+        entries_.pop_back();
+        dirty_ = true;
+    }
+
+    void Evict()
+    {
+        while (bytes_ > limit_ && entries_.size())
+        {
+            int oldest = 0;
+            for (int i = 1; i < entries_.size(); ++i)
+            {
+                if (entries_[i].used < entries_[oldest].used)oldest = i;
+            }
+            IndexEntry entry = entries_[oldest];
+            Forget(entry.key, entry.kind);
+            remove(Path(EntryName(entry.key).c_str(), entry.kind).c_str());
+        }
+    }
+
+    void WriteIndex()
+    {
+        std::string path = Path("index", 0);
+        std::string temp = path + ".tmp";
+        FILE* f = fopen(temp.c_str(), "wb");
+        if (!f)return;
+        IndexHeader header;
+        header.magic = INDEX_MAGIC;
+        header.version = VERSION;
+        header.count = entries_.size();
+        header.reserved = 0;
+        bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            (!entries_.size() || fwrite(entries_.data(), sizeof(IndexEntry), entries_.size(), f) == entries_.size());
+        written = fclose(f) == 0 && written;
+        remove(path.c_str());
+        if (written && rename(temp.c_str(), path.c_str()) == 0)dirty_ = false;
+    }
+
+    std::mutex lock_;
+    std::string dir_;
+    octet::dynarray<IndexEntry> entries_;
+    std::atomic<unsigned long long> limit_;//read without the lock by SetLimit and Store
+    unsigned long long bytes_;
+    unsigned long long clock_;
+    bool dirty_;
+    std::atomic<unsigned int> temps_;//numbers the temporary files of concurrent Stores
+};
+
+
+
+
+
+#include "AngleConvert.h"
+
+class DrawHelper2D final : public LSystemVisualizer
+{
+public:
+
+    DrawHelper2D():dir_(0,1,0), paramCount_(0){
+        maxRot_ = 0;
+        minRot_ = 0;
+    lineLength_=0.1f;
+    meshy_ = new octet::mesh();
+    }
+
+    //parametric symbols draw F(length) and rotate +(angle)
+    void SetParameters(const float* params, int count)override
+    {
+        paramCount_ = count;
+        if (count)param_ = params[0];
+    }
+
+    void Init(LSystemDrawInfo* info)override
+    {
+        if (info)
+        {
+            if(info->sectionLength)lineLength_ = info->sectionLength;
+            if (info->minZRot)minRot_ = info->minZRot;
+            if (info->maxZRot)maxRot_ = info->maxZRot;
+        }
+        //the turns by the grammar's angle are worked out once rather than on every rotation
+        for (int i = 0; i < TURN_CACHE; ++i)
+        {
+            float angle = (i - TURN_CACHE / 2) * minRot_ * DEGPI;
+            turnCos_[i] = cosf(angle);
+            turnSin_[i] = sinf(angle);
+        }
+    }
+    void DrawLine() override
+    {
+        DrawLines(1);
+    }
+    //a run of lines is straight, so it is drawn as one
+    void DrawLines(int count) override
+    {
+        float length = (paramCount_ ? param_ : lineLength_) * count;
+        Turtle& turtle = turtles_.back();
+        verticies_.push_back(myVertex(octet::vec3(turtle.x, turtle.y, 0), 0xff + 255));
+        turtle.x += turtle.dx * length;
+        turtle.y += turtle.dy * length;
+        verticies_.push_back(myVertex(octet::vec3(turtle.x, turtle.y, 0), 0xff + 255));
+    }
+   void RotatePositive()override
+    {
+       Turn(1);
+    }
+    void RotateNegative()override
+    {
+        Turn(-1);
+    }
+    void Turn(int turns)override
+    {
+        float c, s;
+        if (!paramCount_ && turns > -TURN_CACHE / 2 && turns < TURN_CACHE / 2)
+        {
+            c = turnCos_[turns + TURN_CACHE / 2];
+            s = turnSin_[turns + TURN_CACHE / 2];
+        }
+        else
+        {
+            float angle = (paramCount_ ? param_ : minRot_) * turns * DEGPI;
+            c = cosf(angle);
+            s = sinf(angle);
+        }
+        Turtle& turtle = turtles_.back();
+        float dx = turtle.dx;
+        turtle.dx = dx * c - turtle.dy * s;
+        turtle.dy = turtle.dy * c + dx * s;
+    }
+    //every rotation is about z by the same angle
+    bool CanCancelTurns(const LSystemDrawInfo* info) const override
+    {
+        return true;
+    }
+    void PushStack()override
+    {
+        turtles_.push_back(turtles_.back());
+    }
+    void PopStack()override
+    {
+        turtles_.pop_back();
+    }
+    void Custom()override
+    {
+       
+    }
+    void SetState(LSystemState* state)override
+    {
+        Turtle start = { 0, 0, dir_.x(), dir_.y() };
+        turtles_.resize(0);
+        turtles_.push_back(start);
+        verticies_.resize(0);
+    }
+
+    int GetVertexCount() const override
+    {
+        return verticies_.size();
+    }
+
+    //copies the finished lines into the mesh, this needs the GL context so call it
+    //on the thread that renders rather than from Finished
+    void Upload()
+    {
+        LSystemMeshData data;
+        Take(data);
+        Upload(data);
+    }
+
+    //moves the finished lines out so they can be kept or uploaded later
+    void Take(LSystemMeshData& data)
+    {
+        data.vertices.resize(sizeof(myVertex)* verticies_.size());
+        memcpy(data.vertices.data(), verticies_.data(), data.vertices.size());
+        data.indices.resize(0);
+        verticies_.resize(0);
+    }
+
+    //only touches the mesh, so it is safe while another thread visualizes into this helper
+    void Upload(const LSystemMeshData& data)
+    {
+        int vertexCount = data.vertices.size() / sizeof(myVertex);
+        meshy_->allocate(data.vertices.size(), 0);
+        meshy_->set_params(sizeof(myVertex), 0, vertexCount, GL_LINES, 0);
+
+        meshy_->clear_attributes();
+        meshy_->add_attribute(octet::attribute_pos, 3, GL_FLOAT, 0);
+        meshy_->add_attribute(octet::attribute_color, 4, GL_UNSIGNED_BYTE, 12, TRUE);
+
+        octet::gl_resource::wolock vl(meshy_->get_vertices());
+        memcpy(vl.u8(), data.vertices.data(), data.vertices.size());
+    }
+
+
+    octet::mesh* GetMesh()
+    {
+        return meshy_;
+    }
+private:
+    enum { TURN_CACHE = 16 };
+
+    //where the turtle is and the unit vector it faces, rotations turn the vector
+    struct Turtle
+    {
+        float x, y;
+        float dx, dy;
+    };
+
+    struct myVertex
+    {
+        myVertex(octet::vec3 v, uint32_t col)
+        {
+            pos = v; color = col;
+        }
+        myVertex(){}
+        octet::vec3p pos;
+        uint32_t color;
+    };
+
+    octet::dynarray<myVertex> verticies_;
+
+    float lineLength_;
+    float minRot_;
+    float maxRot_;
+    octet::vec3 dir_;
+
+    float param_;
+    int paramCount_;
+
+    int numVerticies_;
+
+    LSystemState* state_;
+
+    octet::dynarray<Turtle> turtles_;
+    float turnCos_[TURN_CACHE];//turns of -TURN_CACHE / 2 + 1 to TURN_CACHE / 2 - 1 by minRot_
+    float turnSin_[TURN_CACHE];
+    octet::vec3 direction_;
+
+    octet::ref<octet::mesh> meshy_;
+};
+
+#include <random>
+#include <unordered_map>
+class DrawHelper3D final : public LSystemVisualizer
+{
+public:
+    DrawHelper3D(int vertexNum) : minRot_(20,20,20),maxRot_(0,0,0),
+    randomize_(true), seed_(0), rotations_(0), paramCount_(0), vertexCount_(0), batch_(NULL),
+    instancing_(false), minInstanceSections_(4), recording_(false), instanced_(false){
+        thickness_ = 0.5f;
+        thicknessReduction_ = 0;
+        sectionLength_ = 0.5f;
+        meshy_ = new octet::mesh();
+        cylinderBase_.resize(vertexNum);
+    }
+
+    //parametric symbols draw F(length,width) and rotate +(angle) about z
+    void SetParameters(const float* params, int count)override
     {
-        int startPos = str.find("DrawInfo");
-        if (startPos == -1)
+        if (recording_ && count)StopRecording();
+        paramCount_ = count;
+        for (int k = 0; k < count && k < 2; ++k)
         {
-            return true;
+            params_[k] = params[k];
         }
-        startPos += 9; //size of "DrawInfo{"
-        int endPos = FindSymbolAfter('}', startPos);
+    }
 
-        if (endPos == -1)
-        {
-            printf("%s", "No close brackets after DrawInfo section");
-            assert(false);
-            return false;
-        }
+    //randomized angles are drawn from the seed and the rotation's ordinal in the level,
+    //so the same seed always gives the same tree
+    void SetSeed(unsigned int seed)
+    {
+        seed_ = seed;
+    }
 
-        float arr[sizeof(LSystemDrawInfo) / sizeof(float)] = { 0 };
-        int counter = 0;
-        for (int i = startPos; i < endPos; ++i)
+    //with randomize off, every bracketed branch of at least minSections sections is built once per distinct
+    //content and placed as an instance wherever it recurs, branches inside it being instances of their own;
+    //the level is only recorded while it is visualized and built in Finished, so time and memory go with
+    //the distinct branches. TakeInstanced hands the result out as it is, where a prototype's first section joins
+    //a ring of its own at the branch point, and Take flattens it into the mesh drawn without instancing.
+    //Parametric levels are drawn directly, and the turtle isn't split while instancing
+    void SetInstancing(bool instancing, int minSections = 4)
+    {
+        instancing_ = instancing;
+        minInstanceSections_ = minSections > 1 ? minSections : 1;
+    }
+    bool GetInstancing() const
+    {
+        return instancing_;
+    }
+
+    void Init(LSystemDrawInfo* info)  override
+    {
+        float oldThick = thickness_;
+        if (info)
         {
-            int equals = FindSymbolAfter('=', i);
-            int eol = FindSymbolAfter(';',equals);
-            if (eol>endPos)
+            if (info->sectionWidth) thickness_ = info->sectionWidth;
+            if (info->sectionWidthReduction) thicknessReduction_ = info->sectionWidthReduction;
+            if (info->sectionLength)sectionLength_ = info->sectionLength;
+            if (info->minXRot || info->minYRot || info->minZRot)
             {
-                printf("%s", "No semicolon after statement");
-                assert(false);
-                return false;
+                minRot_ = octet::vec3(info->minXRot, info->minYRot, info->minZRot);
             }
-            octet::string value(&read_[i], equals - i);
-            octet::string key(&read_[equals + 1], (eol - equals)-1);
-            arr[InfoLocFromString(key)] = atof(value);
-            i = eol;
-            counter++;
+            if (info->maxXRot || info->maxYRot || info->maxZRot) maxRot_ = octet::vec3(info->maxXRot, info->maxYRot, info->maxZRot);
+            randomize_ = info->randomize;
         }
-        if (counter > 0)
+        if (startPos_.size() == 0)
         {
-            LSystemDrawInfo* info = new LSystemDrawInfo();
-            memcpy(info, arr, sizeof(info)*sizeof(float));
-            lSys->SetDrawInfo(info);
+            float angle = M_PI * 2 / cylinderBase_.size();
+            for (int i = 0; i < cylinderBase_.size(); ++i)
+            {
+                cylinderBase_[i] = myVertex(octet::vec3(
+                    sinf(angle*i)*thickness_,
+                    0,
+                    cosf(angle*i)*thickness_));
+                verticies_.push_back(cylinderBase_.back());
+            }
+            vertexCount_ = verticies_.size();
+            startPos_.push_back(0);
         }
-    
-    }
-private:
-    //lineraly searches for the next instance of a symbol after a current point
-    int FindSymbolAfter(char symbol, int loc)
-    {
-        for (int i = loc; i < read_.size(); ++i)
+        else if (thickness_ != oldThick)
         {
-            if (read_[i] == symbol)
+            for (int i = 0; i < cylinderBase_.size(); ++i)
             {
-                return i;
+                cylinderBase_[i].pos = cylinderBase_[i].pos.normalize();
+                cylinderBase_[i].pos *= thickness_;
             }
         }
-        return -1;
+        //an unrandomized + or - is always the same z, x then y rotation, so it is one cached quaternion
+        float x[4], y[4];
+        AxisTurn(2, minRot_.z(), turnPositive_);
+        AxisTurn(0, minRot_.x(), x);
+        AxisTurn(1, minRot_.y(), y);
+        Multiply(turnPositive_, x);
+        Multiply(turnPositive_, y);
+        AxisTurn(2, -minRot_.z(), turnNegative_);
+        AxisTurn(0, -minRot_.x(), x);
+        AxisTurn(1, -minRot_.y(), y);
+        Multiply(turnNegative_, x);
+        Multiply(turnNegative_, y);
+        recording_ = instancing_ && !randomize_;
+        record_.resize(0);
     }
-    // simple fix for built in types, conversion from string to enum
-    static LSystem::KEY_SYMBOLS KeyFromString(const octet::string& c)
+    //the turtle only works out where the ring goes and which ring it joins, the ring itself is
+    //built straight away or recorded for BuildGeometry when a batch is set
+    void DrawLine() override
     {
-        if (c == "KEY_DRAW")
+        if (recording_)
         {
-            return LSystem::KEY_DRAW;
+            Record(LSystemOpcodes::OP_DRAW, 1);
+            return;
         }
-        if (c == "KEY_PLUS_ROTATE")
+        DrawSection(paramCount_ > 0 ? params_[0] : sectionLength_, paramCount_ > 1 ? params_[1] / thickness_ : 1.0f);
+    }
+    //a run of sections is one straight cylinder, so it gets one ring at its end
+    void DrawLines(int count) override
+    {
+        if (recording_)
         {
-            return LSystem::KEY_PLUS_ROTATE;
+            Record(LSystemOpcodes::OP_DRAW, count);
+            return;
         }
-        if (c == "KEY_MINUS_ROTATE")
+        if (paramCount_)
         {
-            return LSystem::KEY_MINUS_ROTATE;
+            for (int i = 0; i < count; ++i)DrawLine();
+            return;
         }
-        if (c == "KEY_PUSH")
+        DrawSection(sectionLength_ * count, 1.0f);
+    }
+    bool CanDefer() const override
+    {
+        return true;
+    }
+    void SetBatch(LSystemGeometryBatch* batch)override
+    {
+        batch_ = batch;
+    }
+    void BuildGeometry(const LSystemGeometryBatch& batch)override
+    {
+        int count = batch.Count<Segment>();
+        Segment segment;
+        for (int i = 0; i < count; ++i)
         {
-            return LSystem::KEY_PUSH;
+            batch.Read(i, segment);
+            BuildSegment(segment);
         }
-        if (c == "KEY_POP")
+    }
+    void RotatePositive()override
+    {
+        if (recording_)
         {
-            return LSystem::KEY_POP;
+            Record(LSystemOpcodes::OP_TURN, 1);
+            return;
         }
-
-        //Possible extension of features
-        if (c == "KEY_LEAF")
+        if (paramCount_)
         {
-            return LSystem::KEY_LEAF;
+            TurnAbout(turtles_.back(), 2, params_[0]);
+            return;
         }
-        if (c == "KEY_ROTATE")
+        TurnTurtle(turtles_.back(), 1, rotations_);
+    }
+    void RotateNegative()override
+    {
+        if (recording_)
         {
-            return LSystem::KEY_ROTATE;
+            Record(LSystemOpcodes::OP_TURN, -1);
+            return;
         }
-        if (c == "KEY_CUSTOM")
+        if (paramCount_)
         {
-            return LSystem::KEY_CUSTOM;
+            TurnAbout(turtles_.back(), 2, -params_[0]);
+            return;
         }
-
-        return LSystem::KEY_NULL;
+        TurnTurtle(turtles_.back(), -1, rotations_);
     }
-
-    static int InfoLocFromString(const octet::string& c)
+    //a + and a - apply their three rotations in the same order, so they don't undo each other,
+    //and randomized ones each take their own angle, so runs are turned one rotation at a time
+    void Turn(int turns)override
     {
-        if (c == "LENGTH")
+        if (recording_)
         {
-            return 0;
+            Record(LSystemOpcodes::OP_TURN, turns);
+            return;
         }
-        if (c == "LENGTH_REDUCTION")
+        for (; turns > 0; --turns)RotatePositive();
+        for (; turns < 0; ++turns)RotateNegative();
+    }
+    void PushStack()override
+    {
+        if (recording_)
         {
-            return 1;
+            Record(LSystemOpcodes::OP_PUSH, 1);
+            return;
         }
-        if (c == "WIDTH")
+        startPos_.push_back(startPos_.back());
+        turtles_.push_back(turtles_.back());
+    }
+    void PopStack()override
+    {
+        if (recording_)
         {
-            return 2;
+            Record(LSystemOpcodes::OP_POP, 1);
+            return;
         }
-        if (c == "WIDTH_REDUCTION")
+        startPos_.pop_back();
+        turtles_.pop_back();
+    }
+    void Custom()override
+    {
+
+    }
+    void Finished()override
+    {
+        if (recording_)BuildInstances();
+    }
+
+    //two summary passes: the first counts each chunk's sections and rotations so a prefix sum gives
+    //every chunk its vertices, indices and rotation ordinals, the second runs the chunk's turtle from
+    //the identity for its net movement and what it leaves on the stack, then the scan works out
+    //the real turtle each chunk starts with and the ones it pops back to
+    int GetSplitPasses() const override
+    {
+        return instancing_ ? 0 : 2;
+    }
+    void BeginSplit(int chunks)override
+    {
+        split_.resize(chunks);
+    }
+    void SummarizeChunk(int pass, int chunk, const unsigned char* keys, int count)override
+    {
+        SplitChunk& split = split_[chunk];
+        if (pass == 0)
         {
-            return 3;
+            split.draws = split.turns = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                split.draws += keys[i] == LSystem::KEY_DRAW;
+                split.turns += keys[i] == LSystem::KEY_PLUS_ROTATE || keys[i] == LSystem::KEY_MINUS_ROTATE;
+            }
+            return;
         }
-        if (c == "MIN_ROT_X")
+        SplitTurtle identity = { { { 0, 0, 0, 0 }, { 0, 0, 0, 1 } }, -1 };
+        std::vector<SplitTurtle>& stack = split.stack;
+        stack.resize(0);
+        stack.push_back(identity);
+        split.pops = 0;
+        unsigned int rotations = split.rotationBase;
+        int vertex = split.vertexBase;
+        for (int i = 0; i < count; ++i)
         {
-            return 4;
+            switch (keys[i])
+            {
+            case(LSystem::KEY_DRAW) :
+                Move(stack.back().turtle, sectionLength_);
+                stack.back().start = vertex;
+                vertex += cylinderBase_.size();
+                break;
+            case(LSystem::KEY_PLUS_ROTATE) :
+                TurnTurtle(stack.back().turtle, 1, rotations);
+                break;
+            case(LSystem::KEY_MINUS_ROTATE) :
+                TurnTurtle(stack.back().turtle, -1, rotations);
+                break;
+            case(LSystem::KEY_PUSH) :
+            {
+                SplitTurtle top = stack.back();
+                stack.push_back(top);
+                break;
+            }
+            case(LSystem::KEY_POP) :
+                if (stack.size() > 1)
+                {
+                    stack.pop_back();
+                }
+                else
+                {
+                    //pops a turtle pushed before the chunk, what follows moves relative to that one
+                    ++split.pops;
+                    stack.back() = identity;
+                }
+                break;
+            default:
+                break;
+            }
         }
-        if (c == "MAX_ROT_X")
+    }
+    void ScanSplit(int pass)override
+    {
+        if (pass == 0)
         {
-            return 7;
+            int ring = cylinderBase_.size();
+            int vertex = verticies_.size();
+            int index = indicies_.size();
+            unsigned int rotations = rotations_;
+            for (int c = 0; c < (int)split_.size(); ++c)
+            {
+                SplitChunk& split = split_[c];
+                split.vertexBase = vertex;
+                split.indexBase = index;
+                split.rotationBase = rotations;
+                vertex += split.draws * ring;
+                index += split.draws * ring * 6;
+                rotations += split.turns;
+            }
+            verticies_.resize(vertex);
+            indicies_.resize(index);
+            rotations_ = rotations;
+            vertexCount_ = vertex;
+            return;
         }
-        if (c == "MIN_ROT_Y")
+        //the turtle stack as it stands between chunks
+        octet::dynarray<SplitTurtle>& stack = splitStack_;
+        stack.resize(0);
+        for (int k = 0; k < turtles_.size(); ++k)
         {
-            return 5;
+            SplitTurtle turtle = { turtles_[k], startPos_[k] };
+            stack.push_back(turtle);
         }
-        if (c== "MAX_ROT_Y")
+        for (int c = 0; c < (int)split_.size(); ++c)
         {
-            return 8;
-        }
-        if (c == "MIN_ROT_Z")
-        {  
-            return 6;
+            SplitChunk& split = split_[c];
+            split.starts.resize(0);
+            split.starts.push_back(stack.back());
+            for (int k = 0; k < split.pops; ++k)
+            {
+                if (stack.size() > 1)stack.pop_back();
+                split.starts.push_back(stack.back());
+            }
+            SplitTurtle base = stack.back();
+            stack.pop_back();
+            for (int k = 0; k < (int)split.stack.size(); ++k)
+            {
+                stack.push_back(Compose(base, split.stack[k]));
+            }
         }
-        if (c == "MAX_ROT_Z")
+        turtles_.resize(0);
+        startPos_.resize(0);
+        for (int k = 0; k < stack.size(); ++k)
         {
-            return 9;
+            turtles_.push_back(stack[k].turtle);
+            startPos_.push_back(stack[k].start);
         }
     }
-
-    //cheks to see if that char is grammer
-    //grammer being defined as the characters in quote marks ||| , { } =  ; |||
-    inline bool IsNotGrammer(char c)
-    {
-        return (c != ','&&c != '{'&&c != '}'&&c != '='&&c != ';');
-    }
-
-    //checks to see if that char was seen in our alphabet
-    bool IsInAlphabet(char c)
+    //the chunk's turtle again, this time from its real start and writing its rings and indices
+    //into the ranges the first scan gave it, so the chunks never touch each other's geometry
+    void EmitChunk(int chunk, const unsigned char* keys, int count)override
     {
-        //instead, make sure that the tempAlphabet vec is sorted,
-        //or have 255 sized array containing bools if the symbol had been added
-        //this will work for now, as it is unlikely the alphabet will be too long
-        for (int i = 0; i < tempAlphabet_.size(); ++i)
+        const SplitChunk& split = split_[chunk];
+        octet::dynarray<SplitTurtle> stack;
+        stack.push_back(split.starts[0]);
+        int pops = 0;
+        unsigned int rotations = split.rotationBase;
+        int ring = cylinderBase_.size();
+        int vertex = split.vertexBase;
+        myVertex* vertices = verticies_.data();
+        unsigned int* indices = indicies_.data() + split.indexBase;
+        for (int i = 0; i < count; ++i)
         {
-            if (tempAlphabet_[i] == c)
+            switch (keys[i])
             {
-                return true;
+            case(LSystem::KEY_DRAW) :
+            {
+                SplitTurtle& top = stack.back();
+                Move(top.turtle, sectionLength_);
+                Segment segment;
+                segment.scale = 1.0f;
+                segment.start = top.start;
+                memcpy(segment.position, top.turtle.position, sizeof(segment.position));
+                memcpy(segment.rotation, top.turtle.rotation, sizeof(segment.rotation));
+                octet::vec3 axes[3];
+                Axes(segment.rotation, axes);
+                for (int k = 0; k < ring; ++k)
+                {
+                    vertices[vertex + k] = RingVertex(segment, axes, k);
+                    RingQuad(indices, k, segment.start, vertex);
+                    indices += 6;
+                }
+                top.start = vertex;
+                vertex += ring;
+                break;
             }
-        }
-        return false;
-    }
-
-    //clean out whitespace from the data
-    void CleanWhiteSpace()
-    {
-        //looks for new line, space and tabs and deletes them
-        char* readPtr = read_.data();
-        char* writePtr = read_.data();
-        char* endPtr = read_.data() + read_.size();
-        int counter = 0;
-        while (readPtr != endPtr)
-        {
-            if (*readPtr != ' ' && *readPtr != '\n' && *readPtr != '\t')//if its not whitespace
+            case(LSystem::KEY_PLUS_ROTATE) :
+                TurnTurtle(stack.back().turtle, 1, rotations);
+                break;
+            case(LSystem::KEY_MINUS_ROTATE) :
+                TurnTurtle(stack.back().turtle, -1, rotations);
+                break;
+            case(LSystem::KEY_PUSH) :
             {
-                ++counter; //we found a character, so increment eg (A,B,c,d etc...)
-                if (*writePtr == ' ' || *writePtr == '\n' || *writePtr == '\t')// if we can write into whitespace
+                SplitTurtle top = stack.back();
+                stack.push_back(top);
+                break;
+            }
+            case(LSystem::KEY_POP) :
+                if (stack.size() > 1)
+                {
+                    stack.pop_back();
+                }
+                else
                 {
-                    *writePtr = *readPtr; //do it
-                    *readPtr = ' ';// and replace our reading character with whitespace
+                    stack.back() = split.starts[++pops];
                 }
-                ++readPtr;
-                ++writePtr;
-            }
-            else
-            {
-
-                ++readPtr;//we are going over whitespace, skip it
+                break;
+            default:
+                break;
             }
         }
-        read_.resize(counter);//keep the size conistant
-    }
-private:
-    octet::dynarray<char> tempAlphabet_;
-    octet::dynarray<char> read_;
-};
-
-
-
-
-class DrawHelper2D: public LSystemVisualizer
-{
-public:
-
-    DrawHelper2D():dir_(0,1,0){
-        maxRot_ = 0;
-        minRot_ = 0;
-    lineLength_=0.1f;
-    meshy_ = new octet::mesh();
     }
-
-    void Init(LSystemDrawInfo* info)override
+    void SetState(LSystemState* state)override
     {
-        if (info)
+        Turtle start = { { 0, 0, 0, 0 }, { 0, 0, 0, 1 } };
+        turtles_.resize(0);
+        turtles_.push_back(start);
+        rotations_ = 0;
+        verticies_.resize(0);
+        indicies_.resize(0);
+        vertexCount_ = 0;
+        ClearInstances();
+        if (startPos_.size())
         {
-            if(info->sectionLength)lineLength_ = info->sectionLength;
-            if (info->minZRot)minRot_ = info->minZRot;
-            if (info->maxZRot)maxRot_ = info->maxZRot;
+            startPos_.resize(1);
+            startPos_.back() = 0;
         }
     }
-    void DrawLine() override
-    {
-        verticies_.push_back(myVertex(matrixStack_.back()[3].xyz(), 0xff + 255));
-        matrixStack_.back().translate((dir_*lineLength_).x(),
-            (dir_*lineLength_).y(),
-            (dir_*lineLength_).z());
-        verticies_.push_back(myVertex(matrixStack_.back()[3].xyz(), 0xff + 255));
 
-    }
-   void RotatePositive()override
+    //counted by the turtle, so it is safe to call while another thread builds the geometry
+    int GetVertexCount() const override
     {
-       matrixStack_.back().rotateZ(minRot_);
+        return vertexCount_;
     }
-    void RotateNegative()override
+
+    //copies the finished cylinders into the mesh, this needs the GL context so call it
+    //on the thread that renders rather than from Finished
+    void Upload()
     {
-        matrixStack_.back().rotateZ(-minRot_);
+        LSystemMeshData data;
+        Take(data);
+        Upload(data);
     }
-    void PushStack()override
+
+    //moves the finished cylinders out so they can be kept or uploaded later,
+    //instanced output is flattened on the way
+    void Take(LSystemMeshData& data)
     {
-        matrixStack_.push_back(matrixStack_.back());
+        if (instanced_)
+        {
+            LSystemInstancedMesh mesh;
+            TakeInstanced(mesh);
+            Flatten(mesh, data);
+            return;
+        }
+        data.vertices.resize(sizeof(myVertex)* verticies_.size());
+        data.indices.resize(sizeof(unsigned int)*indicies_.size());
+        memcpy(data.vertices.data(), verticies_.data(), data.vertices.size());
+        memcpy(data.indices.data(), indicies_.data(), data.indices.size());
+        verticies_.resize(0);
+        indicies_.resize(0);
+        startPos_.back() = 0;
     }
-    void PopStack()override
+
+    //moves the cylinders out with the instanced branches left as instances, without instancing
+    //everything is in mesh.root
+    void TakeInstanced(LSystemInstancedMesh& mesh)
     {
-        matrixStack_.pop_back();
+        CopyOut(verticies_, indicies_, mesh.root);
+        CopyOut(prototypeVertices_, prototypeIndices_, mesh.prototypeMesh);
+        mesh.instances.resize(rootInstances_.size());
+        memcpy(mesh.instances.data(), rootInstances_.data(), rootInstances_.size() * sizeof(LSystemInstancedMesh::Instance));
+        mesh.prototypeInstances.resize(prototypeInstances_.size());
+        memcpy(mesh.prototypeInstances.data(), prototypeInstances_.data(),
+            prototypeInstances_.size() * sizeof(LSystemInstancedMesh::Instance));
+        mesh.prototypes.resize(prototypes_.size());
+        memcpy(mesh.prototypes.data(), prototypes_.data(), prototypes_.size() * sizeof(LSystemInstancedMesh::Prototype));
+        mesh.ring = cylinderBase_.size();
+        verticies_.resize(0);
+        indicies_.resize(0);
+        ClearInstances();
+        startPos_.back() = 0;
     }
-    void Custom()override
+
+    //every instance expanded where it was placed, each branch joining the ring before it, so the mesh is
+    //the one Take would have made without instancing
+    static void Flatten(const LSystemInstancedMesh& mesh, LSystemMeshData& data)
     {
-       
+        octet::dynarray<int> vertexTotals;
+        int vertices;
+        int indices;
+        FlattenedSize(mesh, vertexTotals, vertices, indices);
+        data.vertices.resize(vertices * sizeof(myVertex));
+        data.indices.resize(indices * sizeof(unsigned int));
+        Flatten(mesh, vertexTotals.data(), (myVertex*)data.vertices.data(), (unsigned int*)data.indices.data());
     }
-    void SetState(LSystemState* state)override
+
+    //instances are flattened straight into the mesh's buffers, so an instanced mesh is only expanded here
+    void Upload(const LSystemInstancedMesh& mesh)
     {
-        matrixStack_.resize(0);
-        matrixStack_.push_back(octet::mat4t());
+        if (!mesh.instances.size())
+        {
+            Upload(mesh.root);
+            return;
+        }
+        octet::dynarray<int> vertexTotals;
+        int vertices;
+        int indices;
+        FlattenedSize(mesh, vertexTotals, vertices, indices);
+        AllocateMesh(vertices, indices);
+        octet::gl_resource::wolock vl(meshy_->get_vertices());
+        octet::gl_resource::wolock il(meshy_->get_indices());
+        Flatten(mesh, vertexTotals.data(), (myVertex*)vl.u8(), (unsigned int*)il.u8());
     }
 
-    void Finished()override
+    //only touches the mesh, so it is safe while another thread visualizes into this helper
+    void Upload(const LSystemMeshData& data)
     {
-        
-        meshy_->allocate(sizeof(myVertex)* verticies_.size(), 0);
-        meshy_->set_params(sizeof(myVertex), 0, verticies_.size(), GL_LINES, 0);
-
-        meshy_->clear_attributes();
-        meshy_->add_attribute(octet::attribute_pos, 3, GL_FLOAT, 0);
-        meshy_->add_attribute(octet::attribute_color, 4, GL_UNSIGNED_BYTE, 12, TRUE);
-
+        AllocateMesh(data.vertices.size() / sizeof(myVertex), data.indices.size() / sizeof(unsigned int));
         octet::gl_resource::wolock vl(meshy_->get_vertices());
-        myVertex* vtx = (myVertex*)vl.u8();
-
-        memcpy(vtx, verticies_.data(), sizeof(myVertex)*verticies_.size());
-        verticies_.resize(0);
+        octet::gl_resource::wolock il(meshy_->get_indices());
+        memcpy(vl.u8(), data.vertices.data(), data.vertices.size());
+        memcpy(il.u8(), data.indices.data(), data.indices.size());
     }
 
 
@@ -842,274 +7231,1205 @@ public:
         return meshy_;
     }
 private:
+
+    float max(float a, float b) const {return a > b ? a : b; }
+
+    void AllocateMesh(int vertexCount, int indexCount)
+    {
+        meshy_->allocate(vertexCount * sizeof(myVertex), indexCount * sizeof(unsigned int));
+        meshy_->set_params(sizeof(myVertex), indexCount, vertexCount, GL_TRIANGLES, GL_UNSIGNED_INT);
+
+        meshy_->clear_attributes();
+        meshy_->add_attribute(octet::attribute_pos, 3, GL_FLOAT, 0);
+        meshy_->add_attribute(octet::attribute_normal, 3, GL_FLOAT, 12);
+        meshy_->add_attribute(octet::attribute_uv, 2, GL_FLOAT, 24);
+    }
+
     struct myVertex
     {
-        myVertex(octet::vec3 v, uint32_t col)
+        myVertex(octet::vec3 v)
         {
-            pos = v; color = col;
+            pos = v; normal = v;
         }
         myVertex(){}
-        octet::vec3p pos;
-        uint32_t color;
+        octet::vec3 pos;
+        octet::vec3 normal;
+        octet::vec2 uv;
     };
 
-    octet::dynarray<myVertex> verticies_;
-
-    float lineLength_;
-    float minRot_;
-    float maxRot_;
-    octet::vec3 dir_;
+    //where the turtle is and which way it faces, a unit quaternion x, y, z, w; each half is one
+    //SSE register and a push copies 32 bytes, rotations are quaternion products
+    struct Turtle
+    {
+        float position[4];//the last is padding
+        float rotation[4];
+    };
 
-    int numVerticies_;
+    //a turtle and the ring its next section joins, while a chunk's turtle is run from the identity
+    //start is -1 until it draws, the ring being the one of the turtle the chunk turns out to start from
+    struct SplitTurtle
+    {
+        Turtle turtle;
+        int start;
+    };
 
-    LSystemState* state_;
+    //what the split passes know about one chunk of the level
+    struct SplitChunk
+    {
+        int draws;
+        int turns;
+        //first vertex, index and rotation ordinal of the chunk
+        int vertexBase;
+        int indexBase;
+        unsigned int rotationBase;
+        //pops of turtles pushed before the chunk, and the stack it leaves above the last one it pops to,
+        //relative to that turtle with the turtle at the end on top
+        int pops;
+        std::vector<SplitTurtle> stack;
+        //the turtle the chunk starts with then the one each of its pops goes back to
+        std::vector<SplitTurtle> starts;
+    };
 
-    octet::dynarray<octet::mat4t> matrixStack_;
-    octet::vec3 direction_;
+    //rel carried on from base, rel's position being along base's axes
+    static Turtle Compose(const Turtle& base, const Turtle& rel)
+    {
+        octet::vec3 axes[3];
+        Axes(base.rotation, axes);
+        Turtle result = base;
+        const float* p = rel.position;
+        result.position[0] += axes[0].x() * p[0] + axes[1].x() * p[1] + axes[2].x() * p[2];
+        result.position[1] += axes[0].y() * p[0] + axes[1].y() * p[1] + axes[2].y() * p[2];
+        result.position[2] += axes[0].z() * p[0] + axes[1].z() * p[1] + axes[2].z() * p[2];
+        Multiply(result.rotation, rel.rotation);
+        return result;
+    }
+    static SplitTurtle Compose(const SplitTurtle& base, const SplitTurtle& rel)
+    {
+        SplitTurtle result = { Compose(base.turtle, rel.turtle), rel.start >= 0 ? rel.start : base.start };
+        return result;
+    }
 
-    octet::ref<octet::mesh> meshy_;
-};
+    //a branch still open while the recording is reduced, from the push at begin
+    struct BranchFrame
+    {
+        int begin;
+        int signature;//where it starts in signature_
+        int sections;
+    };
 
-#include "AngleConvert.h"
+    //stands in a signature for an instanced branch, its prototype in the count bits
+    enum { OP_INSTANCE = LSystemOpcodes::OP_MASK };
 
-#include<time.h>
-#include <random>
-class DrawHelper3D : public LSystemVisualizer
-{
-public:
-    DrawHelper3D(int vertexNum) : minRot_(20,20,20),maxRot_(0,0,0), dir_(0, 1, 0),
-    randomize_(true){
-        thickness_ = 0.5f;
-        thicknessReduction_ = 0;
-        sectionLength_ = 0.5f;
-        meshy_ = new octet::mesh();
-        cylinderBase_.resize(vertexNum);
-        srand(time(NULL));
-    }
-    void Init(LSystemDrawInfo* info)  override
+    //turns the same way fold, as two RotatePositives are a Turn(2), but draws don't as each is a ring
+    void Record(int op, int count)
     {
-        float oldThick = thickness_;
-        if (info)
+        int last = record_.size() - 1;
+        if (op == LSystemOpcodes::OP_TURN && last >= 0 && (record_[last] & LSystemOpcodes::OP_MASK) == op)
         {
-            if (info->sectionWidth) thickness_ = info->sectionWidth;
-            if (info->sectionWidthReduction) thicknessReduction_ = info->sectionWidthReduction;
-            if (info->sectionLength)sectionLength_ = info->sectionLength;
-            if (info->minXRot || info->minYRot || info->minZRot)
+            int turns = record_[last] >> LSystemOpcodes::OP_BITS;
+            if ((turns > 0) == (count > 0) && turns < LSystemOpcodes::MAX_RUN && turns > -LSystemOpcodes::MAX_RUN)
             {
-                minRot_ = octet::vec3(info->minXRot, info->minYRot, info->minZRot);
+                record_[last] = op | (int)((unsigned int)(turns + count) << LSystemOpcodes::OP_BITS);
+                return;
             }
-            if (info->maxXRot || info->maxYRot || info->maxZRot) maxRot_ = octet::vec3(info->maxXRot, info->maxYRot, info->maxZRot);
-            randomize_ = info->randomize;
         }
-        if (startPos_.size() == 0)
+        record_.push_back(op | (int)((unsigned int)count << LSystemOpcodes::OP_BITS));
+    }
+
+    //the recording has no parameters, so a parametric level draws what was recorded and carries on directly
+    void StopRecording()
+    {
+        recording_ = false;
+        for (int i = 0; i < record_.size(); ++i)
         {
-            float angle = M_PI * 2 / cylinderBase_.size();
-            for (int i = 0; i < cylinderBase_.size(); ++i)
+            int count = record_[i] >> LSystemOpcodes::OP_BITS;
+            switch (record_[i] & LSystemOpcodes::OP_MASK)
             {
-                cylinderBase_[i] = myVertex(octet::vec3(
-                    sinf(angle*i)*thickness_,
-                    0,
-                    cosf(angle*i)*thickness_));
-                verticies_.push_back(cylinderBase_.back());
+            case(LSystemOpcodes::OP_DRAW) :
+                DrawLines(count);
+                break;
+            case(LSystemOpcodes::OP_TURN) :
+                Turn(count);
+                break;
+            case(LSystemOpcodes::OP_PUSH) :
+                PushStack();
+                break;
+            case(LSystemOpcodes::OP_POP) :
+                PopStack();
+                break;
             }
-            startPos_.push_back(0);
         }
-        else if (thickness_ != oldThick)
+        record_.resize(0);
+    }
+
+    //reduces every branch of the recording bottom up as its pop is reached to a signature, its opcodes with each
+    //instanced branch inside it standing in as one OP_INSTANCE, so a signature is only as long as what the branch
+    //draws itself; a big enough branch's signature picks its prototype, built the first time the signature turns up,
+    //then the level itself is drawn with those branches placed as instances
+    void BuildInstances()
+    {
+        recording_ = false;
+        instanced_ = true;
+        const int* ops = record_.data();
+        int count = record_.size();
+        instanceEnd_.resize(count);
+        instanceOf_.resize(count);
+        frames_.resize(0);
+        signature_.resize(0);
+        prototypeIds_.clear();
+        prototypeNext_.resize(0);
+        signatures_.resize(0);
+        signatureStart_.resize(0);
+        signatureStart_.push_back(0);
+        for (int i = 0; i < count; ++i)
         {
-            for (int i = 0; i < cylinderBase_.size(); ++i)
+            int op = ops[i] & LSystemOpcodes::OP_MASK;
+            if (op == LSystemOpcodes::OP_PUSH)
             {
-                cylinderBase_[i].pos = cylinderBase_[i].pos.normalize();
-                cylinderBase_[i].pos *= thickness_;
+                BranchFrame frame = { i, (int)signature_.size(), 0 };
+                frames_.push_back(frame);
+                instanceEnd_[i] = -1;
+            }
+            if (!frames_.size())continue;
+            signature_.push_back(ops[i]);
+            if (op == LSystemOpcodes::OP_POP)
+            {
+                BranchFrame frame = frames_.back();
+                frames_.pop_back();
+                if (frame.sections >= minInstanceSections_)
+                {
+                    int prototype = FindPrototype(frame.begin, i, frame.signature);
+                    instanceEnd_[frame.begin] = i;
+                    instanceOf_[frame.begin] = prototype;
+                    signature_.resize(frame.signature);
+                    signature_.push_back(OP_INSTANCE | (prototype << LSystemOpcodes::OP_BITS));
+                }
+                if (frames_.size())frames_.back().sections += frame.sections;
+                else signature_.resize(0);
+                continue;
             }
+            frames_.back().sections += op == LSystemOpcodes::OP_DRAW;
         }
+        DrawBranch(0, count, turtles_.back(), startPos_.back(), verticies_, 0, indicies_, 0, rootInstances_);
+        vertexCount_ = verticies_.size() + prototypeVertices_.size();
+        record_.resize(0);
     }
-    void DrawLine() override
+
+    //the prototype of the branch from the push at begin to its pop at end, whose signature runs from signature
+    //to the end of signature_; the hash only finds the prototypes to compare it with, one is built when none match
+    int FindPrototype(int begin, int end, int signature)
     {
-        octet::vec3 v = dir_*sectionLength_;
-        matrixStack_.back().translate(v.x(), v.y(), v.z());
-        for (int i = 0; i < cylinderBase_.size(); ++i)
+        const int* ops = signature_.data() + signature;
+        int length = signature_.size() - signature;
+        unsigned long long hash = LSystemHash(LSYSTEM_HASH_SEED, ops, length * sizeof(int));
+        std::unordered_map<unsigned long long, int>::iterator found = prototypeIds_.find(hash);
+        int next = found != prototypeIds_.end() ? found->second : -1;
+        for (int p = next; p >= 0; p = prototypeNext_[p])
+        {
+            if (signatureStart_[p + 1] - signatureStart_[p] == length &&
+                memcmp(signatures_.data() + signatureStart_[p], ops, length * sizeof(int)) == 0)return p;
+        }
+        int prototype = BuildPrototype(begin, end);
+        for (int k = 0; k < length; ++k)
         {
-            verticies_.push_back(myVertex(matrixStack_.back()[3].xyz()+(cylinderBase_[i].pos*matrixStack_.back())));
+            signatures_.push_back(ops[k]);
         }
-        startPos_.back() = MakeIndecies(startPos_.back());
+        signatureStart_.push_back(signatures_.size());
+        prototypeNext_.push_back(next);
+        prototypeIds_[hash] = prototype;
+        return prototype;
     }
-    void RotatePositive()override
+
+    //the branch from the push at begin to its pop at end drawn from the identity, after a ring of its own
+    //for its first section to join
+    int BuildPrototype(int begin, int end)
     {
-        
-        if (randomize_)
+        LSystemInstancedMesh::Prototype prototype;
+        prototype.firstVertex = prototypeVertices_.size();
+        prototype.firstIndex = prototypeIndices_.size();
+        prototype.firstInstance = prototypeInstances_.size();
+        Turtle identity = { { 0, 0, 0, 0 }, { 0, 0, 0, 1 } };
+        for (int k = 0; k < cylinderBase_.size(); ++k)
+        {
+            prototypeVertices_.push_back(cylinderBase_[k]);
+        }
+        DrawBranch(begin + 1, end, identity, 0, prototypeVertices_, prototype.firstVertex, prototypeIndices_, prototype.firstIndex,
+            prototypeInstances_);
+        prototype.vertexCount = prototypeVertices_.size() - prototype.firstVertex;
+        prototype.indexCount = prototypeIndices_.size() - prototype.firstIndex;
+        prototype.instanceCount = prototypeInstances_.size() - prototype.firstInstance;
+        prototypes_.push_back(prototype);
+        return prototypes_.size() - 1;
+    }
+
+    //draws the recording from begin to end as the turtle would from turtle, placing the branches that
+    //have prototypes as instances instead; vertices and indices count from firstVertex and firstIndex
+    void DrawBranch(int begin, int end, const Turtle& turtle, int start, octet::dynarray<myVertex>& vertices, int firstVertex,
+        octet::dynarray<unsigned int>& indices, int firstIndex, octet::dynarray<LSystemInstancedMesh::Instance>& instances)
+    {
+        const int* ops = record_.data();
+        SplitTurtle first = { turtle, start };
+        branchStack_.resize(0);
+        branchStack_.push_back(first);
+        for (int i = begin; i < end; ++i)
         {
-            float r = (float)rand() / RAND_MAX;
-            switch (rand() % 3)
+            int count = ops[i] >> LSystemOpcodes::OP_BITS;
+            switch (ops[i] & LSystemOpcodes::OP_MASK)
+            {
+            case(LSystemOpcodes::OP_DRAW) :
             {
-            case 0:
-                matrixStack_.back().rotateZ(minRot_.z() + max(maxRot_.z() - minRot_.z()*r,
-                    0));
+                SplitTurtle& top = branchStack_.back();
+                Move(top.turtle, sectionLength_ * count);
+                Segment segment;
+                segment.scale = 1.0f;
+                segment.start = top.start;
+                memcpy(segment.position, top.turtle.position, sizeof(segment.position));
+                memcpy(segment.rotation, top.turtle.rotation, sizeof(segment.rotation));
+                top.start = AppendRing(segment, vertices, firstVertex, indices);
                 break;
-            case 1:
-                matrixStack_.back().rotateX(minRot_.x() + max(maxRot_.x() - minRot_.x()*r,
-                    0));
+            }
+            case(LSystemOpcodes::OP_TURN) :
+                for (; count > 0; --count)Multiply(branchStack_.back().turtle.rotation, turnPositive_);
+                for (; count < 0; ++count)Multiply(branchStack_.back().turtle.rotation, turnNegative_);
+                break;
+            case(LSystemOpcodes::OP_PUSH) :
+                if (instanceEnd_[i] >= 0)
+                {
+                    const SplitTurtle& top = branchStack_.back();
+                    LSystemInstancedMesh::Instance instance;
+                    instance.prototype = instanceOf_[i];
+                    instance.join = top.start;
+                    instance.vertex = vertices.size() - firstVertex;
+                    instance.index = indices.size() - firstIndex;
+                    memcpy(instance.position, top.turtle.position, sizeof(instance.position));
+                    memcpy(instance.rotation, top.turtle.rotation, sizeof(instance.rotation));
+                    instances.push_back(instance);
+                    i = instanceEnd_[i];
+                }
+                else
+                {
+                    SplitTurtle top = branchStack_.back();
+                    branchStack_.push_back(top);
+                }
                 break;
-            case 2:
-                matrixStack_.back().rotateY(minRot_.y() + max(maxRot_.y() - minRot_.y()*r,
-                    0));
+            case(LSystemOpcodes::OP_POP) :
+                if (branchStack_.size() > 1)branchStack_.pop_back();
                 break;
             }
         }
-        else
+    }
+
+    //where Flatten writes to and how many vertices each prototype comes out as
+    struct Flattening
+    {
+        myVertex* vertices;
+        unsigned int* indices;
+        int vertex;//written so far
+        int index;
+        const int* vertexTotals;
+        octet::dynarray<int> offsets;//for each piece being written, the output index less the piece's own of each run
+    };
+
+    //sizes of the flattened mesh: each prototype without its own ring and with its sub-branches expanded,
+    //prototypes being built after the branches inside them so one pass in order sizes them all
+    static void FlattenedSize(const LSystemInstancedMesh& mesh, octet::dynarray<int>& vertexTotals, int& vertices, int& indices)
+    {
+        int count = mesh.prototypes.size();
+        octet::dynarray<int> indexTotals;
+        vertexTotals.resize(count);
+        indexTotals.resize(count);
+        for (int p = 0; p < count; ++p)
         {
-            
-            matrixStack_.back().rotateZ(minRot_.z());
-            matrixStack_.back().rotateX(minRot_.x());
-            matrixStack_.back().rotateY(minRot_.y());
+            const LSystemInstancedMesh::Prototype& prototype = mesh.prototypes[p];
+            vertexTotals[p] = prototype.vertexCount - mesh.ring;
+            indexTotals[p] = prototype.indexCount;
+            for (int k = 0; k < prototype.instanceCount; ++k)
+            {
+                int child = mesh.prototypeInstances[prototype.firstInstance + k].prototype;
+                vertexTotals[p] += vertexTotals[child];
+                indexTotals[p] += indexTotals[child];
+            }
+        }
+        vertices = mesh.root.vertices.size() / sizeof(myVertex);
+        indices = mesh.root.indices.size() / sizeof(unsigned int);
+        for (int k = 0; k < mesh.instances.size(); ++k)
+        {
+            vertices += vertexTotals[mesh.instances[k].prototype];
+            indices += indexTotals[mesh.instances[k].prototype];
         }
     }
-    void RotateNegative()override
+
+    static void Flatten(const LSystemInstancedMesh& mesh, const int* vertexTotals, myVertex* vertices, unsigned int* indices)
+    {
+        Flattening out;
+        out.vertices = vertices;
+        out.indices = indices;
+        out.vertex = 0;
+        out.index = 0;
+        out.vertexTotals = vertexTotals;
+        FlattenPiece(mesh, (const myVertex*)mesh.root.vertices.data(), mesh.root.vertices.size() / sizeof(myVertex),
+            (const unsigned int*)mesh.root.indices.data(), mesh.root.indices.size() / sizeof(unsigned int),
+            mesh.instances.data(), mesh.instances.size(), NULL, 0, 0, out);
+    }
+
+    //writes a piece, the root as it is or a prototype placed at turtle, with its instances expanded where they were
+    //placed; the piece's own vertices come in runs split by the instances, each run at a fixed offset from where
+    //it is in the piece, and its first skip vertices are the ring its first section joins, already written at join
+    static void FlattenPiece(const LSystemInstancedMesh& mesh, const myVertex* vertices, int vertexCount, const unsigned int* indices,
+        int indexCount, const LSystemInstancedMesh::Instance* instances, int instanceCount, const Turtle* turtle, int skip, int join,
+        Flattening& out)
     {
-        if (randomize_)
+        int first = out.offsets.size();
+        int written = out.vertex;
+        int local = skip;
+        for (int k = 0; k < instanceCount; ++k)
         {
-            float r = (float)rand() / RAND_MAX;
-            switch (rand() % 3)
+            out.offsets.push_back(written - local);
+            written += instances[k].vertex - local + out.vertexTotals[instances[k].prototype];
+            local = instances[k].vertex;
+        }
+        out.offsets.push_back(written - local);
+
+        octet::vec3 axes[3];
+        octet::vec3 position(0, 0, 0);
+        if (turtle)
+        {
+            Axes(turtle->rotation, axes);
+            position = octet::vec3(turtle->position[0], turtle->position[1], turtle->position[2]);
+        }
+        int vertex = skip;
+        int index = 0;
+        for (int k = 0; k <= instanceCount; ++k)
+        {
+            int vertexEnd = k < instanceCount ? instances[k].vertex : vertexCount;
+            int indexEnd = k < instanceCount ? instances[k].index : indexCount;
+            const int* offsets = out.offsets.data() + first;
+            int runStart = vertex;
+            for (; vertex < vertexEnd; ++vertex)
             {
-            case 0:
-                matrixStack_.back().rotateZ(-(minRot_.z() + max(maxRot_.z() - minRot_.z()*r,
-                    0)));
-                break;
-            case 1:
-                matrixStack_.back().rotateX(-(minRot_.x() + max(maxRot_.x() - minRot_.x()*r,
-                    0)));
-                break;
-            case 2:
-                matrixStack_.back().rotateY(-(minRot_.y() + max(maxRot_.y() - minRot_.y()*r,
-                    0)));
-                break;
+                if (turtle)
+                {
+                    octet::vec3 p = vertices[vertex].pos;
+                    out.vertices[out.vertex++] = myVertex(position + axes[0] * p.x() + axes[1] * p.y() + axes[2] * p.z());
+                }
+                else
+                {
+                    out.vertices[out.vertex++] = vertices[vertex];
+                }
+            }
+            //a run's quads join its own rings or the last ring before it
+            for (; index < indexEnd; ++index)
+            {
+                int v = indices[index];
+                out.indices[out.index++] = v >= runStart ? v + offsets[k] : FlattenedVertex(v, instances, instanceCount, skip, join, offsets);
             }
+            if (k == instanceCount)break;
+
+            const LSystemInstancedMesh::Instance& instance = instances[k];
+            Turtle relative;
+            memcpy(relative.position, instance.position, sizeof(instance.position));
+            relative.position[3] = 0;
+            memcpy(relative.rotation, instance.rotation, sizeof(instance.rotation));
+            Turtle placed = turtle ? Compose(*turtle, relative) : relative;
+            const LSystemInstancedMesh::Prototype& prototype = mesh.prototypes[instance.prototype];
+            FlattenPiece(mesh, (const myVertex*)mesh.prototypeMesh.vertices.data() + prototype.firstVertex, prototype.vertexCount,
+                (const unsigned int*)mesh.prototypeMesh.indices.data() + prototype.firstIndex, prototype.indexCount,
+                mesh.prototypeInstances.data() + prototype.firstInstance, prototype.instanceCount, &placed, mesh.ring,
+                FlattenedVertex(instance.join, instances, instanceCount, skip, join, offsets), out);
+        }
+        out.offsets.resize(first);
+    }
+
+    //where vertex v of a piece was written, found by the instances placed at or before it
+    static int FlattenedVertex(int v, const LSystemInstancedMesh::Instance* instances, int instanceCount, int skip, int join,
+        const int* offsets)
+    {
+        if (v < skip)return join + v;
+        int lo = 0;
+        int hi = instanceCount;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (instances[mid].vertex <= v)lo = mid + 1;
+            else hi = mid;
+        }
+        return v + offsets[lo];
+    }
+
+    void ClearInstances()
+    {
+        instanced_ = false;
+        rootInstances_.resize(0);
+        prototypeVertices_.resize(0);
+        prototypeIndices_.resize(0);
+        prototypeInstances_.resize(0);
+        prototypes_.resize(0);
+    }
+
+    template<class Vertex, class Index>
+    static void CopyOut(const octet::dynarray<Vertex>& vertices, const octet::dynarray<Index>& indices, LSystemMeshData& data)
+    {
+        data.vertices.resize(sizeof(Vertex) * vertices.size());
+        data.indices.resize(sizeof(Index) * indices.size());
+        memcpy(data.vertices.data(), vertices.data(), data.vertices.size());
+        memcpy(data.indices.data(), indices.data(), data.indices.size());
+    }
+
+    //one ring of the cylinder, the turtle after the move and the ring it joins
+    struct Segment
+    {
+        float position[3];
+        float scale;
+        float rotation[4];
+        int start;
+    };
+
+    //q = q * r, r turning about q's own axes as mat4t's rotate functions do
+    static void Multiply(float q[4], const float r[4])
+    {
+#ifdef LSYSTEM_X86
+        __m128 a = _mm_loadu_ps(q);
+        __m128 b = _mm_loadu_ps(r);
+        __m128 result = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 3)), b);
+        result = _mm_add_ps(result, _mm_mul_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 0, 0)),
+            _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 1, 2, 3))), _mm_setr_ps(1, -1, 1, -1)));
+        result = _mm_add_ps(result, _mm_mul_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)),
+            _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 3, 2))), _mm_setr_ps(1, 1, -1, -1)));
+        result = _mm_add_ps(result, _mm_mul_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2)),
+            _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 3, 0, 1))), _mm_setr_ps(-1, 1, 1, -1)));
+        _mm_storeu_ps(q, result);
+#else
+        float x = q[3] * r[0] + q[0] * r[3] + q[1] * r[2] - q[2] * r[1];
+        float y = q[3] * r[1] - q[0] * r[2] + q[1] * r[3] + q[2] * r[0];
+        float z = q[3] * r[2] + q[0] * r[1] - q[1] * r[0] + q[2] * r[3];
+        float w = q[3] * r[3] - q[0] * r[0] - q[1] * r[1] - q[2] * r[2];
+        q[0] = x;
+        q[1] = y;
+        q[2] = z;
+        q[3] = w;
+#endif
+    }
+
+    //the quaternion of a turn by degrees about axis 0, 1 or 2
+    static void AxisTurn(int axis, float degrees, float r[4])
+    {
+        float half = degrees * DEGPI * 0.5f;
+        r[0] = r[1] = r[2] = 0;
+        r[axis] = sinf(half);
+        r[3] = cosf(half);
+    }
+
+    static void TurnAbout(Turtle& turtle, int axis, float degrees)
+    {
+        float r[4];
+        AxisTurn(axis, degrees, r);
+        Multiply(turtle.rotation, r);
+    }
+
+    //a + when sign is 1 and a - when it is -1, randomized turns take the angle of the given ordinal
+    //and count it, so a chunk of the level can turn its own turtles from where its ordinals start
+    void TurnTurtle(Turtle& turtle, int sign, unsigned int& rotations) const
+    {
+        if (!randomize_)
+        {
+            Multiply(turtle.rotation, sign > 0 ? turnPositive_ : turnNegative_);
+            return;
+        }
+        unsigned int random[2];
+        NextRandom(rotations, random);
+        float r = random[0] * (1.0f / 4294967296.0f);
+        switch (random[1] % 3)
+        {
+        case 0:
+            TurnAbout(turtle, 2, sign * (minRot_.z() + max(maxRot_.z() - minRot_.z()*r,
+                0)));
+            break;
+        case 1:
+            TurnAbout(turtle, 0, sign * (minRot_.x() + max(maxRot_.x() - minRot_.x()*r,
+                0)));
+            break;
+        case 2:
+            TurnAbout(turtle, 1, sign * (minRot_.y() + max(maxRot_.y() - minRot_.y()*r,
+                0)));
+            break;
+        }
+    }
+
+    //the rows a mat4t of the rotation would have, its x, y and z axes; products of unit quaternions
+    //drift from unit length far too slowly to show over the rotations along one branch
+    static void Axes(const float q[4], octet::vec3 axes[3])
+    {
+        float s = 2;
+        float xx = q[0] * q[0] * s, yy = q[1] * q[1] * s, zz = q[2] * q[2] * s;
+        float xy = q[0] * q[1] * s, xz = q[0] * q[2] * s, yz = q[1] * q[2] * s;
+        float wx = q[3] * q[0] * s, wy = q[3] * q[1] * s, wz = q[3] * q[2] * s;
+        axes[0] = octet::vec3(1 - yy - zz, xy + wz, xz - wy);
+        axes[1] = octet::vec3(xy - wz, 1 - xx - zz, yz + wx);
+        axes[2] = octet::vec3(xz + wy, yz - wx, 1 - xx - yy);
+    }
+
+    //moves the turtle along its y axis
+    static void Move(Turtle& turtle, float length)
+    {
+        const float* q = turtle.rotation;
+        float s = 2 * length;
+        turtle.position[0] += (q[0] * q[1] - q[3] * q[2]) * s;
+        turtle.position[1] += length - (q[0] * q[0] + q[2] * q[2]) * s;
+        turtle.position[2] += (q[1] * q[2] + q[3] * q[0]) * s;
+    }
+
+    void DrawSection(float length, float scale)
+    {
+        Turtle& turtle = turtles_.back();
+        Move(turtle, length);
+        Segment segment;
+        segment.scale = scale;
+        segment.start = startPos_.back();
+        memcpy(segment.position, turtle.position, sizeof(segment.position));
+        memcpy(segment.rotation, turtle.rotation, sizeof(segment.rotation));
+        startPos_.back() = vertexCount_;
+        vertexCount_ += cylinderBase_.size();
+        if (batch_)
+        {
+            batch_->Append(segment);
         }
         else
         {
-            matrixStack_.back().rotateZ(-minRot_.z());
-            matrixStack_.back().rotateX(-minRot_.x());
-            matrixStack_.back().rotateY(-minRot_.y());
+            BuildSegment(segment);
         }
     }
-    void PushStack()override
-    {
 
-        startPos_.push_back(startPos_.back());
-        matrixStack_.push_back(matrixStack_.back());
-    }
-    void PopStack()override
+    void BuildSegment(const Segment& segment)
     {
-        startPos_.pop_back();
-        matrixStack_.pop_back();
+        AppendRing(segment, verticies_, 0, indicies_);
     }
-    void Custom()override
+
+    //the segment's ring and its quads back to the ring at segment.start, both counted from firstVertex;
+    //returns where the new ring starts
+    int AppendRing(const Segment& segment, octet::dynarray<myVertex>& vertices, int firstVertex, octet::dynarray<unsigned int>& indices) const
     {
+        octet::vec3 axes[3];
+        Axes(segment.rotation, axes);
+        int objectSize = cylinderBase_.size();
+        for (int i = 0; i < objectSize; ++i)
+        {
+            vertices.push_back(RingVertex(segment, axes, i));
+        }
+        int targetSpace = vertices.size() - objectSize - firstVertex;
+        unsigned int quad[6];
+        for (int i = 0; i < objectSize; ++i)
+        {
+            RingQuad(quad, i, segment.start, targetSpace);
+            for (int k = 0; k < 6; ++k)
+            {
+                indices.push_back(quad[k]);
+            }
+        }
+        return targetSpace;
+    }
 
+    //vertex i of the ring of segment, axes being the segment's rotation
+    myVertex RingVertex(const Segment& segment, const octet::vec3 axes[3], int i) const
+    {
+        octet::vec3 position(segment.position[0], segment.position[1], segment.position[2]);
+        octet::vec3 p = cylinderBase_[i].pos*segment.scale;
+        return myVertex(position + axes[0] * p.x() + axes[1] * p.y() + axes[2] * p.z());
     }
-    void SetState(LSystemState* state)override
+
+    //the rotations use their own counter row above any level the derivation keys by
+    void NextRandom(unsigned int& rotations, unsigned int random[2]) const
     {
-        matrixStack_.resize(0);
-        matrixStack_.push_back(octet::mat4t());
+        LSystemPhilox(seed_, 0xffffffffu, rotations++, random);
     }
 
-    void Finished()override
+    //the two triangles between side i of the ring at startSpace and the ring at targetSpace
+    void RingQuad(unsigned int quad[6], int i, int startSpace, int targetSpace) const
     {
-        meshy_->allocate(sizeof(myVertex)* verticies_.size(), sizeof(unsigned int)*indicies_.size());
-        meshy_->set_params(sizeof(myVertex), indicies_.size(), verticies_.size(),GL_TRIANGLES, GL_UNSIGNED_INT);
+        int objectSize = cylinderBase_.size();
+        /*
+            (ti)------(ti+1)
+              |  \      |
+              |    \    |
+              |      \  |
+              |        \|
+             (si)=-----(si+1)
+        */
+        quad[0] = i + startSpace;
+        quad[1] = ((i + 1) % objectSize) + startSpace;
+        quad[2] = i + targetSpace;
+        quad[3] = i + targetSpace;
+        quad[4] = ((i + 1) % objectSize) + startSpace;
+        quad[5] = ((i + 1) % objectSize) + targetSpace;
+    }
 
-        meshy_->clear_attributes();
-        meshy_->add_attribute(octet::attribute_pos, 3, GL_FLOAT, 0);
-        meshy_->add_attribute(octet::attribute_normal, 3, GL_FLOAT, 12);
-        meshy_->add_attribute(octet::attribute_uv, 2, GL_FLOAT, 24);
+    octet::dynarray<myVertex> verticies_;
+    octet::dynarray<unsigned int> indicies_;
+    octet::dynarray<int> startPos_;
 
-        octet::gl_resource::wolock vl(meshy_->get_vertices());
-        octet::gl_resource::wolock il(meshy_->get_indices());
-        myVertex* vtx = (myVertex*)vl.u8();
-        unsigned int * indx = (unsigned int*)il.u8();
 
-        memcpy(vtx, verticies_.data(), sizeof(myVertex)*verticies_.size());
-        memcpy(indx, indicies_.data(), sizeof(unsigned int)*indicies_.size());
-        verticies_.resize(0);
-        indicies_.resize(0);
-        startPos_.back() = 0;
-    }
+    octet::dynarray<myVertex> cylinderBase_;
 
+    float sectionLength_;
+    float thickness_;
 
-    octet::mesh* GetMesh()
-    {
-        return meshy_;
-    }
-private:
+    float thicknessReduction_;
 
-    float max(float a, float b){return a > b ? a : b; }
+    octet::vec3 minRot_;
+    octet::vec3 maxRot_;
+    float turnPositive_[4];//an unrandomized + and -
+    float turnNegative_[4];
 
-    int MakeIndecies(int startSpace)
-    {
-        int objectSize = cylinderBase_.size();
-        int targetSpace = verticies_.size()-objectSize;
-        for (int i = 0; i < objectSize; ++i)
-        {
-            /*
-                (ti)------(ti+1)
-                  |  \      |
-                  |    \    |
-                  |      \  |
-                  |        \|
-                 (si)=-----(si+1)
-            */
+    bool randomize_;
+    unsigned int seed_;
+    unsigned int rotations_;
+
+    float params_[2];
+    int paramCount_;
+
+    int vertexCount_;//vertices the turtle has drawn, built or not
+    LSystemGeometryBatch* batch_;
+
+    std::vector<SplitChunk> split_;
+    octet::dynarray<SplitTurtle> splitStack_;
+
+    bool instancing_;
+    int minInstanceSections_;
+    bool recording_;//this visualize is being recorded for instancing
+    bool instanced_;//the finished mesh has instances
+    octet::dynarray<int> record_;//LSystemOpcodes opcodes
+    octet::dynarray<int> instanceEnd_;//for a push the pop of its branch when that is instanced, else -1
+    octet::dynarray<int> instanceOf_;
+    octet::dynarray<BranchFrame> frames_;
+    octet::dynarray<SplitTurtle> branchStack_;
+    octet::dynarray<int> signature_;//of the open branches, each after its parent's start
+    octet::dynarray<int> signatures_;//of each prototype, one after another
+    octet::dynarray<int> signatureStart_;//where each prototype's signature starts, with the end after the last
+    std::unordered_map<unsigned long long, int> prototypeIds_;//the last prototype with a signature's hash
+    octet::dynarray<int> prototypeNext_;//the one before it with the same hash, -1 for none
+    octet::dynarray<LSystemInstancedMesh::Instance> rootInstances_;
+    octet::dynarray<myVertex> prototypeVertices_;
+    octet::dynarray<unsigned int> prototypeIndices_;
+    octet::dynarray<LSystemInstancedMesh::Instance> prototypeInstances_;
+    octet::dynarray<LSystemInstancedMesh::Prototype> prototypes_;
+
+    octet::dynarray<Turtle> turtles_;
 
-            indicies_.push_back(i+startSpace);
+    octet::ref<octet::mesh> meshy_;
+};
 
-            indicies_.push_back(((i+1)%objectSize)+startSpace);
 
-            indicies_.push_back(i + targetSpace);
 
-            indicies_.push_back(i + targetSpace);
 
-            indicies_.push_back(((i + 1) % objectSize) + startSpace);
 
-            indicies_.push_back(((i + 1) % objectSize) + targetSpace);
 
+//headless timing of the engine, run with -bench so it needs no window or GL context
+class LSystemBenchmark
+{
+public:
+    //derives the grammar to the given level with each rewrite mode and prints the throughput of the last level
+    static void IterateThroughput(const char* filename, int levels)
+    {
+        const char* names[] = { "serial", "two pass", "parallel" };
+        LSystem::REWRITE_MODE modes[] = { LSystem::REWRITE_SERIAL, LSystem::REWRITE_TWO_PASS, LSystem::REWRITE_PARALLEL };
+        for (int m = 0; m < 3; ++m)
+        {
+            LSystem lSys;
+            LSystemImporter importer;
+            if (!importer.Load(&lSys, filename))return;
+            lSys.SetRewriteMode(modes[m]);
+            lSys.SetThreadPool(&Pool());
+            lSys.Iterate(levels);
+            const LSystem::IterateStats& stats = lSys.GetIterateStats();
+            printf("%s level %d %s: %d symbols in %.2fms, %.1f Msymbols/sec\n", filename, levels, names[m],
+                stats.symbolsWritten, stats.seconds * 1000, stats.SymbolsPerSecond() / 1000000);
         }
-        return targetSpace;
     }
-    struct myVertex
+
+    static LSystemThreadPool& Pool()
     {
-        myVertex(octet::vec3 v)
+        static LSystemThreadPool pool;
+        return pool;
+    }
+
+    //counts the vertices a line mesh would have without building one
+    class LineCounter final : public LSystemVisualizer
+    {
+    public:
+        LineCounter() :vertices_(0), finished_(false){}
+
+        void Init(LSystemDrawInfo* info)override{}
+        void DrawLine()override{ vertices_ += 2; }
+        void RotatePositive()override{}
+        void RotateNegative()override{}
+        void PushStack()override{}
+        void PopStack()override{}
+        void SetState(LSystemState* state)override
         {
-            pos = v; normal = v;
+            vertices_ = 0;
+            finished_ = false;
         }
-        myVertex(){}
-        octet::vec3 pos;
-        octet::vec3 normal;
-        octet::vec2 uv;
+        void Finished()override{ finished_ = true; }
+        int GetVertexCount() const override{ return vertices_; }
+
+        int vertices_;
+        bool finished_;
     };
 
-    octet::dynarray<myVertex> verticies_;
-    octet::dynarray<unsigned int> indicies_;
-    octet::dynarray<int> startPos_;
+    //streams the level into cylinders one stage after another and then through the pipeline,
+    //printing how busy each stage was, both must give the same number of vertices
+    static void PipelineThroughput(const char* filename, int level)
+    {
+        LSystem lSys;
+        LSystemImporter importer;
+        if (!importer.Load(&lSys, filename))return;
+        DrawHelper3D serial(5);
+        DrawHelper3D pipelined(5);
+        auto start = std::chrono::high_resolution_clock::now();
+        lSys.Visualize(&serial, level);
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        lSys.VisualizePipelined(&pipelined, level);
+        const LSystem::PipelineStats& stats = lSys.GetPipelineStats();
+        printf("%s level %d pipelined: %llu symbols in %.2fms against %.2fms (%.2fx)%s\n", filename, level,
+            stats.symbols, stats.seconds * 1000, seconds * 1000, stats.seconds > 0 ? seconds / stats.seconds : 0,
+            serial.GetVertexCount() == pipelined.GetVertexCount() ? "" : " VERTICES DIFFER");
+        const char* names[] = { "derive", "interpret", "mesh" };
+        for (int i = 0; i < LSystem::PIPELINE_STAGES; ++i)
+        {
+            printf("    %s %.1f Msymbols/sec, busy %.2fms starved %.2fms blocked %.2fms\n", names[i], stats.StageRate(i) / 1000000,
+                stats.busy[i] * 1000, stats.starved[i] * 1000, stats.blocked[i] * 1000);
+        }
+    }
 
+    //best of a few runs of visualizing the current level of lSys with viz
+    template<class Visualizer>
+    static double TimeVisualize(LSystem& lSys, Visualizer* viz)
+    {
+        double best = 0;
+        for (int run = 0; run < 3; ++run)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            lSys.Visualize(viz);
+            double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            if (run == 0 || seconds < best)best = seconds;
+        }
+        return best;
+    }
 
-    octet::dynarray<myVertex> cylinderBase_;
+    //visualizes a stored level through the virtual interface and then by the visualizer's own type,
+    //with a visualizer that only counts and with the cylinder mesh builder
+    static void DispatchThroughput(const char* filename, int level)
+    {
+        LSystem lSys;
+        LSystemImporter importer;
+        if (!importer.Load(&lSys, filename))return;
+        lSys.Iterate(level);
+        double symbols = (double)lSys.GetCurrentState()->GetSymbolCount();
+
+        LineCounter counter;
+        double virtualSeconds = TimeVisualize(lSys, (LSystemVisualizer*)&counter);
+        int virtualVertices = counter.GetVertexCount();
+        double directSeconds = TimeVisualize(lSys, &counter);
+        printf("%s level %d counting: virtual %.1f Msymbols/sec, direct %.1f Msymbols/sec (%.2fx)%s\n", filename, level,
+            symbols / virtualSeconds / 1000000, symbols / directSeconds / 1000000, virtualSeconds / directSeconds,
+            virtualVertices == counter.GetVertexCount() ? "" : " VERTICES DIFFER");
+
+        DrawHelper3D mesh(5);
+        virtualSeconds = TimeVisualize(lSys, (LSystemVisualizer*)&mesh);
+        virtualVertices = mesh.GetVertexCount();
+        directSeconds = TimeVisualize(lSys, &mesh);
+        printf("%s level %d cylinders: virtual %.1f Msymbols/sec, direct %.1f Msymbols/sec (%.2fx)%s\n", filename, level,
+            symbols / virtualSeconds / 1000000, symbols / directSeconds / 1000000, virtualSeconds / directSeconds,
+            virtualVertices == mesh.GetVertexCount() ? "" : " VERTICES DIFFER");
+    }
 
-    float sectionLength_;
-    float thickness_;
+    //lowers a stored level to opcodes and visualizes it into cylinders symbol by symbol and through
+    //the opcodes, printing how many turtle calls the opcodes stand in for and the time each way takes
+    static void LoweringThroughput(const char* filename, int level)
+    {
+        LSystem lSys;
+        LSystemImporter importer;
+        if (!importer.Load(&lSys, filename))return;
+        lSys.Iterate(level);
+        double symbols = (double)lSys.GetCurrentState()->GetSymbolCount();
+        LSystemOpcodes ops;
+        auto start = std::chrono::high_resolution_clock::now();
+        lSys.Visualize(&ops);
+        double lowerSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+        DrawHelper3D mesh(5);
+        double plainSeconds = TimeVisualize(lSys, &mesh);
+        int plainVertices = mesh.GetVertexCount();
+        lSys.SetTurtleLowering(true);
+        double loweredSeconds = TimeVisualize(lSys, &mesh);
+        printf("%s level %d lowered: %.0f symbols to %d opcodes (%.1fx fewer turtle calls) in %.2fms, "
+            "cylinders %.2fms against %.2fms (%.2fx), %d vertices against %d\n", filename, level,
+            symbols, ops.GetOpCount(), (double)ops.GetTurtleSymbols() / (ops.GetOpCount() ? ops.GetOpCount() : 1), lowerSeconds * 1000,
+            loweredSeconds * 1000, plainSeconds * 1000, plainSeconds / loweredSeconds, mesh.GetVertexCount(), plainVertices);
+    }
 
-    float thicknessReduction_;
+    //visualizes a stored level into cylinders with one turtle and with the turtle split over the pool,
+    //checking both draw the same number of vertices
+    static void TurtleParallelThroughput(const char* filename, int level)
+    {
+        LSystem lSys;
+        LSystemImporter importer;
+        if (!importer.Load(&lSys, filename))return;
+        lSys.SetThreadPool(&Pool());
+        lSys.Iterate(level);
+        double symbols = (double)lSys.GetCurrentState()->GetSymbolCount();
+        DrawHelper3D mesh(5);
+        double sequentialSeconds = TimeVisualize(lSys, &mesh);
+        int sequentialVertices = mesh.GetVertexCount();
+        double parallelSeconds = 0;
+        for (int run = 0; run < 3; ++run)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            lSys.VisualizeParallel(&mesh);
+            double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+            if (run == 0 || seconds < parallelSeconds)parallelSeconds = seconds;
+        }
+        printf("%s level %d turtle: one thread %.1f Msymbols/sec, split %.1f Msymbols/sec (%.2fx)%s\n", filename, level,
+            symbols / sequentialSeconds / 1000000, symbols / parallelSeconds / 1000000, sequentialSeconds / parallelSeconds,
+            sequentialVertices == mesh.GetVertexCount() ? "" : " VERTICES DIFFER");
+    }
 
-    octet::vec3 minRot_;
-    octet::vec3 maxRot_;
-    octet::vec3 dir_;
+    //whether two cylinder meshes draw the same triangles, the vertices to within the rounding of placing
+    //an instance by its quaternion rather than by the turtle that drew it
+    static bool SameMesh(const LSystemMeshData& a, const LSystemMeshData& b)
+    {
+        if (a.vertices.size() != b.vertices.size() || a.indices.size() != b.indices.size())return false;
+        if (memcmp(a.indices.data(), b.indices.data(), a.indices.size()))return false;
+        //eight floats a vertex, the position then the normal then the uv, as AllocateMesh declares them
+        const float* x = (const float*)a.vertices.data();
+        const float* y = (const float*)b.vertices.data();
+        size_t floats = a.vertices.size() / sizeof(float);
+        float scale = 1;
+        for (size_t i = 0; i < floats; i += 8)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                if (fabsf(x[i + j]) > scale)scale = fabsf(x[i + j]);
+            }
+        }
+        for (size_t i = 0; i < floats; i += 8)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                if (fabsf(x[i + j] - y[i + j]) > scale * 2e-4f || fabsf(x[i + 3 + j] - y[i + 3 + j]) > scale * 2e-4f)return false;
+            }
+        }
+        return true;
+    }
 
-    bool randomize_;
+    //visualizes an unrandomized stored level into cylinders directly and with its repeated branches instanced,
+    //printing the prototypes and instances, the bytes each way and the time to flatten the instances,
+    //which stitch back to the direct mesh
+    static void InstancingThroughput(const char* filename, int level)
+    {
+        LSystem lSys;
+        LSystemImporter importer;
+        if (!importer.Load(&lSys, filename))return;
+        if (!lSys.GetDrawInfo())lSys.SetDrawInfo(new LSystemDrawInfo());
+        lSys.GetDrawInfo()->randomize = false;
+        lSys.Iterate(level);
+        DrawHelper3D mesh(5);
+        double directSeconds = TimeVisualize(lSys, &mesh);
+        LSystemMeshData direct;
+        mesh.Take(direct);
+        mesh.SetInstancing(true);
+        double instancedSeconds = TimeVisualize(lSys, &mesh);
+        LSystemInstancedMesh instanced;
+        mesh.TakeInstanced(instanced);
+        LSystemMeshData flat;
+        auto start = std::chrono::high_resolution_clock::now();
+        DrawHelper3D::Flatten(instanced, flat);
+        double flattenSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        bool same = SameMesh(direct, flat);
+        printf("%s level %d instanced: %d prototypes, %d instances, %.2fMB against %.2fMB (%.1fx), built in %.2fms against %.2fms, "
+            "flattened in %.2fms%s\n", filename, level, (int)instanced.prototypes.size(), (int)(instanced.instances.size() + instanced.prototypeInstances.size()),
+            instanced.GetByteSize() / 1048576.0, direct.GetByteSize() / 1048576.0, (double)direct.GetByteSize() / instanced.GetByteSize(),
+            instancedSeconds * 1000, directSeconds * 1000, flattenSeconds * 1000, same ? "" : " OUTPUT DIFFERS");
+    }
 
-    octet::dynarray<octet::mat4t> matrixStack_;
+    //starts a deep level on a generator and replaces it with a shallow one once it is visualizing,
+    //timing how long the deep one takes to give up and the shallow one to be ready
+    static void GeneratorCancel(const char* filename, int deep, int shallow)
+    {
+        LSystem deepSys;
+        LSystem shallowSys;
+        LSystemImporter importer;
+        if (!importer.Load(&deepSys, filename) || !importer.Load(&shallowSys, filename))return;
+        LSystemGenerator generator;
+        deepSys.SetProgress(generator.GetProgress());
+        shallowSys.SetProgress(generator.GetProgress());
+        LineCounter deepViz;
+        LineCounter shallowViz;
+        generator.Start([&]()
+        {
+            deepSys.Iterate(deep);
+            deepSys.Visualize(&deepViz);
+        });
+        while (generator.IsBusy() && generator.GetProgress()->vertices == 0)
+        {
+            std::this_thread::yield();
+        }
+        unsigned long long symbols = generator.GetProgress()->symbols;
+        auto start = std::chrono::high_resolution_clock::now();
+        generator.Start([&]()
+        {
+            shallowSys.Iterate(shallow);
+            shallowSys.Visualize(&shallowViz);
+        });
+        generator.Wait();
+        bool ready = generator.Poll();
+        double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        printf("%s level %d cancelled after %llu symbols, level %d with %d vertices ready %.2fms later%s\n", filename, deep,
+            symbols, shallow, shallowViz.vertices_, seconds * 1000,
+            deepViz.finished_ ? " DEEP LEVEL FINISHED" : ready && shallowViz.finished_ ? "" : " SHALLOW LEVEL NOT READY");
+    }
 
-    octet::ref<octet::mesh> meshy_;
-};
+    //two pass throughput with each instruction set the CPU supports
+    static void SimdThroughput(const char* filename, int levels)
+    {
+        const char* names[] = { "scalar", "ssse3", "avx2" };
+        for (int simd = LSYSTEM_SIMD_NONE; simd <= LSystemDetectSimd(); ++simd)
+        {
+            LSystem lSys;
+            LSystemImporter importer;
+            if (!importer.Load(&lSys, filename))return;
+            lSys.SetSimd((LSYSTEM_SIMD)simd);
+            lSys.Iterate(levels);
+            const LSystem::IterateStats& stats = lSys.GetIterateStats();
+            printf("%s level %d two pass %s: %.1f Msymbols/sec\n", filename, levels, names[simd],
+                stats.SymbolsPerSecond() / 1000000);
+        }
+    }
+
+    //two pass throughput of a grammar with F=FF against the same grammar with the multi symbol
+    //rules FF=FFFF and F]=FF] added, both rewrite runs exactly as F=FF would so the levels must match
+    static void StringRuleThroughput(const char* filename, int levels)
+    {
+        LSystem single;
+        LSystem multi;
+        LSystem parallel;
+        LSystemImporter importer;
+        if (!importer.Load(&single, filename) || !importer.Load(&multi, filename) || !importer.Load(&parallel, filename))return;
+        multi.AddStringRule("FF", 2, "FFFF", 4);
+        multi.AddStringRule("F]", 2, "FF]", 3);
+        parallel.AddStringRule("FF", 2, "FFFF", 4);
+        parallel.AddStringRule("F]", 2, "FF]", 3);
+        parallel.SetRewriteMode(LSystem::REWRITE_PARALLEL);
+        parallel.SetThreadPool(&Pool());
+        single.Iterate(levels);
+        multi.Iterate(levels);
+        parallel.Iterate(levels);
+        double singleRate = single.GetIterateStats().SymbolsPerSecond();
+        double multiRate = multi.GetIterateStats().SymbolsPerSecond();
+        double parallelRate = parallel.GetIterateStats().SymbolsPerSecond();
+        const octet::dynarray<char>& a = single.GetCurrentState()->state_;
+        const octet::dynarray<char>& b = multi.GetCurrentState()->state_;
+        const octet::dynarray<char>& c = parallel.GetCurrentState()->state_;
+        bool same = a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0 &&
+            b.size() == c.size() && memcmp(b.data(), c.data(), b.size()) == 0;
+        printf("%s level %d single symbol rules %.1f, multi symbol rules %.1f (%.2fx slower), on %d threads %.1f Msymbols/sec%s\n",
+            filename, levels, singleRate / 1000000, multiRate / 1000000, multiRate > 0 ? singleRate / multiRate : 0,
+            Pool().GetThreadCount(), parallelRate / 1000000, same ? "" : " OUTPUT DIFFERS");
+    }
+
+    //swaps + and - in c's rule once the grammar is derived to the given level, timing the splice
+    //against deriving the edited grammar from the axiom, the two levels must match
+    static void RederiveSpeedup(const char* filename, int levels, char c)
+    {
+        LSystem edited;
+        LSystem rebuilt;
+        LSystemImporter importer;
+        if (!importer.Load(&edited, filename) || !importer.Load(&rebuilt, filename))return;
+        int length;
+        const char* production = edited.GetRule(c, length);
+        octet::dynarray<char> swapped;
+        swapped.resize(length);
+        for (int i = 0; i < length; ++i)
+        {
+            swapped[i] = production[i] == '+' ? '-' : production[i] == '-' ? '+' : production[i];
+        }
+        octet::string rule(swapped.data(), swapped.size());
+        edited.Iterate(levels);
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        edited.AddBasicRules(c, rule);
+        edited.UpdateLevels();
+        std::chrono::duration<double> splice = std::chrono::high_resolution_clock::now() - start;
+        start = std::chrono::high_resolution_clock::now();
+        rebuilt.AddBasicRules(c, rule);
+        rebuilt.Iterate(levels);
+        std::chrono::duration<double> full = std::chrono::high_resolution_clock::now() - start;
+
+        const octet::dynarray<char>& a = edited.GetCurrentState()->state_;
+        const octet::dynarray<char>& b = rebuilt.GetCurrentState()->state_;
+        bool same = a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+        printf("%s level %d edit %c: %d symbols, spliced %.2fms, rebuilt %.2fms (%.1fx)%s\n", filename, levels, c, a.size(),
+            splice.count() * 1000, full.count() * 1000, splice.count() > 0 ? full.count() / splice.count() : 0, same ? "" : " OUTPUT DIFFERS");
+    }
 
+    //Tree6 grown from a trunk symbol T that only the axiom holds, so an edit to T touches a few
+    //hundred symbols of each level and the rest is spliced through
+    static void RederiveTrunk(int levels)
+    {
+        octet::string x("F-[[X]+X]+F[+FX]-X");
+        octet::string f("FF");
+        octet::string trunk("F[+F]F");
+        octet::string edit("F[-F]F");
+        LSystem edited;
+        LSystem rebuilt;
+        edited.SetAxiom("TX", 2);
+        rebuilt.SetAxiom("TX", 2);
+        edited.AddBasicRules('X', x);
+        edited.AddBasicRules('F', f);
+        edited.AddBasicRules('T', trunk);
+        rebuilt.AddBasicRules('X', x);
+        rebuilt.AddBasicRules('F', f);
+        rebuilt.AddBasicRules('T', edit);
+        edited.Iterate(levels);
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        edited.AddBasicRules('T', edit);
+        edited.UpdateLevels();
+        std::chrono::duration<double> splice = std::chrono::high_resolution_clock::now() - start;
+        start = std::chrono::high_resolution_clock::now();
+        rebuilt.Iterate(levels);
+        std::chrono::duration<double> full = std::chrono::high_resolution_clock::now() - start;
+
+        const octet::dynarray<char>& a = edited.GetCurrentState()->state_;
+        const octet::dynarray<char>& b = rebuilt.GetCurrentState()->state_;
+        bool same = a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+        printf("trunk level %d edit T: %d symbols, spliced %.2fms, rebuilt %.2fms (%.1fx)%s\n", levels, a.size(),
+            splice.count() * 1000, full.count() * 1000, splice.count() > 0 ? full.count() / splice.count() : 0, same ? "" : " OUTPUT DIFFERS");
+    }
 
+    //random grammars over A, B, F and C derived a few levels, then three of their rules edited,
+    //brought up to date after each edit or all at once, must match the edited grammar derived
+    //from the axiom, and again after a further level and two steps back
+    static void RederiveEquivalence(int grammars)
+    {
+        const char symbols[] = "ABFC";
+        const char alphabet[] = "ABFC+-[]";
+        unsigned int draws = 0;
+        auto draw = [&](unsigned int n) -> unsigned int
+        {
+            unsigned int random[2];
+            LSystemPhilox(0x5eed, 0, draws++, random);
+            return random[0] % n;
+        };
+        auto production = [&](octet::dynarray<char>& rule)
+        {
+            rule.resize(draw(7));
+            for (int i = 0; i < rule.size(); ++i)
+            {
+                rule[i] = alphabet[draw(8)];
+            }
+        };
+        auto same = [](LSystem& a, LSystem& b) -> bool
+        {
+            const octet::dynarray<char>& x = a.GetCurrentState()->state_;
+            const octet::dynarray<char>& y = b.GetCurrentState()->state_;
+            return x.size() == y.size() && memcmp(x.data(), y.data(), x.size()) == 0;
+        };
+        int runs = 0;
+        int mismatches = 0;
+        for (int g = 0; g < grammars; ++g)
+        {
+            octet::dynarray<char> rules[4];
+            for (int k = 0; k < 4; ++k)
+            {
+                if (draw(4))production(rules[k]);
+            }
+            int levels = 2 + draw(7);
+            int mode = draw(3);
+            bool eager = draw(2) != 0;
+            LSystem edited;
+            edited.SetThreadPool(&Pool());
+            edited.SetRewriteMode(mode == 0 ? LSystem::REWRITE_SERIAL : mode == 1 ? LSystem::REWRITE_TWO_PASS : LSystem::REWRITE_PARALLEL);
+            edited.SetAxiom("AB", 2);
+            for (int k = 0; k < 4; ++k)
+            {
+                octet::string rule(rules[k].data(), rules[k].size());
+                if (rules[k].size())edited.AddBasicRules(symbols[k], rule);
+            }
+            edited.Iterate(levels);
+            if (edited.GetCurrentState()->state_.size() > 3000000)continue;
+            for (int e = 0; e < 3; ++e)
+            {
+                int k = draw(4);
+                unsigned int kind = draw(10);
+                if (kind < 2)rules[k].resize(0);
+                else if (kind < 6)production(rules[k]);
+                else rules[k].push_back('+');
+                if (rules[k].size() && draw(3) == 0)rules[k][draw(rules[k].size())] = alphabet[draw(6)];
+                octet::string rule(rules[k].data(), rules[k].size());
+                edited.AddBasicRules(symbols[k], rule);
+                if (eager)edited.UpdateLevels();
+            }
+            LSystem rebuilt;
+            rebuilt.SetAxiom("AB", 2);
+            for (int k = 0; k < 4; ++k)
+            {
+                octet::string rule(rules[k].data(), rules[k].size());
+                if (rules[k].size())rebuilt.AddBasicRules(symbols[k], rule);
+            }
+            rebuilt.Iterate(levels);
+            ++runs;
+            if (!same(edited, rebuilt))++mismatches;
+            edited.Iterate(1);
+            rebuilt.Iterate(1);
+            edited.Decrement(2);
+            rebuilt.Decrement(2);
+            if (!same(edited, rebuilt))++mismatches;
+        }
+        printf("rederive equivalence: runs %d mismatches %d\n", runs, mismatches);
+    }
 
+    static void Run()
+    {
+        printf("%d threads\n", Pool().GetThreadCount());
+        const char* files[] = { "Tree1.txt", "Tree2.txt", "Tree3.txt", "Tree4.txt", "Tree5.txt", "Tree6.txt" };
+        for (int i = 0; i < 6; ++i)
+        {
+            IterateThroughput(files[i], 7);
+            SimdThroughput(files[i], 7);
+        }
+        for (int i = 3; i < 6; ++i)
+        {
+            StringRuleThroughput(files[i], 9);
+        }
+        for (int i = 0; i < 6; ++i)
+        {
+            RederiveSpeedup(files[i], i < 3 ? 7 : 9, i < 3 ? 'F' : 'X');
+        }
+        RederiveTrunk(10);
+        RederiveEquivalence(3000);
+        GeneratorCancel("Tree3.txt", 8, 5);
+        for (int i = 0; i < 6; ++i)
+        {
+            PipelineThroughput(files[i], i < 3 ? 6 : 9);
+        }
+        for (int i = 0; i < 6; ++i)
+        {
+            DispatchThroughput(files[i], i < 3 ? 6 : 9);
+        }
+        for (int i = 0; i < 6; ++i)
+        {
+            LoweringThroughput(files[i], i < 3 ? 6 : 9);
+        }
+        for (int i = 0; i < 6; ++i)
+        {
+            TurtleParallelThroughput(files[i], i < 3 ? 7 : 10);
+        }
+        for (int i = 0; i < 6; ++i)
+        {
+            InstancingThroughput(files[i], i < 3 ? 6 : 9);
+        }
+    }
+};
 
 
 
@@ -1121,10 +8441,11 @@ namespace octet {
 
 
         LSystemImporter import_;
+        LSystemThreadPool pool_;
         dynarray<LSystem> lSys_;
         DrawHelper2D draw2D_;
         DrawHelper3D draw3D_;
-        const LSystemState* s_;
+        dynarray<LSystemDrawInfo> infos_;//draw settings of each preset, only the main thread touches these
         LSystemDrawInfo drawInfo_;
 
 
@@ -1142,11 +8463,46 @@ namespace octet {
         bool lmbPressed_;
         
         bool is3D_;
+        bool stream_;
+        bool pipelined_;
+        bool lowered_;
+        bool parallelTurtle_;
+        bool instancing_;
+        bool packed_;
+        bool grammar_;
+        unsigned int seed_;
         static bool regenerate_;
         static bool reload_;
+
+        //key of the mesh of the last job started and of the mesh on screen, every finished mesh
+        //goes through the cache so a setting seen recently is shown without building it again
+        unsigned long long jobKey_;
+        bool jobPrefetch_;
+        bool jobMeshes_;
+        unsigned long long shownKey_;
+        unsigned int appliedSeed_;//the seed as of the last Generate
+        dynarray<int> levels_;//level each preset was left at by the last job that finished it
+        //while the generator is idle the neighbouring levels and presets are built ahead
+        bool prefetch_;
+        bool prefetchMeshes_;
+        int cacheBudget_;//megabytes
+        int diskBudget_;//megabytes
+        //copies of the generator's progress for the tweak bar
+        double progressSymbols_;
+        int progressVertices_;
+        double cachedMegabytes_;
+        bool generating_;
+        bool prefetching_;
+        LSystemMeshCache cache_;
+        //levels and meshes kept between runs
+        LSystemDiskCache disk_;
+        //declared last so its thread stops before the systems, visualizers and caches it uses are destroyed
+        LSystemGenerator generator_;
     public:
         /// this is called when we construct the class before everything is initialised.
-        LSystems(int argc, char **argv) : app(argc, argv), draw3D_(5), is3D_(true),fileChoice_(0),oldFile_(0),numIterations_(6) {
+        LSystems(int argc, char **argv) : app(argc, argv), draw3D_(5), is3D_(true), stream_(false), pipelined_(false), lowered_(true), parallelTurtle_(false), instancing_(false), packed_(false), grammar_(false), seed_(0), fileChoice_(0),oldFile_(0),numIterations_(6),
+            jobKey_(0), jobPrefetch_(false), jobMeshes_(false), shownKey_(0), appliedSeed_(0), prefetch_(true), prefetchMeshes_(true), cacheBudget_(256), diskBudget_(1024),
+            progressSymbols_(0), progressVertices_(0), cachedMegabytes_(0), generating_(false), prefetching_(false), cache_(256 << 20) {
             lmbPressed_ = false;
             speed_ = 4;
         }
@@ -1161,6 +8517,185 @@ namespace octet {
         {
             reload_ = true;
         }
+
+        //everything that changes the mesh of a preset at a level
+        unsigned long long MeshKey(int preset, int level, bool is3D)
+        {
+            const LSystemDrawInfo& info = infos_[preset];
+            float fields[] = { info.sectionLength, info.sectionLengthReduction, info.sectionWidth, info.sectionWidthReduction,
+                info.minXRot, info.minYRot, info.minZRot, info.maxXRot, info.maxYRot, info.maxZRot };
+            int values[] = { preset, level, is3D, info.randomize, (int)appliedSeed_, lowered_, parallelTurtle_, instancing_ };
+            unsigned long long hash = 14695981039346656037ull;
+            const unsigned char* bytes = (const unsigned char*)fields;
+            for (int i = 0; i < sizeof(fields); ++i)
+            {
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+            }
+            bytes = (const unsigned char*)values;
+            for (int i = 0; i < sizeof(values); ++i)
+            {
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+            }
+            return hash;
+        }
+
+        //the name of a mesh in the disk cache, from what the system derives and draws as it is set up now;
+        //0 when its levels can't be named by the grammar
+        static unsigned long long DiskKey(LSystem* system, int level, bool is3D, bool instancing)
+        {
+            unsigned long long hash = system->GetGrammarHash();
+            if (!hash)return 0;
+            int values[] = { level, is3D, system->GetTurtleLowering(), instancing };
+            return LSystemHash(hash, values, sizeof(values));
+        }
+
+        //moves the system to level, reading it from the disk cache rather than deriving it when it is
+        //above every level derived so far, and storing it there when it has to be derived
+        static void SeekCached(LSystem* system, LSystemDiskCache* disk, int level)
+        {
+            if (system->GetCurrentState()->level >= level)
+            {
+                system->SeekLevel(level);
+                return;
+            }
+            if (disk->LoadLevel(system, level))return;
+            system->SeekLevel(level);
+            if (!system->GetProgress() || !system->GetProgress()->cancel)disk->StoreLevel(system);
+        }
+
+        //the 3D helper's branches stay instances until the mesh is uploaded
+        static void TakeMesh(DrawHelper3D* viz, LSystemInstancedMesh& data)
+        {
+            viz->TakeInstanced(data);
+        }
+        static void TakeMesh(DrawHelper2D* viz, LSystemInstancedMesh& data)
+        {
+            viz->Take(data.root);
+        }
+
+        //visualizes level into data on the generator's thread, templated so the helper's handlers
+        //are called directly; false when the job was cancelled
+        template<class Visualizer>
+        static bool BuildMesh(LSystem* system, Visualizer* viz, LSystemDiskCache* disk, int level, bool pipelined, bool stream, bool parallel,
+            LSystemInstancedMesh& data)
+        {
+            if (pipelined)
+            {
+                system->VisualizePipelined(viz, level);
+            }
+            else if (stream)
+            {
+                system->Visualize(viz, level);
+            }
+            else
+            {
+                SeekCached(system, disk, level);
+                parallel ? system->VisualizeParallel(viz) : system->Visualize(viz);
+            }
+            if (system->GetProgress()->cancel)return false;
+            TakeMesh(viz, data);
+            return true;
+        }
+
+        //builds the preset at level on the generator and puts the mesh in the cache,
+        //a prefetch without meshes only derives the level so it is ready in lSys_
+        void StartJob(int preset, int level, bool prefetch)
+        {
+            jobKey_ = MeshKey(preset, level, is3D_);
+            jobPrefetch_ = prefetch;
+            jobMeshes_ = !prefetch || prefetchMeshes_;
+
+            //everything the job needs is copied now, the tweak bar keeps editing the members
+            LSystem* system = &lSys_[preset];
+            DrawHelper2D* draw2D = &draw2D_;
+            DrawHelper3D* draw3D = &draw3D_;
+            LSystemMeshCache* cache = &cache_;
+            LSystemDiskCache* disk = &disk_;
+            LSystemDrawInfo info = infos_[preset];
+            //levels_ is sized once in app_init and only read while the generator is idle, whose lock
+            //makes what the job wrote visible; a cancelled job leaves it as the last finished one set it
+            int* reached = &levels_[preset];
+            unsigned long long key = jobKey_;
+            bool meshes = jobMeshes_;
+            bool is3D = is3D_;
+            bool packed = packed_;
+            bool grammar = grammar_;
+            bool stream = stream_;
+            bool pipelined = pipelined_;
+            //the parallel turtle never merges runs, so a system set to it isn't lowered either and its
+            //meshes are named on disk as unmerged ones
+            bool parallel = parallelTurtle_;
+            bool lowered = lowered_ && !parallel;
+            bool instancing = instancing_;
+            unsigned int seed = appliedSeed_;
+            generator_.Start([=]()
+            {
+                *system->GetDrawInfo() = info;
+                system->SetPackedStorage(packed);
+                system->SetGrammarStorage(grammar);
+                system->SetSeed(seed);
+                system->SetTurtleLowering(lowered);
+                if (!meshes)
+                {
+                    SeekCached(system, disk, level);
+                    if (!system->GetProgress()->cancel)*reached = system->GetCurrentState()->level;
+                    return;
+                }
+                LSystemInstancedMesh data;
+                unsigned long long diskKey = DiskKey(system, level, is3D, instancing);
+                if (disk->LoadMesh(diskKey, data))
+                {
+                    cache->Insert(key, data);
+                    return;
+                }
+                draw3D->SetSeed(seed);
+                draw3D->SetInstancing(instancing);
+                bool built = is3D ? BuildMesh(system, draw3D, disk, level, pipelined, stream, parallel, data) :
+                    BuildMesh(system, draw2D, disk, level, pipelined, stream, parallel, data);
+                if (!built)return;
+                *reached = system->GetCurrentState()->level;
+                disk->StoreMesh(diskKey, data);
+                cache->Insert(key, data);
+            });
+        }
+
+        //starts the first of the level above and below and the same level of the presets either side
+        //that isn't ready yet, leaving out levels likely to take over half the cache budget by the
+        //bytes per symbol of the mesh on screen; only called while the generator is idle, so lSys_ is free to look at
+        void Prefetch()
+        {
+            size_t shownBytes = 0;
+            cache_.Use(shownKey_, [&](const LSystemInstancedMesh& data)
+            {
+                shownBytes = data.GetByteSize();
+            });
+            unsigned long long shownLength = 0;
+            lSys_[fileChoice_].GetLevelLength(numIterations_, shownLength);
+            double bytesPerSymbol = prefetchMeshes_ && shownLength ? (double)shownBytes / shownLength + 1 : 1;
+            double budget = (double)((size_t)cacheBudget_ << 20);
+
+            int candidates[4][2] =
+            {
+                { fileChoice_, numIterations_ + 1 },
+                { fileChoice_, numIterations_ - 1 },
+                { fileChoice_ + 1, numIterations_ },
+                { fileChoice_ - 1, numIterations_ },
+            };
+            for (int i = 0; i < 4; ++i)
+            {
+                int preset = candidates[i][0];
+                int level = candidates[i][1];
+                if (preset < 0 || preset >= lSys_.size() || level < 0)continue;
+                if (prefetchMeshes_ ? cache_.Contains(MeshKey(preset, level, is3D_)) :
+                    //lower levels stay in the history, so only deriving upwards saves anything
+                    levels_[preset] >= level)continue;
+                //levels whose length only the derivation knows are left to be asked for
+                unsigned long long length;
+                if (!lSys_[preset].GetLevelLength(level, length) || length * bytesPerSymbol > budget / 2)continue;
+                StartJob(preset, level, true);
+                return;
+            }
+        }
         /// this is called once OpenGL is initialized
         void app_init() {
             app_scene = new visual_scene();
@@ -1188,6 +8723,16 @@ namespace octet {
 
             TwAddVarRW(bar_, "3D", TW_TYPE_BOOLCPP, &is3D_, "Help='Switches between 2D and 3D drawing'");
 
+            TwAddVarRW(bar_, "Stream derivation", TW_TYPE_BOOLCPP, &stream_, "Help='Draws the level straight from the axiom without storing it, for levels too large to keep in memory'");
+
+            TwAddVarRW(bar_, "Pipelined", TW_TYPE_BOOLCPP, &pipelined_, "Help='Derives, interprets and builds the mesh on separate threads, chunk by chunk, without storing the level'");
+            TwAddVarRW(bar_, "Merge turtle runs", TW_TYPE_BOOLCPP, &lowered_, "Help='Draws runs of sections as one and turns runs of rotations at once, fewer vertices for the same tree'");
+            TwAddVarRW(bar_, "Instance branches", TW_TYPE_BOOLCPP, &instancing_, "Help='Builds each repeated branch once and keeps it as instances, expanded only when uploaded, unrandomized 3D trees only'");
+            TwAddVarRW(bar_, "Parallel turtle", TW_TYPE_BOOLCPP, &parallelTurtle_, "Help='Splits the stored level into chunks and runs the 3D turtle on every thread, runs are not merged while this is on'");
+
+            TwAddVarRW(bar_, "Packed storage", TW_TYPE_BOOLCPP, &packed_, "Help='Stores new levels at 2 or 4 bits per symbol'");
+            TwAddVarRW(bar_, "Grammar storage", TW_TYPE_BOOLCPP, &grammar_, "Help='Stores new levels as references to the productions'");
+
             TwAddSeparator(bar_, "Rotation", "");
 
             TwAddVarRW(bar_, "Min X rotation", TW_TYPE_FLOAT, &drawInfo_.minXRot,
@@ -1212,10 +8757,33 @@ namespace octet {
             TwAddVarRW(bar_, "Randomize Drawing", TW_TYPE_BOOLCPP, &drawInfo_.randomize,
                 "Help='Enables or disables the randomization of angles, without the minimum angle will always be chosen'");
 
+            TwAddVarRW(bar_, "Seed", TW_TYPE_UINT32, &seed_,
+                "Help='Seed of the random angles and weighted rules, the same seed always gives the same tree'");
+
             TwAddSeparator(bar_, "Buttons", "");
 
             TwAddButton(bar_, "Generate", Generate, NULL, "");
 
+            TwAddVarRO(bar_, "Generating", TW_TYPE_BOOLCPP, &generating_,
+                "Help='A new tree is being built in the background, changing the preset or iterations starts again'");
+            TwAddVarRO(bar_, "Symbols", TW_TYPE_DOUBLE, &progressSymbols_,
+                "Precision=0 Help='Symbols derived so far by the generation in progress'");
+            TwAddVarRO(bar_, "Vertices", TW_TYPE_INT32, &progressVertices_,
+                "Help='Vertices emitted so far by the generation in progress'");
+
+            TwAddSeparator(bar_, "Prefetch", "");
+
+            TwAddVarRW(bar_, "Prefetch", TW_TYPE_BOOLCPP, &prefetch_,
+                "Help='Builds the iterations either side and the neighbouring presets while nothing else is generating'");
+            TwAddVarRW(bar_, "Prefetch meshes", TW_TYPE_BOOLCPP, &prefetchMeshes_,
+                "Help='Prefetches whole meshes rather than only deriving the levels'");
+            TwAddVarRW(bar_, "Cache budget MB", TW_TYPE_INT32, &cacheBudget_,
+                "Min=1 Help='Memory kept for finished meshes, the least recently shown are dropped first'");
+            TwAddVarRW(bar_, "Disk cache MB", TW_TYPE_INT32, &diskBudget_,
+                "Min=0 Help='Disk space kept for derived levels and meshes between runs, 0 turns the disk cache off and empties it'");
+            TwAddVarRO(bar_, "Cached MB", TW_TYPE_DOUBLE, &cachedMegabytes_, "Precision=1");
+            TwAddVarRO(bar_, "Prefetching", TW_TYPE_BOOLCPP, &prefetching_, "");
+
             const int num = 8;
             TwEnumVal presets[num] =
             {
@@ -1233,6 +8801,8 @@ namespace octet {
 
             files_.resize(num);
             lSys_.resize(num);
+            infos_.resize(num);
+            levels_.resize(num);
 
             TwType eNum = TwDefineEnum("Presets", presets, num);
 
@@ -1253,9 +8823,14 @@ namespace octet {
             files_[7] = "Dragon.txt";
 
 
+            disk_.Open("lsystem_cache", (unsigned long long)diskBudget_ << 20);
             for (int i = 0; i < files_.size(); ++i)
             {
                 import_.Load(&lSys_[i], files_[i].c_str());
+                lSys_[i].SetRewriteMode(LSystem::REWRITE_PARALLEL);
+                lSys_[i].SetThreadPool(&pool_);
+                lSys_[i].SetRetention(LSystem::RETAIN_ALL, 0, 256 << 20);
+                lSys_[i].SetTurtleLowering(lowered_ && !parallelTurtle_);
                 if (lSys_[i].GetDrawInfo())
                 {
                     drawInfo_.Combine(lSys_[i].GetDrawInfo());
@@ -1266,25 +8841,46 @@ namespace octet {
                     lSys_[i].SetDrawInfo(new LSystemDrawInfo());
                     memcpy(lSys_[i].GetDrawInfo(), &drawInfo_, sizeof(drawInfo_));
                 }
-                lSys_[i].Iterate(numIterations_);
+                infos_[i] = *lSys_[i].GetDrawInfo();
+                SeekCached(&lSys_[i], &disk_, numIterations_);
+                levels_[i] = numIterations_;
+                lSys_[i].SetProgress(generator_.GetProgress());
             }
             
             //visi.Visualize(&draw3D);
             mesh_instance *inst;
             ref<param_shader> sh = new param_shader("shaders/default.vs", "shaders/gradient.fs");
+            LSystemInstancedMesh data;
+            unsigned long long diskKey = DiskKey(&lSys_[0], numIterations_, is3D_, instancing_);
+            bool stored = disk_.LoadMesh(diskKey, data);
             if (is3D_)
             {
-                lSys_[0].Visualize(&draw3D_);
+                if (!stored)
+                {
+                    draw3D_.SetInstancing(instancing_);
+                    parallelTurtle_ ? lSys_[0].VisualizeParallel(&draw3D_) : lSys_[0].Visualize(&draw3D_);
+                    draw3D_.TakeInstanced(data);
+                }
+                draw3D_.Upload(data);
                 inst = new mesh_instance(new scene_node(), draw3D_.GetMesh(), new material(vec4(1, 0, 0, 1), sh));
                 drawInfo_ = *lSys_[0].GetDrawInfo();
             }
             else
             {
-                lSys_[0].Visualize(&draw2D_);
+                if (!stored)
+                {
+                    lSys_[0].Visualize(&draw2D_);
+                    draw2D_.Take(data.root);
+                }
+                draw2D_.Upload(data.root);
                 inst = new mesh_instance(new scene_node(), draw2D_.GetMesh(), new material(vec4(1, 0, 0, 1), sh));
                 drawInfo_ = *lSys_[0].GetDrawInfo();
             }
 
+            if (!stored)disk_.StoreMesh(diskKey, data);
+            shownKey_ = MeshKey(0, numIterations_, is3D_);
+            cache_.Insert(shownKey_, data);
+
             camera.init(this, 1000, 100.0f);
             
             glLineWidth(1.0f);
@@ -1305,39 +8901,65 @@ namespace octet {
                 regenerate_ = true;
             }
 
+            if (oldFile_ != fileChoice_)
+            {
+                drawInfo_ = infos_[fileChoice_];
+                oldFile_ = fileChoice_;
+            }
             if (regenerate_)
             {
-                if (oldFile_ != fileChoice_)
-                {
-                    drawInfo_ = *lSys_[fileChoice_].GetDrawInfo();
-                    oldFile_ = fileChoice_;
-                }
-                else
-                {
-                   
-                    *lSys_[fileChoice_].GetDrawInfo() = drawInfo_;
-                }
-                s_ = lSys_[fileChoice_].GetCurrentState();
-                if (s_->level > numIterations_)
+                infos_[fileChoice_] = drawInfo_;
+                appliedSeed_ = seed_;
+                regenerate_ = false;
+            }
+
+            cache_.SetBudget((size_t)cacheBudget_ << 20);
+            disk_.SetLimit((unsigned long long)diskBudget_ << 20);
+            unsigned long long wanted = MeshKey(fileChoice_, numIterations_, is3D_);
+            if (wanted != shownKey_)
+            {
+                //the last mesh is drawn until this one is in the cache, the GL upload has to happen on this thread
+                bool shown = cache_.Use(wanted, [&](const LSystemInstancedMesh& data)
                 {
-                    lSys_[fileChoice_].Decrement(s_->level - numIterations_);
-                }
-                if (s_->level < numIterations_)
+                    if (is3D_)
+                    {
+                        draw3D_.Upload(data);
+                        app_scene->get_mesh_instance(0)->set_mesh(draw3D_.GetMesh());
+                    }
+                    else
+                    {
+                        draw2D_.Upload(data.root);
+                        app_scene->get_mesh_instance(0)->set_mesh(draw2D_.GetMesh());
+                    }
+                });
+                if (shown)
                 {
-                    lSys_[fileChoice_].Iterate(numIterations_ - s_->level);
+                    shownKey_ = wanted;
                 }
-                regenerate_ = false;
-                if (is3D_)
+                else if (jobKey_ != wanted || !jobMeshes_ || !generator_.IsBusy())
                 {
-                    lSys_[fileChoice_].Visualize(&draw3D_);
-                    app_scene->get_mesh_instance(0)->set_mesh(draw3D_.GetMesh());
+                    //whatever is running is out of date, starting cancels it
+                    StartJob(fileChoice_, numIterations_, false);
                 }
                 else
                 {
-                    lSys_[fileChoice_].Visualize(&draw2D_);
-                    app_scene->get_mesh_instance(0)->set_mesh(draw2D_.GetMesh());
+                    //a prefetch of this mesh is already under way
+                    jobPrefetch_ = false;
                 }
             }
+            else if (prefetch_ && !generator_.IsBusy())
+            {
+                Prefetch();
+            }
+
+            LSystemProgress* progress = generator_.GetProgress();
+            bool busy = generator_.IsBusy();
+            generating_ = busy && !jobPrefetch_;
+            prefetching_ = busy && jobPrefetch_;
+            progressSymbols_ = (double)progress->symbols;
+            progressVertices_ = progress->vertices;
+            cachedMegabytes_ = cache_.GetBytes() / (1024.0 * 1024.0);
+
             camera.update(app_scene->get_camera_instance(0)->get_node()->access_nodeToParent());
             // update matrices. assume 30 fps.
             app_scene->update(1.0f / 30);
@@ -16,6 +16,11 @@
 
 /// Create a box with octet
 int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "-bench") == 0) {
+    LSystemBenchmark::Run();
+    return 0;
+  }
+
   // set up the platform.
   octet::app::init_all(argc, argv);
 